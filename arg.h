@@ -35,4 +35,12 @@ extern char *argv0;
 				}\
 			}
 
+#define ARGC()		argc_
+
+#define ARGF()		((argv[0][1] == '\0' && argv[1] == NULL)?\
+				(char *)0 :\
+				(brk_ = 1, (argv[0][1] != '\0')?\
+					(&argv[0][1]) :\
+					(argc--, argv++, argv[0])))
+
 #endif
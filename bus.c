@@ -1,14 +1,28 @@
 /* See LICENSE file for copyright and license details. */
 #include "bus.h"
 
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/sem.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
 #include <pwd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "arg.h"
@@ -27,11 +41,201 @@
  */
 char *argv0;
 
+/**
+ * The environment of the process
+ */
+extern char **environ;
+
 /**
  * The command to spawn when a message is received
  */
 static const char *command;
 
+/**
+ * The file descriptor received messages are streamed to
+ */
+static int stream_fd = -1;
+
+/**
+ * The byte written after each message that is streamed
+ */
+static char delimiter = '\n';
+
+/**
+ * The command line of the command to spawn when a message is received,
+ * `NULL` until `prepare_handler` has been called
+ */
+static char **handler_argv = NULL;
+
+/**
+ * The environment of spawned commands, `handler_env[handler_env_msg]`
+ * is reserved for `$msg`
+ */
+static char **handler_env = NULL;
+
+/**
+ * The index of `$msg` in `handler_env`
+ */
+static size_t handler_env_msg;
+
+/**
+ * The maximum number of concurrently running spawned commands, 0 if unlimited
+ */
+static long max_handlers = 0;
+
+/**
+ * The number of spawned commands that have not been reaped
+ */
+static long running_handlers = 0;
+
+/**
+ * Whether messages are dropped, rather than held until a spawned command
+ * has exited, when `max_handlers` commands are running
+ */
+static int drop_messages = 0;
+
+/**
+ * The name of the channel `bus accept` waits to be offered
+ */
+static const char *channel_name;
+
+/**
+ * The number of seconds the messages `bus broadcast`
+ * broadcasts remain relevant, negative if they never expire
+ */
+static double time_to_live = -1;
+
+/**
+ * Whether the messages `bus broadcast` broadcasts
+ * are retained under their key
+ */
+static int retain_messages = 0;
+
+/**
+ * A message `bus bridge` is broadcasting, shared between its
+ * processes so that the message is not forwarded back to where
+ * it came from
+ */
+struct echo
+{
+	/**
+	 * Non-zero while the message is being broadcasted
+	 * and it has not yet been received
+	 */
+	volatile sig_atomic_t pending;
+
+	/**
+	 * The hash of the message
+	 */
+	volatile uint32_t hash;
+
+	/**
+	 * The length of the message
+	 */
+	volatile size_t length;
+};
+
+/**
+ * The message being broadcasted by this process, or received
+ * by this process, that `bus bridge` shall not forward, `NULL`
+ * if all messages shall be forwarded
+ */
+static struct echo *echo = NULL;
+
+
+
+/**
+ * Prepare the command line and environment for spawned commands
+ * 
+ * @param   argv  The command line, `NULL`-terminated, or `NULL`
+ *                if `command` shall be run with sh(1)
+ * @return        0 on success, -1 on error
+ */
+static int
+prepare_handler(char **argv)
+{
+	static char *sh_argv[] = {"sh", "-c", NULL, NULL};
+	size_t i, n;
+
+	if (argv) {
+		handler_argv = argv;
+	} else {
+		sh_argv[2] = (char *)command;
+		handler_argv = sh_argv;
+	}
+
+	for (n = 0; environ[n]; n++);
+	handler_env = malloc((n + 2) * sizeof(char *));
+	if (!handler_env)
+		return -1;
+	for (i = n = 0; environ[i]; i++)
+		if (strncmp(environ[i], "msg=", 4))
+			handler_env[n++] = environ[i];
+	handler_env_msg = n;
+	handler_env[n + 1] = NULL;
+	return 0;
+}
+
+
+/**
+ * Reap spawned commands that have exited
+ * 
+ * @param   block  Whether to wait until at least one command has exited
+ * @return         0 on success, -1 on error
+ */
+static int
+reap_handlers(int block)
+{
+	pid_t pid;
+	while (running_handlers) {
+		pid = waitpid(-1, NULL, block ? 0 : WNOHANG);
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ECHILD)
+				return -1;
+			running_handlers = 0;
+		} else if (!pid) {
+			break;
+		} else {
+			running_handlers--;
+			block = 0;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Spawn a command because a message has been received
+ * 
+ * @param   message  The received message
+ * @return           0 on success, -1 on error
+ */
+static int
+spawn_handler(const char *message)
+{
+	static char msg[sizeof("msg=") + BUS_MEMORY_SIZE];
+	pid_t pid;
+
+	t(reap_handlers(0));
+	while (max_handlers && running_handlers >= max_handlers) {
+		if (drop_messages)
+			return 0;
+		t(reap_handlers(1));
+	}
+
+	stpcpy(stpcpy(msg, "msg="), message);
+	handler_env[handler_env_msg] = msg;
+	errno = posix_spawnp(&pid, handler_argv[0], NULL, NULL, handler_argv, handler_env);
+	if (errno)
+		goto fail;
+	running_handlers++;
+	return 0;
+
+fail:
+	return -1;
+}
 
 
 /**
@@ -44,15 +248,9 @@ static const char *command;
 static int
 spawn_continue(const char *message, void *user_data)
 {
-	pid_t pid;
 	if (!message)
 		return 1;
-	if ((pid = fork()))
-		return pid == -1 ? -1 : 1;
-	setenv("msg", message, 1);
-	execlp("sh", "sh", "-c", command, NULL);
-	perror(argv0);
-	exit(1);
+	return spawn_handler(message) ? -1 : 1;
 	(void) user_data;
 }
 
@@ -67,16 +265,307 @@ spawn_continue(const char *message, void *user_data)
 static int
 spawn_break(const char *message, void *user_data)
 {
-	pid_t pid;
 	if (!message)
 		return 1;
-	if ((pid = fork()))
-		return pid == -1 ? -1 : 0;
-	setenv("msg", message, 1);
+	return spawn_handler(message) ? -1 : 0;
+	(void) user_data;
+}
+
+
+/**
+ * Write a message, followed by `delimiter`, to `stream_fd`
+ * 
+ * @param   message    The received message
+ * @param   user_data  Not used
+ * @return             1 (continue listening) on success, 0 (stop listening)
+ *                     if the reading end has been closed, -1 on error
+ */
+static int
+stream_message(const char *message, void *user_data)
+{
+	static char buf[BUS_MEMORY_SIZE + 1];
+	size_t len, ptr;
+	ssize_t wrote;
+
+	if (!message)
+		return 1;
+
+	/* Write the message and the delimiter with one call, so
+	 * that the consumer can never observe half a message. */
+	len = strlen(message);
+	memcpy(buf, message, len);
+	buf[len++] = delimiter;
+	for (ptr = 0; ptr < len; ptr += (size_t)wrote) {
+		wrote = write(stream_fd, buf + ptr, len - ptr);
+		if (wrote < 0) {
+			if (errno == EINTR) {
+				wrote = 0;
+				continue;
+			}
+			return errno == EPIPE ? 0 : -1;
+		}
+	}
+	return 1;
+	(void) user_data;
+}
+
+
+/**
+ * Write a message read from the journal of a bus, like
+ * `stream_message`, but leave it unacknowledged, so that
+ * it is read again, if the reading end has been closed
+ * 
+ * @param   message    The read message
+ * @param   user_data  Not used
+ * @return             1 (continue reading) on success, -1 on error,
+ *                     with `errno` set to `EPIPE` if the reading
+ *                     end has been closed
+ */
+static int
+stream_journal_message(const char *message, void *user_data)
+{
+	int r = stream_message(message, user_data);
+	if (!r)
+		errno = EPIPE;
+	return r ? r : -1;
+}
+
+
+/**
+ * Start a command that messages are streamed to
+ * 
+ * @param   fdp  Output parameter for the file descriptor for the
+ *               write-end of the pipe to the command's stdin
+ * @return       The process ID of the command, -1 on error
+ */
+static pid_t
+spawn_stream(int *fdp)
+{
+	int fds[2];
+	pid_t pid;
+	if (pipe(fds))
+		return -1;
+	if ((pid = fork())) {
+		close(fds[0]);
+		if (pid == -1)
+			close(fds[1]);
+		else
+			*fdp = fds[1];
+		return pid;
+	}
+	close(fds[1]);
+	if (fds[0] != STDIN_FILENO) {
+		if (dup2(fds[0], STDIN_FILENO) == -1)
+			goto fail;
+		close(fds[0]);
+	}
 	execlp("sh", "sh", "-c", command, NULL);
+fail:
 	perror(argv0);
 	exit(1);
-	(void) user_data;
+}
+
+
+/**
+ * Get the FNV-1a hash of a message
+ * 
+ * @param   message  The message
+ * @param   len      The length of the message
+ * @return           The hash of the message
+ */
+static uint32_t
+hash_message(const char *message, size_t len)
+{
+	uint32_t h = 2166136261UL;
+	while (len--)
+		h = (h ^ (unsigned char)*message++) * 16777619UL;
+	return h;
+}
+
+
+/**
+ * Get the time a number of seconds from now
+ * 
+ * @param   deadline  Output parameter for the time, measured
+ *                    with the monotonic clock
+ * @param   seconds   The number of seconds
+ * @return            0 on success, -1 on error
+ */
+static int
+deadline_after(struct timespec *deadline, double seconds)
+{
+	if (clock_gettime(CLOCK_MONOTONIC, deadline))
+		return -1;
+	deadline->tv_sec += (time_t)seconds;
+	deadline->tv_nsec += (long)((seconds - (double)(time_t)seconds) * 1e9);
+	if (deadline->tv_nsec >= 1000000000L)
+		deadline->tv_sec += 1, deadline->tv_nsec -= 1000000000L;
+	return 0;
+}
+
+
+/**
+ * Broadcast a message, that expires after `time_to_live`
+ * seconds unless it is negative, and retain it under
+ * its key if `retain_messages` is non-zero
+ * 
+ * @param   bus      Bus information
+ * @param   key      The key to broadcast the message with, see
+ *                   `bus_write_keyed`, `NULL` to broadcast it without key
+ * @param   message  The message
+ * @param   flags    `BUS_NOWAIT` if the function shall fail if
+ *                   another process is currently broadcasting
+ * @return           0 on success, -1 on error
+ */
+static int
+broadcast_message(const bus_t *bus, const char *key, const char *message, int flags)
+{
+	struct timespec expires;
+	if (retain_messages)
+		return bus_write_retained(bus, key, message, flags);
+	if (time_to_live < 0)
+		return key ? bus_write_keyed(bus, key, message, flags) : bus_write(bus, message, flags);
+	if (deadline_after(&expires, time_to_live))
+		return -1;
+	return bus_write_expiring(bus, key, message, &expires, CLOCK_MONOTONIC, flags);
+}
+
+
+/**
+ * Broadcast messages read from a file, each message
+ * shall be terminated by `delimiter`
+ * 
+ * @param   bus    Bus information
+ * @param   fd     The file descriptor to read the messages from
+ * @param   batch  Whether consecutive messages that are read at the
+ *                 same time shall be broadcasted together, as one
+ *                 newline-separated message, if they fit
+ * @param   key    The key to broadcast the messages with, see
+ *                 `bus_write_keyed`, `NULL` to broadcast them without key
+ * @param   flags  `BUS_NOWAIT` if the function shall fail if
+ *                 another process is currently broadcasting
+ * @return         0 on success, -1 on error
+ */
+static int
+broadcast_stream(const bus_t *bus, int fd, int batch, const char *key, int flags)
+{
+	static char buf[1 << 16];
+	size_t len = 0, off;
+	char *msg, *end, *next;
+	ssize_t got;
+	int eof = 0;
+
+	while (!eof) {
+		got = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		eof = !got;
+		len += (size_t)got;
+		if (eof && len && buf[len - 1] != delimiter)
+			buf[len++] = delimiter;
+
+		for (off = 0; (end = memchr(msg = buf + off, delimiter, len - off)); off = (size_t)(end + 1 - buf)) {
+			if (batch)
+				while ((next = memchr(end + 1, delimiter, len - (size_t)(end + 1 - buf))) &&
+				       (next - msg < BUS_MEMORY_SIZE))
+					end = next;
+			if (end - msg >= BUS_MEMORY_SIZE)
+				return errno = EMSGSIZE, -1;
+			*end = '\0';
+			if (echo) {
+				echo->hash = hash_message(msg, (size_t)(end - msg));
+				echo->length = (size_t)(end - msg);
+				echo->pending = 1;
+			}
+			if (broadcast_message(bus, key, msg, flags))
+				return -1;
+			if (echo)
+				echo->pending = 0;
+		}
+
+		memmove(buf, buf + off, len -= off);
+		if (len >= BUS_MEMORY_SIZE)
+			return errno = EMSGSIZE, -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Accept a channel named `channel_name`, if the
+ * message offers it, for `bus_read`
+ * 
+ * @param   message    The received message
+ * @param   user_data  Output parameter for the accepted channel
+ * @return             0 (stop listening) if the channel was accepted,
+ *                     1 (continue listening) if the message is not such an
+ *                     offer or it was already accepted, -1 on error
+ */
+static int
+accept_offer(const char *message, void *user_data)
+{
+	const char *p;
+
+	if (!message)
+		return 1;
+
+	/* The offer is "<pid> channel <id> <name>". */
+	if (!(p = strchr(message, ' ')) || strncmp(p, " channel ", sizeof(" channel ") - 1))
+		return 1;
+	if (!(p = strchr(p + sizeof(" channel ") - 1, ' ')) || strcmp(p + 1, channel_name))
+		return 1;
+	if (bus_channel_accept(message, user_data))
+		return errno == ENOENT ? 1 : -1;
+	return 0;
+}
+
+
+/**
+ * Send lines from a file over a channel
+ * 
+ * @param   channel  The channel
+ * @param   fd       The file descriptor to read from
+ * @return           0 on success, -1 on error
+ */
+static int
+send_stream(const bus_channel_t *channel, int fd)
+{
+	static char buf[1 << 16];
+	size_t len = 0, off;
+	char *msg, *end;
+	ssize_t got;
+	int eof = 0;
+
+	while (!eof) {
+		got = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		eof = !got;
+		len += (size_t)got;
+		if (eof && len && buf[len - 1] != '\n')
+			buf[len++] = '\n';
+
+		for (off = 0; (end = memchr(msg = buf + off, '\n', len - off)); off = (size_t)(end + 1 - buf)) {
+			if (end - msg >= BUS_MEMORY_SIZE)
+				return errno = EMSGSIZE, -1;
+			*end = '\0';
+			if (bus_channel_send(channel, msg, 0))
+				return -1;
+		}
+
+		memmove(buf, buf + off, len -= off);
+		if (len >= BUS_MEMORY_SIZE)
+			return errno = EMSGSIZE, -1;
+	}
+
+	return 0;
 }
 
 
@@ -266,111 +755,2516 @@ parse_owner(char *str, uid_t *uid, gid_t *gid)
 }
 
 
-
 /**
- * Main function of the command line interface for the bus system
+ * Parse a comma-separated list of partitions
  * 
- * @param   argc  The number of elements in `argv`
- * @param   argv  The command. Valid commands:
- *                  <argv0> create [-x] [--] [<path>]             # create a bus
- *                  <argv0> remove [--] <path>                    # remove a bus
- *                  <argv0> listen [--] <path> <command>          # listen for new messages
- *                  <argv0> wait [--] <path> <command>            # listen for one new message
- *                  <argv0> broadcast [-n] [--] <path> <message>  # broadcast a message
- *                  <argv0> chmod [--] <mode> <path>              # change permissions
- *                  <argv0> chown [--] <owner>[:<group>] <path>   # change ownership
- *                  <argv0> chgrp [--] <group> <path>             # change group
- *                <command> will be spawned with $arg set to the message
- * @return        0 on sucess, 1 on error, 2 on invalid command
+ * @param   str         The list
+ * @param   partitions  Output parameter for the partitions,
+ *                      bit `i` is set for partition `i`
+ * @return              0 on success, -1 on error
  */
-int
-main(int argc, char *argv[])
+static int
+parse_partitions(const char *str, uint64_t *partitions)
 {
-	int xflag = 0;
-	int nflag = 0;
-	bus_t bus;
-	char *file;
-	struct stat attr;
-	uid_t uid;
-	gid_t gid;
-	mode_t mode_andnot, mode_or;
+	char *end;
+	long i;
 
-	/* Parse arguments. */
-	ARGBEGIN {
-	case 'x':
-		xflag = 1;
-		break;
-	case 'n':
-		nflag = 1;
-		break;
-	default:
-		return 2;
-	} ARGEND;
+	for (*partitions = 0;; str = end + 1) {
+		if (!isdigit((unsigned char)*str))
+			break;
+		errno = 0;
+		i = strtol(str, &end, 10);
+		if (errno || i >= BUS_MAX_PARTITIONS || (*end && *end != ','))
+			break;
+		*partitions |= (uint64_t)1 << i;
+		if (!*end)
+			return 0;
+	}
 
-	/* Check options. */
-	if (xflag && strcmp(argv[0], "create") && (argc != 2))
-		return 2;
-	if (nflag && strcmp(argv[0], "broadcast") && (argc != 3))
-		return 2;
+	errno = 0;
+	return -1;
+}
 
-	/* Create a new bus with selected name. */
-	if ((argc == 2) && !strcmp(argv[0], "create")) {
-		t(bus_create(argv[1], xflag * BUS_EXCL, NULL));
 
-	/* Create a new bus with random name. */
-	} else if ((argc == 1) && !strcmp(argv[0], "create")) {
-		t(bus_create(NULL, 0, &file));
-		printf("%s\n", file);
-		free(file);
 
-	/* Remove a bus. */
-	} else if ((argc == 2) && !strcmp(argv[0], "remove")) {
-		t(bus_unlink(argv[1]));
+/**
+ * Set when the time limit for `bus bench` has been exceeded
+ */
+static volatile sig_atomic_t timed_out = 0;
 
-	/* Listen on a bus in a loop. */
-	} else if ((argc == 3) && !strcmp(argv[0], "listen")) {
-		command = argv[2];
-		t(bus_open(&bus, argv[1], BUS_RDONLY));
-		t(bus_read(&bus, spawn_continue, NULL));
-		t(bus_close(&bus));
+/**
+ * The file descriptor listeners started by `bus bench`
+ * use to announce that they are listening
+ */
+static int bench_ready_fd = -1;
+
+/**
+ * The maximum number of samples a listener started by `bus bench` may collect
+ */
+static size_t bench_max_samples = 0;
+
+
+/**
+ * The signal, that `bus bridge` shall terminate because of, 0 if none
+ */
+static volatile sig_atomic_t caught_signal = 0;
+
+
+/**
+ * Signal handler for `SIGALRM` used by `bus bench`
+ * 
+ * @param  signo  The signal
+ */
+static void
+alarm_handler(int signo)
+{
+	timed_out = 1;
+	(void) signo;
+}
+
+
+/**
+ * Signal handler for `SIGTERM`, `SIGINT` and `SIGHUP` used by `bus bridge`
+ * 
+ * @param  signo  The signal
+ */
+static void
+terminate_handler(int signo)
+{
+	caught_signal = signo;
+}
+
+
+/**
+ * Get the current time, in nanoseconds, of the monotonic clock
+ * 
+ * @return  The current time
+ */
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+/**
+ * Read exactly `n` bytes, or until end of file
+ * 
+ * @param   fd   The file descriptor to read from
+ * @param   buf  Output buffer
+ * @param   n    The number of bytes to read
+ * @return       The number of read bytes, -1 on error
+ */
+static ssize_t
+read_fully(int fd, void *buf, size_t n)
+{
+	size_t ptr = 0;
+	ssize_t got;
+	while (ptr < n) {
+		got = read(fd, (char *)buf + ptr, n - ptr);
+		if (got < 0)
+			return -1;
+		if (!got)
+			break;
+		ptr += (size_t)got;
+	}
+	return (ssize_t)ptr;
+}
+
+
+/**
+ * Write exactly `n` bytes
+ * 
+ * @param   fd   The file descriptor to write to
+ * @param   buf  The bytes to write
+ * @param   n    The number of bytes to write
+ * @return       0 on success, -1 on error
+ */
+static int
+write_fully(int fd, const void *buf, size_t n)
+{
+	size_t ptr = 0;
+	ssize_t wrote;
+	while (ptr < n) {
+		wrote = write(fd, (const char *)buf + ptr, n - ptr);
+		if (wrote < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		ptr += (size_t)wrote;
+	}
+	return 0;
+}
+
+
+/**
+ * Samples collected by a process started by `bus bench`
+ */
+struct samples
+{
+	/**
+	 * The number of collected samples
+	 */
+	size_t n;
+
+	/**
+	 * The collected samples, in nanoseconds
+	 */
+	uint64_t *v;
+};
+
+
+/**
+ * Add a sample
+ * 
+ * @param   samples  The samples
+ * @param   value    The sample to add
+ * @return           0 on success, -1 on error
+ */
+static int
+add_sample(struct samples *samples, uint64_t value)
+{
+	uint64_t *new;
+	if (!(samples->n & (samples->n - 1))) {
+		new = realloc(samples->v, (samples->n ? 2 * samples->n : 1) * sizeof(*new));
+		if (!new)
+			return -1;
+		samples->v = new;
+	}
+	samples->v[samples->n++] = value;
+	return 0;
+}
+
+
+/**
+ * Send samples to the parent process
+ * 
+ * @param   fd       The file descriptor to send the samples over
+ * @param   samples  The samples
+ * @param   extra    Additional value to send before the samples
+ * @return           0 on success, -1 on error
+ */
+static int
+send_samples(int fd, const struct samples *samples, uint64_t extra)
+{
+	t(write_fully(fd, &extra, sizeof(extra)));
+	t(write_fully(fd, &samples->n, sizeof(samples->n)));
+	t(write_fully(fd, samples->v, samples->n * sizeof(*samples->v)));
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Receive samples from a child process and append them
+ * 
+ * @param   fd       The file descriptor to receive the samples from
+ * @param   samples  The samples to append to
+ * @param   extra    Output parameter for the additional value sent before the samples
+ * @return           0 on success, -1 on error
+ */
+static int
+receive_samples(int fd, struct samples *samples, uint64_t *extra)
+{
+	size_t n;
+	uint64_t *new;
+	if (read_fully(fd, extra, sizeof(*extra)) != (ssize_t)sizeof(*extra))
+		goto short_read;
+	if (read_fully(fd, &n, sizeof(n)) != (ssize_t)sizeof(n))
+		goto short_read;
+	new = realloc(samples->v, (samples->n + n + 1) * sizeof(*new));
+	if (!new)
+		return -1;
+	samples->v = new;
+	if (read_fully(fd, samples->v + samples->n, n * sizeof(*new)) != (ssize_t)(n * sizeof(*new)))
+		goto short_read;
+	samples->n += n;
+	return 0;
+short_read:
+	if (!errno)
+		errno = EPIPE;
+	return -1;
+}
+
+
+/**
+ * Compare two samples, for `qsort`
+ * 
+ * @param   a  One of the samples
+ * @param   b  The other sample
+ * @return     Negative if `*a < *b`, positive if `*a > *b`, otherwise 0
+ */
+static int
+sample_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Get a percentile of sorted samples
+ * 
+ * @param   samples  The samples, sorted in ascending order
+ * @param   p        The percentile, in per mille
+ * @return           The percentile, 0 if there are no samples
+ */
+static uint64_t
+percentile(const struct samples *samples, size_t p)
+{
+	size_t i;
+	if (!samples->n)
+		return 0;
+	i = (samples->n * p + 999) / 1000;
+	return samples->v[i ? i - 1 : 0];
+}
+
+
+/**
+ * Get the average of samples
+ * 
+ * @param   samples  The samples
+ * @return           The average, 0 if there are no samples
+ */
+static uint64_t
+average(const struct samples *samples)
+{
+	long double sum = 0;
+	size_t i;
+	for (i = 0; i < samples->n; i++)
+		sum += (long double)samples->v[i];
+	return samples->n ? (uint64_t)(sum / (long double)samples->n) : 0;
+}
+
+
+/**
+ * Callback for `bus_read` in listeners started by `bus bench`
+ * 
+ * @param   message    The received message
+ * @param   user_data  The delivery latencies, `struct samples *`
+ * @return             1 (continue listening), or 0 (stop listening) when
+ *                     the benchmark is over
+ */
+static int
+bench_listen(const char *message, void *user_data)
+{
+	struct samples *latencies = user_data;
+	uint64_t now = now_ns(), sent;
+	if (!message) {
+		write_fully(bench_ready_fd, "", 1);
+		close(bench_ready_fd);
+		return 1;
+	}
+	message = strchr(message, ' ');
+	if (!message || strncmp(message, " bench ", 7))
+		return 1;
+	message += 7;
+	if (!strncmp(message, "end", 3))
+		return 0;
+	sent = (uint64_t)strtoull(message, NULL, 10);
+	if (latencies->n < bench_max_samples)
+		latencies->v[latencies->n++] = now - sent;
+	return 1;
+}
+
+
+/**
+ * The `bench` command, measure the performance of a bus
+ * 
+ * @param   argc  The number of elements in `argv`
+ * @param   argv  The command line, `argv[0]` is the program's name
+ *                and the command itself is omitted
+ * @return        0 on sucess, 1 on error, 2 on invalid command
+ */
+static int
+bench(int argc, char *argv[])
+{
+	long writers = 1, listeners = 1, size = 64, rate = 0, messages = 10000, timeout = 60, partitions = 0;
+	int csv = 0, ready_fds[2] = {-1, -1}, start_fds[2] = {-1, -1}, status;
+	long *values[7], i, j;
+	int create_flags = 0;
+	char *arg, *end, *path = NULL, buf[BUS_MEMORY_SIZE], key[3 * sizeof(long) + 2];
+	const char *variant;
+	struct bus_state state;
+	int *result_fds = NULL;
+	pid_t *pids = NULL;
+	struct samples deliveries = {0, NULL}, calls = {0, NULL};
+	uint64_t start, stop = 0, extra, delivered = 0, lost;
+	struct sigaction sa;
+	double elapsed;
+	size_t len;
+	bus_t bus;
+	int saved_errno, r = 1;
+
+	bus.message = NULL;
+	values[0] = &writers, values[1] = &listeners, values[2] = &size;
+	values[3] = &rate, values[4] = &messages, values[5] = &timeout;
+	values[6] = &partitions;
+
+	ARGBEGIN {
+	case 'c':
+		csv = 1;
+		break;
+	case 'C':
+		create_flags |= BUS_CONCURRENT;
+		break;
+	case 'w': i = 0; goto number;
+	case 'l': i = 1; goto number;
+	case 's': i = 2; goto number;
+	case 'r': i = 3; goto number;
+	case 'm': i = 4; goto number;
+	case 't': i = 5; goto number;
+	case 'P': i = 6;
+	number:
+		if (!(arg = ARGF()) || !isdigit((unsigned char)*arg))
+			return 2;
+		errno = 0;
+		*values[i] = strtol(arg, &end, 10);
+		if (errno || *end)
+			return 2;
+		break;
+	default:
+		return 2;
+	} ARGEND;
+	if ((argc > 1) || !writers || !messages || !timeout || (size >= BUS_MEMORY_SIZE) ||
+	    (partitions > BUS_MAX_PARTITIONS) ||
+	    (partitions > 1 && (create_flags & BUS_CONCURRENT)))
+		return 2;
+	if (partitions > 1)
+		create_flags |= BUS_PARTITIONS(partitions);
+	if (argc && create_flags)
+		return 2;
+
+	/* Create the bus, unless one was specified, and
+	 * make sure that the benchmark terminates. */
+	if (argc) {
+		t(bus_open(&bus, argv[0], BUS_WRONLY));
+	} else {
+		t(bus_create(NULL, create_flags, &path));
+		t(bus_open(&bus, path, BUS_WRONLY));
+	}
+	t(bus_state(&bus, &state));
+	variant = state.partitions > 1 ? "partitioned" : !bus.map ? (bus.synchronous ? "synchronous" : "default") :
+	          state.slots > 1 ? "concurrent" : "mapped";
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = alarm_handler;
+	t(sigaction(SIGALRM, &sa, NULL));
+	alarm((unsigned int)timeout);
+
+	pids = calloc((size_t)(writers + listeners), sizeof(*pids));
+	result_fds = malloc((size_t)(writers + listeners) * sizeof(*result_fds));
+	if (!pids || !result_fds)
+		goto fail;
+	for (i = 0; i < writers + listeners; i++)
+		result_fds[i] = -1;
+
+	/* Start the listeners and wait until they are listening. */
+	t(pipe(ready_fds));
+	for (i = 0; i < listeners; i++) {
+		int fds[2];
+		t(pipe(fds));
+		t(pids[i] = fork());
+		if (!pids[i]) {
+			close(fds[0]);
+			close(ready_fds[0]);
+			bench_ready_fd = ready_fds[1];
+			bench_max_samples = (size_t)(writers * messages);
+			deliveries.v = malloc(bench_max_samples * sizeof(*deliveries.v));
+			if (!deliveries.v || bus_read(&bus, bench_listen, &deliveries) || send_samples(fds[1], &deliveries, 0)) {
+				if (errno != EIDRM)
+					perror(argv0);
+				_exit(1);
+			}
+			_exit(0);
+		}
+		close(fds[1]);
+		result_fds[i] = fds[0];
+	}
+	close(ready_fds[1]), ready_fds[1] = -1;
+	for (i = 0; i < listeners; i++)
+		if (read_fully(ready_fds[0], buf, 1) != 1)
+			goto fail;
+
+	/* Start the writers, and let them start broadcasting at the same time. */
+	t(pipe(start_fds));
+	for (; i < listeners + writers; i++) {
+		int fds[2];
+		t(pipe(fds));
+		t(pids[i] = fork());
+		if (!pids[i]) {
+			struct timespec next;
+			uint64_t t0, t1, period = rate ? 1000000000ULL / (uint64_t)rate : 0;
+			close(fds[0]);
+			close(start_fds[1]);
+			calls.v = malloc((size_t)messages * sizeof(*calls.v));
+			if (!calls.v || read_fully(start_fds[0], buf, 1) < 0)
+				goto child_fail;
+			/* On a bus with partitions, each writer uses its own key. */
+			sprintf(key, "%li", i - listeners);
+			start = now_ns();
+			for (j = 0; j < messages; j++) {
+				if (period) {
+					t0 = start + (uint64_t)j * period;
+					next.tv_sec = (time_t)(t0 / 1000000000ULL);
+					next.tv_nsec = (long)(t0 % 1000000000ULL);
+					clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+				}
+				t0 = now_ns();
+				len = (size_t)sprintf(buf, "%ji bench %llu ", (intmax_t)getpid(), (unsigned long long)t0);
+				if ((long)len < size) {
+					memset(buf + len, 'x', (size_t)size - len);
+					len = (size_t)size;
+				}
+				buf[len] = '\0';
+				if (bus_write_keyed(&bus, key, buf, 0))
+					goto child_fail;
+				t1 = now_ns();
+				calls.v[calls.n++] = t1 - t0;
+			}
+			if (send_samples(fds[1], &calls, now_ns()))
+				goto child_fail;
+			_exit(0);
+		child_fail:
+			if (errno != EIDRM)
+				perror(argv0);
+			_exit(1);
+		}
+		close(fds[1]);
+		result_fds[i] = fds[0];
+	}
+	start = now_ns();
+	close(start_fds[1]), start_fds[1] = -1;
+
+	/* Collect the durations of the `bus_write` calls, then stop the listeners,
+	 * and collect the latencies from broadcast to delivery. */
+	for (i = listeners; i < listeners + writers; i++) {
+		t(receive_samples(result_fds[i], &calls, &extra));
+		stop = extra > stop ? extra : stop;
+	}
+	sprintf(buf, "0 bench end");
+	t(bus_write(&bus, buf, 0));
+	for (i = 0; i < listeners; i++) {
+		len = deliveries.n;
+		t(receive_samples(result_fds[i], &deliveries, &extra));
+		delivered += (uint64_t)(deliveries.n - len);
+	}
+	alarm(0);
+	for (i = 0; i < listeners + writers; i++) {
+		while (waitpid(pids[i], &status, 0) == -1)
+			if (errno != EINTR)
+				goto fail;
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			goto fail;
+		pids[i] = 0;
+	}
+
+	/* Report. */
+	qsort(calls.v, calls.n, sizeof(*calls.v), sample_cmp);
+	qsort(deliveries.v, deliveries.n, sizeof(*deliveries.v), sample_cmp);
+	elapsed = (double)(stop - start) / 1e9;
+	lost = (uint64_t)(listeners * writers * messages) - delivered;
+	if (csv) {
+		printf("variant,writers,listeners,size,rate,messages,lost,seconds,messages_per_second,bytes_per_second");
+		printf(",delivery_min_ns,delivery_p50_ns,delivery_p90_ns,delivery_p99_ns,delivery_p999_ns,delivery_max_ns,delivery_mean_ns");
+		printf(",write_min_ns,write_p50_ns,write_p90_ns,write_p99_ns,write_p999_ns,write_max_ns,write_mean_ns\n");
+		printf("%s,%li,%li,%li,%li,%li,%llu,%.6f,%.0f,%.0f", variant, writers, listeners, size, rate,
+		       writers * messages, (unsigned long long)lost, elapsed,
+		       (double)calls.n / elapsed, (double)calls.n * (double)size / elapsed);
+		printf(",%llu,%llu,%llu,%llu,%llu,%llu,%llu",
+		       (unsigned long long)percentile(&deliveries, 0), (unsigned long long)percentile(&deliveries, 500),
+		       (unsigned long long)percentile(&deliveries, 900), (unsigned long long)percentile(&deliveries, 990),
+		       (unsigned long long)percentile(&deliveries, 999), (unsigned long long)percentile(&deliveries, 1000),
+		       (unsigned long long)average(&deliveries));
+		printf(",%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+		       (unsigned long long)percentile(&calls, 0), (unsigned long long)percentile(&calls, 500),
+		       (unsigned long long)percentile(&calls, 900), (unsigned long long)percentile(&calls, 990),
+		       (unsigned long long)percentile(&calls, 999), (unsigned long long)percentile(&calls, 1000),
+		       (unsigned long long)average(&calls));
+	} else {
+		printf("variant:     %s\n", variant);
+		printf("writers:     %li\n", writers);
+		printf("listeners:   %li\n", listeners);
+		printf("size:        %li bytes\n", size);
+		if (rate)
+			printf("rate:        %li messages/s per writer\n", rate);
+		else
+			printf("rate:        unlimited\n");
+		printf("messages:    %li (%llu lost)\n", writers * messages, (unsigned long long)lost);
+		printf("elapsed:     %.3f s\n", elapsed);
+		printf("throughput:  %.0f messages/s, %.0f kB/s\n",
+		       (double)calls.n / elapsed, (double)calls.n * (double)size / elapsed / 1000);
+		printf("\n%-16s %10s %10s %10s %10s %10s %10s %10s\n",
+		       "latency (us)", "min", "p50", "p90", "p99", "p99.9", "max", "mean");
+		printf("%-16s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", "delivery",
+		       (double)percentile(&deliveries, 0) / 1000, (double)percentile(&deliveries, 500) / 1000,
+		       (double)percentile(&deliveries, 900) / 1000, (double)percentile(&deliveries, 990) / 1000,
+		       (double)percentile(&deliveries, 999) / 1000, (double)percentile(&deliveries, 1000) / 1000,
+		       (double)average(&deliveries) / 1000);
+		printf("%-16s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", "bus_write",
+		       (double)percentile(&calls, 0) / 1000, (double)percentile(&calls, 500) / 1000,
+		       (double)percentile(&calls, 900) / 1000, (double)percentile(&calls, 990) / 1000,
+		       (double)percentile(&calls, 999) / 1000, (double)percentile(&calls, 1000) / 1000,
+		       (double)average(&calls) / 1000);
+	}
+	if (fflush(stdout))
+		goto fail;
+	r = 0;
+
+fail:
+	saved_errno = timed_out ? ETIMEDOUT : errno;
+	alarm(0);
+	bus_close(&bus);
+	if (path)
+		bus_unlink(path);
+	for (i = 0; pids && i < listeners + writers; i++) {
+		if (pids[i] > 0) {
+			kill(pids[i], SIGTERM);
+			waitpid(pids[i], NULL, 0);
+		}
+	}
+	for (i = 0; result_fds && i < listeners + writers; i++)
+		if (result_fds[i] >= 0)
+			close(result_fds[i]);
+	if (ready_fds[0] >= 0)  close(ready_fds[0]);
+	if (ready_fds[1] >= 0)  close(ready_fds[1]);
+	if (start_fds[0] >= 0)  close(start_fds[0]);
+	if (start_fds[1] >= 0)  close(start_fds[1]);
+	free(path);
+	free(pids);
+	free(result_fds);
+	free(calls.v);
+	free(deliveries.v);
+	if (r) {
+		errno = saved_errno;
+		perror(argv0);
+	}
+	return r;
+}
+
+
+/**
+ * Get the upper bound of a percentile of a histogram
+ * 
+ * @param   histogram  The histogram
+ * @param   p          The percentile, in per mille
+ * @return             The upper bound, in nanoseconds, of the bucket
+ *                     that contains the percentile, 0 if unbounded
+ */
+static uint64_t
+histogram_percentile(const struct bus_histogram *histogram, uint64_t p)
+{
+	uint64_t sum = 0, limit = (histogram->count * p + 999) / 1000;
+	int i;
+	for (i = 0; i < BUS_HISTOGRAM_BUCKETS - 1; i++)
+		if ((sum += histogram->buckets[i]) >= limit)
+			return (uint64_t)2 << i;
+	return 0;
+}
+
+
+/**
+ * Print a histogram, for the `stat` command
+ * 
+ * @param  name       The label of the histogram
+ * @param  histogram  The histogram
+ */
+static void
+print_histogram(const char *name, const struct bus_histogram *histogram)
+{
+	uint64_t p50 = histogram_percentile(histogram, 500);
+	uint64_t p99 = histogram_percentile(histogram, 990);
+	if (!histogram->count) {
+		printf("%s 0\n", name);
+		return;
+	}
+	printf("%s %ju, mean %.1f us", name, (uintmax_t)histogram->count,
+	       (double)histogram->total / (double)histogram->count / 1000);
+	if (p50)
+		printf(", p50 < %.1f us", (double)p50 / 1000);
+	if (p99)
+		printf(", p99 < %.1f us", (double)p99 / 1000);
+	printf("\n");
+}
+
+
+/**
+ * Print the decoded state of a bus, for the `stat` command
+ * 
+ * @param   bus  The bus
+ * @return       0 on success, -1 on error
+ */
+static int
+print_state(const bus_t *bus)
+{
+	static const char names[] = "SWXQN";
+	struct bus_stats stats;
+	struct bus_state state;
+	struct bus_listener listeners[BUS_REGISTRY_SLOTS];
+	struct passwd *pwd;
+	struct group *grp;
+	char date[64];
+	time_t when;
+	uint64_t now;
+	int i, n;
+
+	t(bus_state(bus, &state));
+
+	printf("listeners:       %lu (%lu waiting for a message, %lu acknowledging)\n",
+	       state.listeners, state.waiting_listeners, state.acknowledging);
+	if (state.broadcasting && state.unacknowledged)
+		printf("broadcasting:    yes (%lu listeners have not acknowledged)\n", state.unacknowledged);
+	else
+		printf("broadcasting:    %s\n", state.broadcasting ? "yes" : "no");
+	printf("waiting writers: %lu\n", state.waiting_writers);
+	if (state.semaphore_count) {
+		printf("semaphores:     ");
+		for (i = 0; i < state.semaphore_count; i++)
+			printf(" %c=%hu", names[i], state.semaphores[i]);
+		printf("\n");
+		printf("shared memory:   %zu bytes, %lu attachments\n", state.size, state.attached);
+	} else {
+		printf("mapped file:     %zu bytes\n", state.size);
+	}
+	pwd = getpwuid(state.uid);
+	grp = getgrgid(state.gid);
+	printf("owner:           %s (%ji)\n", pwd ? pwd->pw_name : "?", (intmax_t)state.uid);
+	printf("group:           %s (%ji)\n", grp ? grp->gr_name : "?", (intmax_t)state.gid);
+	printf("mode:            %04o\n", (unsigned)state.mode);
+	printf("creator:         %ji\n", (intmax_t)state.creator);
+	if (state.last_operation)
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&state.last_operation));
+	else
+		strcpy(date, "never");
+	printf("last operation:  %s\n", date);
+	if (state.semaphore_count)
+		printf("protocol:        %s\n", state.synchronous ? "synchronous" : "default");
+	else if (state.slots > 1)
+		printf("message slots:   %lu\n", state.slots);
+	if (state.partitions > 1)
+		printf("partitions:      %lu\n", state.partitions);
+	if (state.calls)
+		printf("pending calls:   %lu\n", state.calls);
+	if (state.sequence)
+		printf("sequence:        %ju\n", (uintmax_t)state.sequence);
+
+	if (!bus_stats(bus, &stats)) {
+		printf("messages:        %ju (%ju bytes, %ju failed)\n",
+		       (uintmax_t)stats.messages, (uintmax_t)stats.bytes, (uintmax_t)stats.failed);
+		printf("deliveries:      %ju\n", (uintmax_t)stats.deliveries);
+		printf("expired:         %ju\n", (uintmax_t)stats.expired);
+		print_histogram("lock wait:      ", &stats.lock);
+		print_histogram("broadcast:      ", &stats.broadcast);
+		print_histogram("acknowledge:    ", &stats.acknowledge);
+	} else if (errno != ENOTSUP) {
+		goto fail;
+	}
+
+	if ((n = bus_listeners(bus, listeners, sizeof(listeners) / sizeof(*listeners))) >= 0) {
+		now = (uint64_t)time(NULL) * 1000000000ULL;
+		printf("registered:      %i\n", n);
+		for (i = 0; i < n; i++) {
+			when = (time_t)(listeners[i].registered / 1000000000ULL);
+			strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&when));
+			printf("  %ji: since %s, received %ju, acknowledged %ju",
+			       (intmax_t)listeners[i].pid, date,
+			       (uintmax_t)listeners[i].received, (uintmax_t)listeners[i].acknowledged);
+			/* The sequence numbers of the partitions are independent. */
+			if (state.partitions == 1)
+				printf(", lag %ju", (uintmax_t)(state.sequence - listeners[i].acknowledged));
+			printf(", last acknowledgement %.1f s ago%s%s\n",
+			       now > listeners[i].acknowledged_at ? (double)(now - listeners[i].acknowledged_at) / 1e9 : 0.0,
+			       listeners[i].received > listeners[i].acknowledged ? ", processing" : "",
+			       listeners[i].alive ? "" : ", dead");
+		}
+	} else if (errno != ENOTSUP) {
+		goto fail;
+	}
+
+	return fflush(stdout) ? -1 : 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * The `top` command, continuously sample the state of a bus
+ * and print the message rate and the time writers wait
+ * 
+ * @param   argc  The number of elements in `argv`
+ * @param   argv  The command line, `argv[0]` is the program's name
+ *                and the command itself is omitted
+ * @return        0 on sucess, 1 on error, 2 on invalid command
+ */
+static int
+top(int argc, char *argv[])
+{
+	double interval = 1, rate, busy, queued, wait, duration;
+	int passive = 0, polling = 0, counted, saved_errno;
+	uint64_t next_sample, next_report, last_report, now, period = 10000000ULL;
+	unsigned long messages = 0, samples = 0, waiting = 0, broadcasting = 0;
+	unsigned long long bytes = 0;
+	struct bus_stats stats, last_stats;
+	struct bus_state state;
+	struct timespec deadline;
+	const char *message;
+	char *arg, *end;
+	bus_t bus;
+
+	bus.message = NULL;
+
+	ARGBEGIN {
+	case 'i':
+		if (!(arg = ARGF()) || !isdigit((unsigned char)*arg))
+			return 2;
+		errno = 0;
+		interval = strtod(arg, &end);
+		if (errno || *end || interval < 0.01)
+			return 2;
+		break;
+	case 'p':
+		passive = 1;
+		break;
+	default:
+		return 2;
+	} ARGEND;
+	if (argc != 1)
+		return 2;
+
+	/* If the bus maintains statistics, use them. Otherwise, unless
+	 * passive, listen on the bus so that messages can be counted;
+	 * the state is sampled in between. */
+	t(bus_open(&bus, argv[0], BUS_RDONLY));
+	counted = !bus_stats(&bus, &last_stats);
+	if (counted)
+		passive = 1;
+	else if (!passive) {
+		t(bus_poll_start(&bus));
+		polling = 1;
+	}
+
+	printf("%9s %9s %6s %10s %10s %10s %10s\n",
+	       "listeners", "writers", "busy", "msg/s", "kB/s", "wait ms", "bcast ms");
+	fflush(stdout);
+	last_report = now_ns();
+	next_sample = last_report + period;
+	next_report = last_report + (uint64_t)(interval * 1e9);
+
+	for (;;) {
+		deadline.tv_sec = (time_t)(next_sample / 1000000000ULL);
+		deadline.tv_nsec = (long)(next_sample % 1000000000ULL);
+		if (passive) {
+			while ((errno = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)))
+				if (errno != EINTR)
+					goto fail;
+		} else if ((message = bus_poll_timed(&bus, &deadline, CLOCK_MONOTONIC))) {
+			messages += 1;
+			bytes += strlen(message);
+			continue;
+		} else if (errno != EAGAIN) {
+			goto fail;
+		}
+
+		t(bus_state(&bus, &state));
+		samples += 1;
+		waiting += state.waiting_writers;
+		broadcasting += (unsigned long)state.broadcasting;
+		next_sample += period;
+
+		if ((now = now_ns()) < next_report)
+			continue;
+		rate = (double)messages * 1e9 / (double)(now - last_report);
+		busy = (double)broadcasting / (double)samples;
+		queued = (double)waiting / (double)samples;
+		/* By Little's law, the average time a writer waits is the
+		 * average number of waiting writers divided by the rate. */
+		wait = messages ? queued / rate * 1000 : 0;
+		duration = messages ? busy / rate * 1000 : 0;
+		if (counted) {
+			t(bus_stats(&bus, &stats));
+			messages = (unsigned long)(stats.messages - last_stats.messages);
+			bytes = (unsigned long long)(stats.bytes - last_stats.bytes);
+			rate = (double)messages * 1e9 / (double)(now - last_report);
+			if (messages) {
+				wait = (double)(stats.lock.total - last_stats.lock.total) /
+				       (double)(stats.lock.count - last_stats.lock.count) / 1e6;
+				duration = (double)(stats.broadcast.total - last_stats.broadcast.total) /
+				           (double)(stats.broadcast.count - last_stats.broadcast.count) / 1e6;
+			}
+			last_stats = stats;
+		}
+		printf("%9lu %9.1f %5.0f%%", state.listeners, queued, busy * 100);
+		if (passive && !counted)
+			printf(" %10s %10s %10s %10s\n", "-", "-", "-", "-");
+		else if (!messages)
+			printf(" %10.0f %10.1f %10s %10s\n", 0., 0., "-", "-");
+		else
+			printf(" %10.0f %10.1f %10.3f %10.3f\n", rate,
+			       (double)bytes * 1e9 / (double)(now - last_report) / 1000, wait, duration);
+		fflush(stdout);
+		messages = samples = waiting = broadcasting = 0;
+		bytes = 0;
+		last_report = now;
+		next_report += (uint64_t)(interval * 1e9);
+		if (next_sample < now)
+			next_sample = now + period;
+	}
+
+fail:
+	saved_errno = errno;
+	if (polling && bus_poll_stop(&bus))
+		polling = 0;
+	if (bus.message)
+		bus_close(&bus);
+	errno = saved_errno;
+	perror(argv0);
+	return 1;
+}
+
+
+/**
+ * The first bytes of a file made by `bus record`
+ */
+#define RECORDING_MAGIC  "\177BUSREC\n"
+
+/**
+ * The version of the format of files made by `bus record`
+ */
+#define RECORDING_VERSION  1
+
+/**
+ * The number of bytes a message in a recording is padded to
+ */
+#define RECORDING_ALIGN  8
+
+
+/**
+ * The header of a file made by `bus record`
+ */
+struct recording_header
+{
+	/**
+	 * `RECORDING_MAGIC`, without NUL-termination
+	 */
+	char magic[8];
+
+	/**
+	 * `RECORDING_VERSION`
+	 */
+	uint32_t version;
+
+	/**
+	 * Reserved, always 0
+	 */
+	uint32_t reserved;
+};
+
+
+/**
+ * The header of each message in a file made by `bus record`,
+ * the message follows directly, without NUL-termination, and
+ * padded with NUL bytes to a multiple of `RECORDING_ALIGN` bytes
+ */
+struct recorded_message
+{
+	/**
+	 * When the message was received, in nanoseconds,
+	 * measured with the monotonic clock
+	 */
+	uint64_t time;
+
+	/**
+	 * The length of the message
+	 */
+	uint32_t length;
+
+	/**
+	 * Reserved, always 0
+	 */
+	uint32_t reserved;
+};
+
+
+/**
+ * Append a message to the recording open on `stream_fd`,
+ * this function is used as a callback for `bus_read`
+ * 
+ * @param   message    The received message
+ * @param   user_data  Not used
+ * @return             1 (continue listening) on success, -1 on error
+ */
+static int
+record_message(const char *message, void *user_data)
+{
+	static char buf[sizeof(struct recorded_message) + BUS_MEMORY_SIZE + RECORDING_ALIGN];
+	struct recorded_message record;
+	size_t len;
+
+	if (!message)
+		return 1;
+
+	/* Write the record with one call, so that it is not
+	 * interleaved with a concurrent recording's records. */
+	memset(&record, 0, sizeof(record));
+	record.time = now_ns();
+	record.length = (uint32_t)strlen(message);
+	memcpy(buf, &record, sizeof(record));
+	len = sizeof(record);
+	memcpy(buf + len, message, (size_t)record.length);
+	len += (size_t)record.length;
+	while (len % RECORDING_ALIGN)
+		buf[len++] = '\0';
+	return write_fully(stream_fd, buf, len) ? -1 : 1;
+	(void) user_data;
+}
+
+
+/**
+ * Prepare a file for `bus record`, unless it already
+ * contains a recording, write the header
+ * 
+ * @param   fd  The file descriptor of the file
+ * @return      0 on success, -1 on error
+ */
+static int
+start_recording(int fd)
+{
+	struct recording_header header;
+	struct stat attr;
+	ssize_t got;
+
+	t(fstat(fd, &attr));
+	if (S_ISREG(attr.st_mode) && attr.st_size) {
+		got = pread(fd, &header, sizeof(header), 0);
+		if (got < 0 && errno == EBADF)
+			return 0;
+		t(got);
+		if ((size_t)got < sizeof(header) || memcmp(header.magic, RECORDING_MAGIC, 8) ||
+		    header.version != RECORDING_VERSION) {
+			errno = EBADMSG;
+			goto fail;
+		}
+		return 0;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RECORDING_MAGIC, 8);
+	header.version = RECORDING_VERSION;
+	return write_fully(fd, &header, sizeof(header));
+fail:
+	return -1;
+}
+
+
+/**
+ * The `replay` command, broadcast the messages in a
+ * file made by `bus record`
+ * 
+ * @param   argc  The number of elements in `argv`
+ * @param   argv  The command line, `argv[0]` is the program's name
+ *                and the command itself is omitted
+ * @return        0 on sucess, 1 on error, 2 on invalid command
+ */
+static int
+replay(int argc, char *argv[])
+{
+	double speed = 1;
+	int nowait = 0, fd = -1, saved_errno;
+	struct recording_header header;
+	struct recorded_message record;
+	char *arg, *end, *data = MAP_FAILED;
+	char buf[BUS_MEMORY_SIZE];
+	size_t off, padded, size = 0;
+	uint64_t first = 0, start = 0, due;
+	struct timespec deadline;
+	struct stat attr;
+	bus_t bus;
+
+	bus.message = NULL;
+
+	ARGBEGIN {
+	case 's':
+		if (!(arg = ARGF()) || !isdigit((unsigned char)*arg))
+			return 2;
+		errno = 0;
+		speed = strtod(arg, &end);
+		if (errno || *end)
+			return 2;
+		break;
+	case 'n':
+		nowait = 1;
+		break;
+	default:
+		return 2;
+	} ARGEND;
+	if (argc != 2)
+		return 2;
+
+	t(fd = open(argv[0], O_RDONLY));
+	t(fstat(fd, &attr));
+	size = (size_t)attr.st_size;
+	if (size < sizeof(header)) {
+		errno = EBADMSG;
+		goto fail;
+	}
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		goto fail;
+	close(fd), fd = -1;
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, RECORDING_MAGIC, 8) || header.version != RECORDING_VERSION) {
+		errno = EBADMSG;
+		goto fail;
+	}
+
+	t(bus_open(&bus, argv[1], BUS_WRONLY));
+
+	/* A trailing incomplete record, from a recording that was
+	 * interrupted while writing, is ignored, even if only its
+	 * padding is missing, so that `off` never passes `size`. */
+	for (off = sizeof(header); size - off >= sizeof(record);) {
+		memcpy(&record, data + off, sizeof(record));
+		off += sizeof(record);
+		if (record.length >= BUS_MEMORY_SIZE) {
+			errno = EBADMSG;
+			goto fail;
+		}
+		padded = ((size_t)record.length + RECORDING_ALIGN - 1) / RECORDING_ALIGN * RECORDING_ALIGN;
+		if (size - off < padded)
+			break;
+		memcpy(buf, data + off, (size_t)record.length);
+		buf[record.length] = '\0';
+		off += padded;
+
+		/* Keep the original pace, scaled by the speed. */
+		if (!start) {
+			first = record.time;
+			start = now_ns();
+		} else if (speed > 0 && record.time > first) {
+			due = start + (uint64_t)((double)(record.time - first) / speed);
+			deadline.tv_sec = (time_t)(due / 1000000000ULL);
+			deadline.tv_nsec = (long)(due % 1000000000ULL);
+			while ((errno = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)))
+				if (errno != EINTR)
+					goto fail;
+		}
+		t(bus_write(&bus, buf, nowait * BUS_NOWAIT));
+	}
+
+	t(bus_close(&bus));
+	munmap(data, size);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (bus.message)
+		bus_close(&bus);
+	if (data != MAP_FAILED)
+		munmap(data, size);
+	if (fd >= 0)
+		close(fd);
+	errno = saved_errno;
+	perror(argv0);
+	return 1;
+}
+
+
+/**
+ * Write a message to `stream_fd`, unless it is the message in `echo`,
+ * this function is used as a callback for `bus_read` by `bus bridge`
+ * 
+ * @param   message    The received message
+ * @param   user_data  Not used
+ * @return             0 (stop listening) if `stream_fd` has been closed,
+ *                     1 (continue listening) on success, -1 on error
+ */
+static int
+forward_message(const char *message, void *user_data)
+{
+	size_t len;
+	if (message && echo && echo->pending) {
+		len = strlen(message);
+		if (echo->length == len && echo->hash == hash_message(message, len)) {
+			echo->pending = 0;
+			return 1;
+		}
+	}
+	return stream_message(message, user_data);
+}
+
+
+/**
+ * Start a process for `bus bridge` that either forwards the
+ * messages on a bus to a file descriptor, or broadcasts the
+ * messages read from a file descriptor on a bus
+ * 
+ * @param   path      The pathname of the bus
+ * @param   fd        The file descriptor
+ * @param   closefd   File descriptor the process shall close, -1 for none
+ * @param   callback  The callback for `bus_read`, that shall write to
+ *                    `stream_fd`, if the process shall listen on the bus,
+ *                    `NULL` if the process shall broadcast on the bus
+ * @param   slot      The `echo` for the bus, `NULL` if
+ *                    messages shall not be recognised
+ * @return            The process ID of the process, -1 on error
+ */
+static pid_t
+start_bridge(const char *path, int fd, int closefd, int (*callback)(const char *, void *), struct echo *slot)
+{
+	bus_t bus;
+	pid_t pid;
+
+	if ((pid = fork()))
+		return pid;
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	if (closefd >= 0)
+		close(closefd);
+	echo = slot;
+	delimiter = '\0';
+	t(bus_open(&bus, path, callback ? BUS_RDONLY : BUS_WRONLY));
+	if (callback) {
+		stream_fd = fd;
+		t(bus_read(&bus, callback, NULL));
+	} else if (broadcast_stream(&bus, fd, 0, NULL, 0)) {
+		/* The peer disconnecting is not an error. */
+		if (errno != ECONNRESET)
+			goto fail;
+	}
+	exit(0);
+fail:
+	perror(argv0);
+	exit(1);
+}
+
+
+/**
+ * Wait until one of the processes of `bus bridge` exits, or
+ * `bus bridge` is told to terminate, and then terminate the
+ * other processes
+ * 
+ * @param   pids  The process IDs
+ * @param   n     The number of elements in `pids`
+ * @return        0 if the process that exited was successful, -1 otherwise
+ */
+static int
+finish_bridge(pid_t *pids, size_t n)
+{
+	int status, first = -1;
+	size_t i, left = n;
+	pid_t pid;
+
+	while (left) {
+		pid = wait(&status);
+		if (pid == -1) {
+			if (errno != EINTR)
+				return -1;
+			if (caught_signal && first < 0) {
+				first = 0;
+				for (i = 0; i < n; i++)
+					if (pids[i] > 0)
+						kill(pids[i], SIGTERM);
+			}
+			continue;
+		}
+		for (i = 0; i < n; i++)
+			if (pids[i] == pid)
+				break;
+		if (i == n)
+			continue;
+		pids[i] = -1, left--;
+		if (first < 0) {
+			first = WIFEXITED(status) && !WEXITSTATUS(status);
+			for (i = 0; i < n; i++)
+				if (pids[i] > 0)
+					kill(pids[i], SIGTERM);
+		}
+	}
+	return first ? 0 : -1;
+}
+
+
+/**
+ * The `bridge` command, forward messages between two buses,
+ * or between a bus and a `bus bridge` on the other end of
+ * a UNIX domain socket
+ * 
+ * @param   argc  The number of elements in `argv`
+ * @param   argv  The command line, `argv[0]` is the program's name
+ *                and the command itself is omitted
+ * @return        0 on sucess, 1 on error, 2 on invalid command
+ */
+static int
+bridge(int argc, char *argv[])
+{
+	int both = 0, sock = -1, conn = -1, fds[2] = {-1, -1}, saved_errno;
+	char *listen_path = NULL, *connect_path = NULL;
+	struct echo *slots = MAP_FAILED;
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct stat attr;
+	pid_t pids[4];
+	size_t n = 0;
+
+	ARGBEGIN {
+	case 'b':
+		both = 1;
+		break;
+	case 'l':
+		if (!(listen_path = ARGF()))
+			return 2;
+		break;
+	case 'c':
+		if (!(connect_path = ARGF()))
+			return 2;
+		break;
+	default:
+		return 2;
+	} ARGEND;
+	if (listen_path || connect_path) {
+		if ((listen_path && connect_path) || both || argc != 1)
+			return 2;
+		if (strlen(listen_path ? listen_path : connect_path) >= sizeof(addr.sun_path))
+			return 2;
+	} else if (argc != 2) {
+		return 2;
+	}
+
+	slots = mmap(NULL, 2 * sizeof(*slots), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (slots == MAP_FAILED)
+		goto fail;
+	memset(slots, 0, 2 * sizeof(*slots));
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Do not leave the other processes running when terminated. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = terminate_handler;
+	t(sigaction(SIGTERM, &sa, NULL));
+	t(sigaction(SIGINT, &sa, NULL));
+	t(sigaction(SIGHUP, &sa, NULL));
+
+	/* Forward between two buses, with a pipe between the
+	 * listening and the broadcasting process, so that the
+	 * listener never waits for a broadcast to finish. */
+	if (!listen_path && !connect_path) {
+		t(pipe(fds));
+		t(pids[n++] = start_bridge(argv[0], fds[1], fds[0], forward_message, both ? &slots[0] : NULL));
+		t(pids[n++] = start_bridge(argv[1], fds[0], fds[1], NULL, both ? &slots[1] : NULL));
+		close(fds[0]), close(fds[1]), fds[0] = fds[1] = -1;
+		if (both) {
+			t(pipe(fds));
+			t(pids[n++] = start_bridge(argv[1], fds[1], fds[0], forward_message, &slots[1]));
+			t(pids[n++] = start_bridge(argv[0], fds[0], fds[1], NULL, &slots[0]));
+			close(fds[0]), close(fds[1]), fds[0] = fds[1] = -1;
+		}
+		if (finish_bridge(pids, n) && !caught_signal)
+			goto fail;
+		goto done;
+	}
+
+	/* Forward both ways between a bus and a socket,
+	 * the messages are NUL-terminated on the socket. */
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, listen_path ? listen_path : connect_path);
+	t(sock = socket(AF_UNIX, SOCK_STREAM, 0));
+	if (connect_path) {
+		t(connect(sock, (struct sockaddr *)&addr, (socklen_t)sizeof(addr)));
+		conn = sock, sock = -1;
+	} else {
+		if (!lstat(listen_path, &attr) && S_ISSOCK(attr.st_mode))
+			t(unlink(listen_path));
+		t(bind(sock, (struct sockaddr *)&addr, (socklen_t)sizeof(addr)));
+		t(listen(sock, 1));
+	}
+	for (;;) {
+		while (sock >= 0 && (conn = accept(sock, NULL, NULL)) == -1) {
+			if (errno != EINTR)
+				goto fail;
+			if (caught_signal)
+				goto done;
+		}
+		n = 0;
+		t(pids[n++] = start_bridge(argv[0], conn, sock, forward_message, &slots[0]));
+		t(pids[n++] = start_bridge(argv[0], conn, sock, NULL, &slots[0]));
+		close(conn), conn = -1;
+		if (sock < 0)
+			break;
+		/* The peer disconnecting is not an error. */
+		finish_bridge(pids, n), n = 0;
+		slots[0].pending = 0;
+		if (caught_signal)
+			goto done;
+	}
+	if (finish_bridge(pids, n) && !caught_signal)
+		goto fail;
+
+done:
+	if (sock >= 0)
+		close(sock);
+	munmap(slots, 2 * sizeof(*slots));
+	if (caught_signal) {
+		signal(caught_signal, SIG_DFL);
+		raise(caught_signal);
+	}
+	return 0;
+
+fail:
+	saved_errno = errno;
+	while (n--)
+		if (pids[n] > 0)
+			kill(pids[n], SIGTERM);
+	if (fds[0] >= 0)
+		close(fds[0]), close(fds[1]);
+	if (conn >= 0)
+		close(conn);
+	if (sock >= 0)
+		close(sock);
+	if (slots != MAP_FAILED)
+		munmap(slots, 2 * sizeof(*slots));
+	errno = saved_errno;
+	perror(argv0);
+	return 1;
+}
+
+
+/**
+ * The state of the listening process started by `bus ping`
+ */
+struct ping_listener
+{
+	/**
+	 * The process ID of `bus ping`
+	 */
+	intmax_t pinger;
+
+	/**
+	 * The message `bus ping` broadcasts when it is done
+	 */
+	char end[3 * sizeof(intmax_t) + sizeof(" ping end")];
+
+	/**
+	 * The file descriptor to announce that the process is listening on
+	 */
+	int ready_fd;
+
+	/**
+	 * Whether replies shall not be printed
+	 */
+	int quiet;
+
+	/**
+	 * The round-trip times of the received replies
+	 */
+	struct samples rtts;
+};
+
+
+/**
+ * Reply to probes broadcasted by `bus ping`, the replies are written to
+ * `stream_fd`, this function is used as a callback for `bus_read`
+ * 
+ * @param   message    The received message
+ * @param   user_data  Not used
+ * @return             0 (stop listening) if `stream_fd` has been closed,
+ *                     1 (continue listening) on success, -1 on error
+ */
+static int
+respond_message(const char *message, void *user_data)
+{
+	char buf[BUS_MEMORY_SIZE];
+	intmax_t pinger;
+	unsigned long seq;
+	unsigned long long sent;
+	if (!message || sscanf(message, "%jd ping %lu %llu", &pinger, &seq, &sent) != 3)
+		return 1;
+	sprintf(buf, "%ji pong %ji %lu %llu", (intmax_t)getpid(), pinger, seq, sent);
+	return stream_message(buf, user_data);
+}
+
+
+/**
+ * Callback for `bus_read` in the listening process started by
+ * `bus ping`, collects the replies to the probes
+ * 
+ * @param   message    The received message
+ * @param   user_data  The `struct ping_listener`
+ * @return             0 (stop listening) when `bus ping` is done,
+ *                     1 (continue listening) otherwise, -1 on error
+ */
+static int
+ping_listen(const char *message, void *user_data)
+{
+	struct ping_listener *state = user_data;
+	uint64_t now = now_ns();
+	intmax_t responder, pinger;
+	unsigned long seq;
+	unsigned long long sent;
+
+	if (!message) {
+		write_fully(state->ready_fd, "", 1);
+		close(state->ready_fd);
+		return 1;
+	}
+	if (sscanf(message, "%jd pong %jd %lu %llu", &responder, &pinger, &seq, &sent) != 4)
+		return !!strcmp(message, state->end);
+	if (pinger != state->pinger || (uint64_t)sent > now)
+		return 1;
+	t(add_sample(&state->rtts, now - (uint64_t)sent));
+	if (!state->quiet) {
+		printf("reply from %ji: seq=%lu rtt=%.1f us\n", responder, seq, (double)(now - (uint64_t)sent) / 1000);
+		fflush(stdout);
+	}
+	return 1;
+fail:
+	return -1;
+}
+
+
+/**
+ * Print a summary of samples, in microseconds, for `bus ping`
+ * 
+ * @param  name     The name of the samples
+ * @param  samples  The samples, will be sorted
+ */
+static void
+print_ping_summary(const char *name, struct samples *samples)
+{
+	if (!samples->n)
+		return;
+	qsort(samples->v, samples->n, sizeof(*samples->v), sample_cmp);
+	printf("%s min/avg/p99/max = %.1f/%.1f/%.1f/%.1f us\n", name,
+	       (double)percentile(samples, 0) / 1000, (double)average(samples) / 1000,
+	       (double)percentile(samples, 990) / 1000, (double)percentile(samples, 1000) / 1000);
+}
+
+
+/**
+ * The `ping` command, broadcast probes on a bus and measure how
+ * long it takes for the listeners to acknowledge them, and how
+ * long it takes to receive replies to them, or reply to probes
+ * 
+ * @param   argc  The number of elements in `argv`
+ * @param   argv  The command line, `argv[0]` is the program's name
+ *                and the command itself is omitted
+ * @return        0 on sucess, 1 on error, 2 on invalid command
+ */
+static int
+ping(int argc, char *argv[])
+{
+	double interval = 1, grace;
+	long count = 0;
+	int respond = 0, quiet = 0, fds[2] = {-1, -1}, ready_fds[2] = {-1, -1}, status, saved_errno;
+	struct ping_listener listener;
+	struct samples writes = {0, NULL};
+	uint64_t t0, t1, next, extra;
+	struct timespec deadline;
+	struct sigaction sa;
+	char *arg, *end, buf[BUS_MEMORY_SIZE], c;
+	unsigned long seq, sent = 0;
+	pid_t pids[2];
+	size_t n = 0;
+	bus_t bus;
+
+	bus.message = NULL;
+	listener.rtts.n = 0, listener.rtts.v = NULL;
+
+	ARGBEGIN {
+	case 'c':
+		if (!(arg = ARGF()) || !isdigit((unsigned char)*arg))
+			return 2;
+		errno = 0;
+		count = strtol(arg, &end, 10);
+		if (errno || *end || count < 1)
+			return 2;
+		break;
+	case 'i':
+		if (!(arg = ARGF()) || !isdigit((unsigned char)*arg))
+			return 2;
+		errno = 0;
+		interval = strtod(arg, &end);
+		if (errno || *end)
+			return 2;
+		break;
+	case 'q':
+		quiet = 1;
+		break;
+	case 'R':
+		respond = 1;
+		break;
+	default:
+		return 2;
+	} ARGEND;
+	if (argc != 1 || (respond && (count || quiet || interval != 1)))
+		return 2;
+
+	signal(SIGPIPE, SIG_IGN);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = terminate_handler;
+	t(sigaction(SIGTERM, &sa, NULL));
+	t(sigaction(SIGINT, &sa, NULL));
+	t(sigaction(SIGHUP, &sa, NULL));
+
+	/* Reply to probes. The replies cannot be broadcasted while
+	 * the probe is being received, so they are broadcasted by
+	 * another process, like in `bus bridge`. */
+	if (respond) {
+		t(pipe(fds));
+		t(pids[n++] = start_bridge(argv[0], fds[1], fds[0], respond_message, NULL));
+		t(pids[n++] = start_bridge(argv[0], fds[0], fds[1], NULL, NULL));
+		close(fds[0]), close(fds[1]), fds[0] = fds[1] = -1;
+		if (finish_bridge(pids, n) && !caught_signal)
+			goto fail;
+		goto done;
+	}
+
+	/* Collect replies in another process. */
+	t(pipe(fds));
+	t(pipe(ready_fds));
+	t(pids[n++] = fork());
+	if (!pids[0]) {
+		signal(SIGINT, SIG_IGN);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGHUP, SIG_DFL);
+		close(fds[0]), close(ready_fds[0]);
+		listener.pinger = (intmax_t)getppid();
+		sprintf(listener.end, "%ji ping end", listener.pinger);
+		listener.ready_fd = ready_fds[1];
+		listener.quiet = quiet;
+		if (bus_open(&bus, argv[0], BUS_RDONLY) || bus_read(&bus, ping_listen, &listener) ||
+		    send_samples(fds[1], &listener.rtts, 0)) {
+			perror(argv0);
+			_exit(1);
+		}
+		_exit(0);
+	}
+	close(fds[1]), close(ready_fds[1]), fds[1] = ready_fds[1] = -1;
+	if (read_fully(ready_fds[0], &c, 1) != 1)
+		goto fail;
+	close(ready_fds[0]), ready_fds[0] = -1;
+
+	/* Broadcast the probes. */
+	t(bus_open(&bus, argv[0], BUS_WRONLY));
+	if (!quiet) {
+		printf("PING %s\n", argv[0]);
+		fflush(stdout);
+	}
+	next = now_ns();
+	for (seq = 1; !caught_signal; seq++) {
+		t0 = now_ns();
+		sprintf(buf, "%ji ping %lu %llu", (intmax_t)getpid(), seq, (unsigned long long)t0);
+		if (bus_write(&bus, buf, 0)) {
+			if (errno == EINTR && caught_signal)
+				break;
+			goto fail;
+		}
+		t1 = now_ns();
+		sent += 1;
+		t(add_sample(&writes, t1 - t0));
+		if (!quiet) {
+			printf("seq=%lu write=%.1f us\n", seq, (double)(t1 - t0) / 1000);
+			fflush(stdout);
+		}
+		if (count && seq == (unsigned long)count)
+			break;
+		next += (uint64_t)(interval * 1e9);
+		deadline.tv_sec = (time_t)(next / 1000000000ULL);
+		deadline.tv_nsec = (long)(next % 1000000000ULL);
+		while (!caught_signal && (errno = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)))
+			if (errno != EINTR)
+				goto fail;
+	}
+
+	/* Give the last replies some time to arrive, then stop
+	 * the collecting process and get the round-trip times. */
+	if (!caught_signal) {
+		grace = interval < 1 ? interval : 1;
+		deadline.tv_sec = (time_t)grace;
+		deadline.tv_nsec = (long)((grace - (double)deadline.tv_sec) * 1e9);
+		nanosleep(&deadline, NULL);
+	}
+	sprintf(buf, "%ji ping end", (intmax_t)getpid());
+	while (bus_write(&bus, buf, 0))
+		if (errno != EINTR)
+			goto fail;
+	t(receive_samples(fds[0], &listener.rtts, &extra));
+	close(fds[0]), fds[0] = -1;
+	while (waitpid(pids[0], &status, 0) == -1)
+		if (errno != EINTR)
+			goto fail;
+	n = 0;
+	t(bus_close(&bus));
+
+	printf("--- %s ping statistics ---\n", argv[0]);
+	printf("%lu probes sent, %zu replies received\n", sent, listener.rtts.n);
+	print_ping_summary("write", &writes);
+	print_ping_summary("rtt", &listener.rtts);
+	free(writes.v);
+	free(listener.rtts.v);
+	return 0;
+
+done:
+	if (caught_signal) {
+		signal(caught_signal, SIG_DFL);
+		raise(caught_signal);
+	}
+	return 0;
+
+fail:
+	saved_errno = errno;
+	while (n--)
+		if (pids[n] > 0)
+			kill(pids[n], SIGTERM);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	if (ready_fds[0] >= 0)
+		close(ready_fds[0]);
+	if (ready_fds[1] >= 0)
+		close(ready_fds[1]);
+	if (bus.message)
+		bus_close(&bus);
+	free(writes.v);
+	free(listener.rtts.v);
+	errno = saved_errno;
+	perror(argv0);
+	return 1;
+}
+
+
+/**
+ * How many seconds an XSI object must have been left untouched
+ * before `bus gc` considers it orphaned, so that buses that are
+ * being created are not collected
+ */
+#define GC_GRACE  60
+
+
+#ifndef SEMUN_ALREADY_DEFINED
+union semun {
+	int val;
+	struct semid_ds *buf;
+	unsigned short *array;
+};
+#endif
+
+
+/**
+ * Keys of XSI objects used by buses
+ */
+struct keys
+{
+	/**
+	 * The number of keys
+	 */
+	size_t n;
+
+	/**
+	 * The keys
+	 */
+	key_t *v;
+};
+
+
+/**
+ * Add a key to a list of keys
+ * 
+ * @param   keys  The list of keys
+ * @param   key   The key to add
+ * @return        0 on success, -1 on error
+ */
+static int
+add_key(struct keys *keys, key_t key)
+{
+	key_t *new;
+	if (!(keys->n & (keys->n - 1))) {
+		new = realloc(keys->v, (keys->n ? 2 * keys->n : 1) * sizeof(*new));
+		if (!new)
+			return -1;
+		keys->v = new;
+	}
+	keys->v[keys->n++] = key;
+	return 0;
+}
+
+
+/**
+ * Check whether a list of keys contains a key
+ * 
+ * @param   keys  The list of keys
+ * @param   key   The key
+ * @return        1 if `key` is in `keys`, 0 otherwise
+ */
+static int
+has_key(const struct keys *keys, key_t key)
+{
+	size_t i;
+	for (i = 0; i < keys->n; i++)
+		if (keys->v[i] == key)
+			return 1;
+	return 0;
+}
+
+
+/**
+ * Add the keys used by a bus, for `bus gc`
+ * 
+ * @param   file  The pathname of the bus, if it is not a bus
+ *                (or it was created with `BUS_MAPPED`) it is ignored
+ * @param   sems  The list to add the key of the semaphore array to
+ * @param   shms  The list to add the key of the shared memory to
+ * @return        0 on success, -1 on error
+ */
+static int
+add_bus_keys(const char *file, struct keys *sems, struct keys *shms)
+{
+	bus_t bus;
+	const bus_t *part;
+	int i;
+	if (bus_open(&bus, file, -1))
+		return errno == ENOMEM ? -1 : 0;
+	for (i = 0; i < bus.partitions; i++) {
+		part = bus.partition ? &bus.partition[i] : &bus;
+		if (part->key_sem != -1)
+			t(add_key(sems, part->key_sem));
+		if (part->key_shm != -1)
+			t(add_key(shms, part->key_shm));
+	}
+	bus_close(&bus);
+	return 0;
+fail:
+	bus_close(&bus);
+	return -1;
+}
+
+
+/**
+ * Add the keys used by the buses in a directory, for `bus gc`
+ * 
+ * @param   dir   The directory, it is not an error if it does not exist
+ * @param   sems  The list to add the keys of the semaphore arrays to
+ * @param   shms  The list to add the keys of the shared memories to
+ * @return        0 on success, -1 on error
+ */
+static int
+add_directory_keys(const char *dir, struct keys *sems, struct keys *shms)
+{
+	DIR *d;
+	struct dirent *f;
+	struct stat attr;
+	char *path = NULL, *new;
+	size_t size = 0, len;
+	int saved_errno;
+
+	if (!(d = opendir(dir)))
+		return errno == ENOENT ? 0 : -1;
+	while (errno = 0, (f = readdir(d))) {
+		if (!strcmp(f->d_name, ".") || !strcmp(f->d_name, ".."))
+			continue;
+		len = strlen(dir) + strlen(f->d_name) + 2;
+		if (len > size) {
+			if (!(new = realloc(path, len)))
+				goto fail;
+			path = new, size = len;
+		}
+		sprintf(path, "%s/%s", dir, f->d_name);
+		if (stat(path, &attr) || !S_ISREG(attr.st_mode))
+			continue;
+		t(add_bus_keys(path, sems, shms));
+	}
+	if (errno)
+		goto fail;
+	closedir(d);
+	free(path);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	closedir(d);
+	free(path);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Check whether a shared memory that was created by `bus_create`
+ * together with a semaphore array is attached, the shared memory
+ * of a bus is created, and its permissions are changed, in the
+ * same second as those of its semaphore array
+ * 
+ * @param   cuid     The ID of the user that created the semaphore array
+ * @param   changed  When the semaphore array was last changed
+ * @return           1 if such a shared memory is attached, 0 otherwise
+ */
+static int
+shared_memory_attached(uid_t cuid, time_t changed)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t size = 0;
+	long key;
+	int id, attached = 0;
+	struct shmid_ds info;
+
+	/* If the shared memories cannot be listed,
+	 * the semaphore array is assumed to be used. */
+	if (!(f = fopen("/proc/sysvipc/shm", "r")))
+		return 1;
+	if (getline(&line, &size, f) < 0)
+		goto done;
+	while (!attached && getline(&line, &size, f) >= 0) {
+		if (sscanf(line, "%ld %d", &key, &id) != 2 || (key & BUS_KEY_MASK) != BUS_KEY_TAG)
+			continue;
+		if (shmctl(id, IPC_STAT, &info))
+			continue;
+		attached = info.shm_nattch && info.shm_perm.cuid == cuid &&
+		           info.shm_ctime - changed <= 1 && changed - info.shm_ctime <= 1;
+	}
+
+done:
+	fclose(f);
+	free(line);
+	return attached;
+}
+
+
+/**
+ * Check whether a semaphore array that was created by `bus_create`
+ * may be used by a bus: if a process is waiting on it, if the
+ * process that last operated on it is alive, or if the shared
+ * memory that was created together with it is attached
+ * 
+ * @param   id    The ID of the semaphore array
+ * @param   info  The status of the semaphore array
+ * @return        1 if the semaphore array may be used, 0 otherwise
+ */
+static int
+semaphores_in_use(int id, const struct semid_ds *info)
+{
+	int i, pid;
+	for (i = 0; i < (int)info->sem_nsems; i++) {
+		if (semctl(id, i, GETNCNT) > 0 || semctl(id, i, GETZCNT) > 0)
+			return 1;
+		pid = semctl(id, i, GETPID);
+		if (pid > 0 && (!kill((pid_t)pid, 0) || errno == EPERM))
+			return 1;
+	}
+	return shared_memory_attached(info->sem_perm.cuid, info->sem_ctime);
+}
+
+
+/**
+ * Report, and optionally remove, XSI objects that were created
+ * by `bus_create` but are not used by any known bus
+ * 
+ * @param   shm     0 for semaphore arrays, 1 for shared memories
+ * @param   keys    The keys used by known buses
+ * @param   force   Whether orphaned objects shall be removed
+ * @return          0 on success, -1 on error
+ */
+static int
+collect_orphans(int shm, const struct keys *keys, int force)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t size = 0;
+	long key;
+	int id, saved_errno;
+	uid_t euid = geteuid(), uid, cuid;
+	time_t now = time(NULL), changed, used;
+	struct semid_ds sem_info;
+	struct shmid_ds shm_info;
+	union semun arg;
+	const char *status;
+
+	/* Linux lists all objects here, which ones
+	 * are accessible is checked with `IPC_STAT`. */
+	if (!(f = fopen(shm ? "/proc/sysvipc/shm" : "/proc/sysvipc/sem", "r")))
+		return -1;
+	if (getline(&line, &size, f) < 0)
+		goto done;
+
+	while (getline(&line, &size, f) >= 0) {
+		if (sscanf(line, "%ld %d", &key, &id) != 2)
+			continue;
+		if ((key & BUS_KEY_MASK) != BUS_KEY_TAG || has_key(keys, (key_t)key))
+			continue;
+
+		status = force ? "removed" : "orphaned";
+		if (shm) {
+			if (shmctl(id, IPC_STAT, &shm_info))
+				continue;
+			uid = shm_info.shm_perm.uid, cuid = shm_info.shm_perm.cuid;
+			changed = shm_info.shm_ctime, used = shm_info.shm_dtime;
+			if (shm_info.shm_nattch)
+				status = "attached";
+		} else {
+			arg.buf = &sem_info;
+			if (semctl(id, 0, IPC_STAT, arg) == -1)
+				continue;
+			uid = sem_info.sem_perm.uid, cuid = sem_info.sem_perm.cuid;
+			changed = sem_info.sem_ctime, used = sem_info.sem_otime;
+		}
+		if (euid && uid != euid && cuid != euid)
+			continue;
+		if (now - changed < GC_GRACE || now - used < GC_GRACE)
+			continue;
+
+		/* A listener that waits for a message does not update
+		 * `sem_otime`, and the bus may be outside the known
+		 * directories, so the semaphore array is only removed
+		 * if nothing indicates that its bus is in use. */
+		if (!shm && semaphores_in_use(id, &sem_info))
+			status = "used";
+
+		if (force && strcmp(status, "attached") && strcmp(status, "used")) {
+			if (shm ? shmctl(id, IPC_RMID, &shm_info) : semctl(id, 0, IPC_RMID))
+				goto fail;
+		}
+		printf("%s\t0x%08lx\t%i\t%s\n", shm ? "shm" : "sem", (unsigned long)key, id, status);
+	}
+	if (ferror(f))
+		goto fail;
+
+done:
+	fclose(f);
+	free(line);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	fclose(f);
+	free(line);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * The `gc` command, find, and optionally remove, XSI semaphore
+ * arrays and shared memories left behind by buses whose files
+ * have been removed without `bus_unlink`, or by `bus_create`
+ * when it was killed
+ * 
+ * @param   argc  The number of elements in `argv`
+ * @param   argv  The command line, `argv[0]` is the program's name
+ *                and the command itself is omitted
+ * @return        0 on sucess, 1 on error, 2 on invalid command
+ */
+static int
+gc(int argc, char *argv[])
+{
+	struct keys sems = {0, NULL}, shms = {0, NULL};
+	int force = 0, saved_errno, i;
+	char *dir = NULL, **env, *eq;
+	const char *runtime;
+	size_t len;
+
+	ARGBEGIN {
+	case 'f':
+		force = 1;
+		break;
+	default:
+		return 2;
+	} ARGEND;
+
+	/* Find the buses in use: those in the given directories, or in
+	 * the runtime directory, and those named by the environment. */
+	if (!argc) {
+		runtime = getenv("XDG_RUNTIME_DIR");
+		if (!runtime || !*runtime)
+			runtime = "/run";
+		if (!(dir = malloc(strlen(runtime) + sizeof("/bus"))))
+			goto fail;
+		sprintf(dir, "%s/bus", runtime);
+		t(add_directory_keys(dir, &sems, &shms));
+		free(dir), dir = NULL;
+	}
+	for (i = 0; i < argc; i++)
+		t(add_directory_keys(argv[i], &sems, &shms));
+	for (env = environ; *env; env++) {
+		if (!(eq = strchr(*env, '=')))
+			continue;
+		len = (size_t)(eq - *env);
+		if ((len > 4 && !strncmp(*env, "BUS_", 4)) || (len > 4 && !strncmp(eq - 4, "_BUS", 4)))
+			t(add_bus_keys(eq + 1, &sems, &shms));
+	}
+
+	t(collect_orphans(0, &sems, force));
+	t(collect_orphans(1, &shms, force));
+
+	free(sems.v);
+	free(shms.v);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	free(dir);
+	free(sems.v);
+	free(shms.v);
+	errno = saved_errno;
+	perror(argv0);
+	return 1;
+}
+
+
+/**
+ * Main function of the command line interface for the bus system
+ * 
+ * @param   argc  The number of elements in `argv`
+ * @param   argv  The command. Valid commands:
+ *                  <argv0> create [-x] [-S] [-r] [-R] [-Q] [-K] [-J] [-m] [-c] [-p <n>] [--] [<path>]
+ *                                                                    # create a bus
+ *                  <argv0> remove [--] <path>                        # remove a bus
+ *                  <argv0> listen [-j <n> [-d]] [-p <list>] [--] <path> <command>
+ *                                                                    # listen for new messages
+ *                  <argv0> listen -e [-j <n> [-d]] [-p <list>] [--] <path> <command> [<argument> ...]
+ *                                                                    # listen for new messages, without sh(1)
+ *                  <argv0> listen -s [-0] [-p <list>] [--] <path> <command>
+ *                                                                    # stream new messages to a command
+ *                  <argv0> listen -o [-0] [-p <list>] [--] <path>    # stream new messages to stdout
+ *                  <argv0> wait [-p <list>] [--] <path> <command>    # listen for one new message
+ *                  <argv0> wait -e [-p <list>] [--] <path> <command> [<argument> ...]
+ *                                                                    # listen for one new message, without sh(1)
+ *                  <argv0> broadcast [-n] [-k <key>] [-t <ttl>] [--] <path> <message>
+ *                                                                    # broadcast a message
+ *                  <argv0> broadcast [-n] [-k <key>] [-t <ttl>] [-0 | -b] [--] <path> -
+ *                                                                    # broadcast messages from stdin
+ *                  <argv0> broadcast [-n] [-k <key>] [-t <ttl>] [-0 | -b] -f <file> [--] <path>
+ *                                                                    # broadcast messages from a file
+ *                  <argv0> broadcast -K -k <key> [-n] [--] <path> <message>
+ *                                                                    # broadcast and retain a message
+ *                  <argv0> retained [-0] [--] <path>                 # print the retained messages
+ *                  <argv0> journal [-n] [-0] [--] <path> <cursor>    # print messages from a cursor
+ *                  <argv0> journal -d [--] <path> <cursor>           # remove a cursor
+ *                  <argv0> call [-t <timeout>] [--] <path> <request> # call listeners and print the reply
+ *                  <argv0> reply [--] <path> <call> <reply>          # reply to a call
+ *                  <argv0> survey [-t <timeout>] [--] <path> <query> # survey listeners and print the responses
+ *                  <argv0> offer [-t <timeout>] [--] <path> <name>   # offer a channel and send stdin over it
+ *                  <argv0> accept [--] <path> <name>                 # accept a channel and print what it receives
+ *                  <argv0> chmod [--] <mode> <path>                  # change permissions
+ *                  <argv0> chown [--] <owner>[:<group>] <path>       # change ownership
+ *                  <argv0> chgrp [--] <group> <path>                 # change group
+ *                  <argv0> bench [-c] [-C | -P <n>] [-w <writers>] [-l <listeners>] [-s <size>] [-r <rate>]
+ *                                [-m <messages>] [-t <timeout>] [--] [<path>]
+ *                                                                    # measure performance
+ *                  <argv0> stat [--] <path>                          # print the state of a bus
+ *                  <argv0> top [-i <interval>] [-p] [--] <path>      # monitor a bus
+ *                  <argv0> record [--] <path> <file>                 # record messages
+ *                  <argv0> replay [-s <speed>] [-n] [--] <file> <path>
+ *                                                                    # broadcast recorded messages
+ *                  <argv0> bridge [-b] [--] <path> <path>            # forward messages between buses
+ *                  <argv0> bridge -l <socket> [--] <path>            # forward messages over a socket
+ *                  <argv0> bridge -c <socket> [--] <path>            # forward messages over a socket
+ *                  <argv0> ping [-c <count>] [-i <interval>] [-q] [--] <path>
+ *                                                                    # measure latency
+ *                  <argv0> ping -R [--] <path>                       # reply to probes
+ *                  <argv0> gc [-f] [--] [<directory> ...]            # find leaked XSI objects
+ *                <command> will be spawned with $arg set to the message
+ * @return        0 on sucess, 1 on error, 2 on invalid command
+ */
+int
+main(int argc, char *argv[])
+{
+	int xflag = 0;
+	int Sflag = 0;
+	int rflag = 0;
+	int Rflag = 0;
+	int Qflag = 0;
+	int mflag = 0;
+	int cflag = 0;
+	int nflag = 0;
+	int sflag = 0;
+	int oflag = 0;
+	int zflag = 0;
+	int eflag = 0;
+	int dflag = 0;
+	int bflag = 0;
+	int Kflag = 0;
+	int Jflag = 0;
+	char *jarg = NULL;
+	char *farg = NULL;
+	char *parg = NULL;
+	char *karg = NULL;
+	char *targ = NULL;
+	long partitions = 0;
+	double timeout = 0;
+	struct timespec deadline;
+	char reply[BUS_MEMORY_SIZE];
+	bus_channel_t channel;
+	const char *received;
+	uint64_t subscribed = 0;
+	int fd = -1;
+	char *end;
+	int r;
+	const char *cmd;
+	bus_t bus;
+	char *file;
+	struct stat attr;
+	uid_t uid;
+	gid_t gid;
+	mode_t mode_andnot, mode_or;
+	pid_t pid = -1;
+
+	/* Parse arguments. Options follow the command, so the
+	 * command is moved out of the way for `ARGBEGIN`. */
+	if (argc < 2)
+		return 2;
+	cmd = argv[1];
+	argv[1] = argv[0];
+	argv++, argc--;
+	if (!strcmp(cmd, "bench"))
+		return bench(argc, argv);
+	if (!strcmp(cmd, "top"))
+		return top(argc, argv);
+	if (!strcmp(cmd, "replay"))
+		return replay(argc, argv);
+	if (!strcmp(cmd, "bridge"))
+		return bridge(argc, argv);
+	if (!strcmp(cmd, "ping"))
+		return ping(argc, argv);
+	if (!strcmp(cmd, "gc"))
+		return gc(argc, argv);
+	ARGBEGIN {
+	case 'x':
+		xflag = 1;
+		break;
+	case 'S':
+		Sflag = 1;
+		break;
+	case 'r':
+		rflag = 1;
+		break;
+	case 'R':
+		Rflag = 1;
+		break;
+	case 'Q':
+		Qflag = 1;
+		break;
+	case 'm':
+		mflag = 1;
+		break;
+	case 'c':
+		cflag = 1;
+		break;
+	case 'n':
+		nflag = 1;
+		break;
+	case 's':
+		sflag = 1;
+		break;
+	case 'o':
+		oflag = 1;
+		break;
+	case '0':
+		zflag = 1;
+		break;
+	case 'e':
+		eflag = 1;
+		break;
+	case 'd':
+		dflag = 1;
+		break;
+	case 'j':
+		if (!(jarg = ARGF()))
+			return 2;
+		break;
+	case 'b':
+		bflag = 1;
+		break;
+	case 'K':
+		Kflag = 1;
+		break;
+	case 'J':
+		Jflag = 1;
+		break;
+	case 'f':
+		if (!(farg = ARGF()))
+			return 2;
+		break;
+	case 'p':
+		if (!(parg = ARGF()))
+			return 2;
+		break;
+	case 'k':
+		if (!(karg = ARGF()))
+			return 2;
+		break;
+	case 't':
+		if (!(targ = ARGF()))
+			return 2;
+		break;
+	default:
+		return 2;
+	} ARGEND;
+
+	/* Check options. */
+	if ((xflag || Sflag || rflag || Rflag || Qflag || Jflag || mflag || cflag) && strcmp(cmd, "create"))
+		return 2;
+	if (targ && strcmp(cmd, "call") && strcmp(cmd, "survey") && strcmp(cmd, "offer") && strcmp(cmd, "broadcast"))
+		return 2;
+	if (nflag && strcmp(cmd, "broadcast") && strcmp(cmd, "journal"))
+		return 2;
+	if ((sflag || oflag) && strcmp(cmd, "listen"))
+		return 2;
+	if ((bflag || farg || karg) && strcmp(cmd, "broadcast"))
+		return 2;
+	if (Kflag && strcmp(cmd, "create") && (strcmp(cmd, "broadcast") || !karg || targ))
+		return 2;
+	if (parg && strcmp(cmd, "create") && strcmp(cmd, "listen") && strcmp(cmd, "wait"))
+		return 2;
+	if ((sflag && oflag) || (zflag && !sflag && !oflag && strcmp(cmd, "broadcast") && strcmp(cmd, "retained") &&
+	     strcmp(cmd, "journal")) || (zflag && bflag))
+		return 2;
+	if (eflag && strcmp(cmd, "listen") && strcmp(cmd, "wait"))
+		return 2;
+	if (!strcmp(cmd, "journal")) {
+		if (jarg || (dflag && (nflag || zflag)))
+			return 2;
+	} else if ((jarg || dflag) && (strcmp(cmd, "listen") || sflag || oflag)) {
+		return 2;
+	}
+	if ((eflag && (sflag || oflag)) || (dflag && !jarg && strcmp(cmd, "journal")))
+		return 2;
+	if (jarg) {
+		errno = 0;
+		max_handlers = strtol(jarg, &end, 10);
+		if (errno || *end || !isdigit((unsigned char)*jarg) || max_handlers < 1)
+			return 2;
+		drop_messages = dflag;
+	}
+	if (parg && !strcmp(cmd, "create")) {
+		errno = 0;
+		partitions = strtol(parg, &end, 10);
+		if (errno || *end || !isdigit((unsigned char)*parg) || partitions < 1 || partitions > BUS_MAX_PARTITIONS)
+			return 2;
+	} else if (parg) {
+		t(parse_partitions(parg, &subscribed));
+	}
+	if (targ) {
+		errno = 0;
+		timeout = strtod(targ, &end);
+		if (errno || *end || !isdigit((unsigned char)*targ))
+			return 2;
+		if (!strcmp(cmd, "broadcast"))
+			time_to_live = timeout;
+		else
+			t(deadline_after(&deadline, timeout));
+	}
+	if (!strcmp(cmd, "broadcast"))
+		retain_messages = Kflag;
+
+	/* Create a new bus with selected name. */
+	if ((argc == 1) && !strcmp(cmd, "create")) {
+		t(bus_create(argv[0], xflag * BUS_EXCL | Sflag * BUS_STATS | rflag * BUS_REGISTRY |
+		             Rflag * BUS_CALLS | Qflag * BUS_SURVEYS | Kflag * BUS_RETAINED | Jflag * BUS_JOURNAL |
+		             mflag * BUS_MAPPED | cflag * BUS_CONCURRENT | BUS_PARTITIONS(partitions), NULL));
+
+	/* Create a new bus with random name. */
+	} else if ((argc == 0) && !strcmp(cmd, "create")) {
+		t(bus_create(NULL, Sflag * BUS_STATS | rflag * BUS_REGISTRY | Rflag * BUS_CALLS | Qflag * BUS_SURVEYS |
+		                   Kflag * BUS_RETAINED | Jflag * BUS_JOURNAL | mflag * BUS_MAPPED |
+		                   cflag * BUS_CONCURRENT | BUS_PARTITIONS(partitions), &file));
+		printf("%s\n", file);
+		free(file);
+
+	/* Remove a bus. */
+	} else if ((argc == 1) && !strcmp(cmd, "remove")) {
+		t(bus_unlink(argv[0]));
+
+	/* Stream messages on a bus to stdout. */
+	} else if ((argc == 1) && oflag && !strcmp(cmd, "listen")) {
+		delimiter = zflag ? '\0' : '\n';
+		stream_fd = STDOUT_FILENO;
+		signal(SIGPIPE, SIG_IGN);
+		t(bus_open(&bus, argv[0], BUS_RDONLY));
+		if (parg)
+			t(bus_subscribe(&bus, subscribed));
+		t(bus_read(&bus, stream_message, NULL));
+		t(bus_close(&bus));
+
+	/* Stream messages on a bus to a command. */
+	} else if ((argc == 2) && sflag && !strcmp(cmd, "listen")) {
+		command = argv[1];
+		delimiter = zflag ? '\0' : '\n';
+		t(bus_open(&bus, argv[0], BUS_RDONLY));
+		if (parg)
+			t(bus_subscribe(&bus, subscribed));
+		t(pid = spawn_stream(&stream_fd));
+		signal(SIGPIPE, SIG_IGN);
+		t(bus_read(&bus, stream_message, NULL));
+		t(bus_close(&bus));
+		close(stream_fd);
+		t(waitpid(pid, &r, 0));
+		if (!WIFEXITED(r) || WEXITSTATUS(r))
+			return 1;
+
+	/* Listen on a bus in a loop. */
+	} else if ((argc == 2 || (eflag && argc > 2)) && !sflag && !oflag && !strcmp(cmd, "listen")) {
+		command = argv[1];
+		t(prepare_handler(eflag ? &argv[1] : NULL));
+		t(bus_open(&bus, argv[0], BUS_RDONLY));
+		if (parg)
+			t(bus_subscribe(&bus, subscribed));
+		t(bus_read(&bus, spawn_continue, NULL));
+		t(bus_close(&bus));
+		while (running_handlers)
+			t(reap_handlers(1));
 
 	/* Listen on a bus for one message. */
-	} else if ((argc == 3) && !strcmp(argv[0], "wait")) {
-		command = argv[2];
-		t(bus_open(&bus, argv[1], BUS_RDONLY));
+	} else if ((argc == 2 || (eflag && argc > 2)) && !strcmp(cmd, "wait")) {
+		command = argv[1];
+		t(prepare_handler(eflag ? &argv[1] : NULL));
+		t(bus_open(&bus, argv[0], BUS_RDONLY));
+		if (parg)
+			t(bus_subscribe(&bus, subscribed));
 		t(bus_read(&bus, spawn_break, NULL));
 		t(bus_close(&bus));
 
+	/* Print the messages retained on a bus. */
+	} else if ((argc == 1) && !strcmp(cmd, "retained")) {
+		delimiter = zflag ? '\0' : '\n';
+		stream_fd = STDOUT_FILENO;
+		signal(SIGPIPE, SIG_IGN);
+		t(bus_open(&bus, argv[0], BUS_RDONLY));
+		t(bus_read_retained(&bus, stream_message, NULL));
+		t(bus_close(&bus));
+
+	/* Remove a cursor from the journal of a bus. */
+	} else if ((argc == 2) && dflag && !strcmp(cmd, "journal")) {
+		t(bus_open(&bus, argv[0], BUS_RDONLY));
+		t(bus_forget_cursor(&bus, argv[1]));
+		t(bus_close(&bus));
+
+	/* Print the messages in the journal of a bus from a cursor. */
+	} else if ((argc == 2) && !strcmp(cmd, "journal")) {
+		delimiter = zflag ? '\0' : '\n';
+		stream_fd = STDOUT_FILENO;
+		signal(SIGPIPE, SIG_IGN);
+		t(bus_open(&bus, argv[0], BUS_RDONLY));
+		while ((r = bus_read_journal(&bus, argv[1], stream_journal_message, NULL, nflag * BUS_NOWAIT)) &&
+		       errno == EOVERFLOW)
+			perror(argv0);
+		if (r && errno != EPIPE)
+			goto fail;
+		t(bus_close(&bus));
+
+	/* Broadcast messages from a file on a bus. */
+	} else if (((argc == 2 && !farg && !strcmp(argv[1], "-")) || (argc == 1 && farg)) && !strcmp(cmd, "broadcast")) {
+		delimiter = zflag ? '\0' : '\n';
+		if (farg)
+			t(fd = open(farg, O_RDONLY));
+		t(bus_open(&bus, argv[0], BUS_WRONLY));
+		t(broadcast_stream(&bus, farg ? fd : STDIN_FILENO, bflag, karg, nflag * BUS_NOWAIT));
+		t(bus_close(&bus));
+		if (farg)
+			close(fd);
+
 	/* Broadcast a message on a bus. */
-	} else if ((argc == 3) && !strcmp(argv[0], "broadcast")) {
-		t(bus_open(&bus, argv[1], BUS_WRONLY));
-		t(bus_write(&bus, argv[2], nflag * BUS_NOWAIT));
+	} else if ((argc == 2) && !zflag && !bflag && !farg && !strcmp(cmd, "broadcast")) {
+		if (strlen(argv[1]) >= BUS_MEMORY_SIZE) {
+			errno = EMSGSIZE;
+			goto fail;
+		}
+		t(bus_open(&bus, argv[0], BUS_WRONLY));
+		t(broadcast_message(&bus, karg, argv[1], nflag * BUS_NOWAIT));
+		t(bus_close(&bus));
+
+	/* Call the listeners on a bus and print the reply,
+	 * or survey them and print their responses. */
+	} else if ((argc == 2) && (!strcmp(cmd, "call") || !strcmp(cmd, "survey"))) {
+		t(bus_open(&bus, argv[0], BUS_WRONLY));
+		if (!strcmp(cmd, "survey")) {
+			stream_fd = STDOUT_FILENO;
+			signal(SIGPIPE, SIG_IGN);
+			t(bus_survey(&bus, argv[1], stream_message, NULL, targ ? &deadline : NULL, CLOCK_MONOTONIC));
+			t(bus_close(&bus));
+		} else {
+			t(bus_call(&bus, argv[1], reply, targ ? &deadline : NULL, CLOCK_MONOTONIC));
+			t(bus_close(&bus));
+			printf("%s\n", reply);
+			t(fflush(stdout) ? -1 : 0);
+		}
+
+	/* Reply to a call on a bus. */
+	} else if ((argc == 3) && !strcmp(cmd, "reply")) {
+		t(bus_open(&bus, argv[0], BUS_WRONLY));
+		t(bus_reply(&bus, argv[1], argv[2]));
+		t(bus_close(&bus));
+
+	/* Offer a channel over a bus, and send lines from stdin over it. */
+	} else if ((argc == 2) && !strcmp(cmd, "offer")) {
+		t(bus_open(&bus, argv[0], BUS_WRONLY));
+		t(bus_channel_offer(&bus, argv[1], &channel, targ ? &deadline : NULL, CLOCK_MONOTONIC));
+		t(bus_close(&bus));
+		r = send_stream(&channel, STDIN_FILENO);
+		bus_channel_close(&channel);
+		t(r);
+
+	/* Accept a channel offered over a bus, and print what is sent over it. */
+	} else if ((argc == 2) && !strcmp(cmd, "accept")) {
+		channel_name = argv[1];
+		t(bus_open(&bus, argv[0], BUS_RDONLY));
+		t(bus_read(&bus, accept_offer, &channel));
+		t(bus_close(&bus));
+		stream_fd = STDOUT_FILENO;
+		signal(SIGPIPE, SIG_IGN);
+		r = 1;
+		while ((received = bus_channel_receive(&channel, 0)))
+			if ((r = stream_message(received, NULL)) < 1)
+				break;
+		bus_channel_close(&channel);
+		if (!received && errno != EPIPE)
+			goto fail;
+		t(r);
+
+	/* Record messages on a bus. */
+	} else if ((argc == 2) && !strcmp(cmd, "record")) {
+		if (strcmp(argv[1], "-"))
+			t(fd = open(argv[1], O_RDWR | O_CREAT | O_APPEND, 0666));
+		stream_fd = fd < 0 ? STDOUT_FILENO : fd;
+		t(start_recording(stream_fd));
+		t(bus_open(&bus, argv[0], BUS_RDONLY));
+		t(bus_read(&bus, record_message, NULL));
+		t(bus_close(&bus));
+		if (fd >= 0)
+			close(fd);
+
+	/* Print the state of a bus. */
+	} else if ((argc == 1) && !strcmp(cmd, "stat")) {
+		t(bus_open(&bus, argv[0], BUS_RDONLY));
+		t(print_state(&bus));
 		t(bus_close(&bus));
 
 	/* Change permissions. */
-	} else if ((argc == 3) && !strcmp(argv[0], "chmod")) {
-		t(parse_mode(argv[1], &mode_andnot, &mode_or));
-		t(stat(argv[2], &attr));
+	} else if ((argc == 2) && !strcmp(cmd, "chmod")) {
+		t(parse_mode(argv[0], &mode_andnot, &mode_or));
+		t(stat(argv[1], &attr));
 		attr.st_mode &= ~mode_andnot;
 		attr.st_mode |= mode_or;
-		t(bus_chmod(argv[2], attr.st_mode));
+		t(bus_chmod(argv[1], attr.st_mode));
 
 	/* Change ownership. */
-	} else if ((argc == 3) && !strcmp(argv[0], "chown")) {
-		if (strchr(argv[1], ':')) {
-			t(parse_owner(argv[1], &uid, &gid));
-			t(bus_chown(argv[2], uid, gid));
+	} else if ((argc == 2) && !strcmp(cmd, "chown")) {
+		if (strchr(argv[0], ':')) {
+			t(parse_owner(argv[0], &uid, &gid));
+			t(bus_chown(argv[1], uid, gid));
 		} else {
-			t(parse_owner(argv[1], &uid, NULL));
-			t(stat(argv[2], &attr));
-			t(bus_chown(argv[2], uid, attr.st_gid));
+			t(parse_owner(argv[0], &uid, NULL));
+			t(stat(argv[1], &attr));
+			t(bus_chown(argv[1], uid, attr.st_gid));
 		}
 
 	/* Change group. */
-	} else if ((argc == 3) && !strcmp(argv[0], "chgrp")) {
-		t(parse_owner(argv[1], NULL, &gid));
-		t(stat(argv[2], &attr));
-		t(bus_chown(argv[2], attr.st_uid, gid));
+	} else if ((argc == 2) && !strcmp(cmd, "chgrp")) {
+		t(parse_owner(argv[0], NULL, &gid));
+		t(stat(argv[1], &attr));
+		t(bus_chown(argv[1], attr.st_uid, gid));
 
 	} else
 		return 2;
@@ -381,5 +3275,9 @@ fail:
 	if (!errno)
 		return 2;
 	perror(argv0);
+	if (pid > 0) {
+		close(stream_fd);
+		waitpid(pid, NULL, 0);
+	}
 	return 1;
 }
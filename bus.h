@@ -7,6 +7,7 @@
 # define _DEFAULT_SOURCE
 #endif
 #include <sys/types.h>
+#include <stdint.h>
 #include <time.h>
 
 
@@ -44,12 +45,80 @@
  */
 #define BUS_INTR  4
 
+/**
+ * Maintain statistics in the bus, see `bus_stats`
+ */
+#define BUS_STATS  8
+
+/**
+ * Keep a registry of the listeners in the bus, see `bus_listeners`
+ */
+#define BUS_REGISTRY  16
+
+/**
+ * Store the bus in its file, which is mapped into the
+ * memory of the processes using the bus, rather than in
+ * an XSI semaphore array and an XSI shared memory
+ */
+#define BUS_MAPPED  32
+
+/**
+ * Let multiple processes broadcast on the bus concurrently, each
+ * message is written to its own slot and listeners receive the
+ * messages in the order they were broadcasted, implies `BUS_MAPPED`
+ */
+#define BUS_CONCURRENT  128
+
+/**
+ * Keep a reply area in the bus, so that processes
+ * can call each other over it, see `bus_call`
+ */
+#define BUS_CALLS  256
+
+/**
+ * Keep a response area in the bus, so that processes
+ * can survey the listeners, see `bus_survey`
+ */
+#define BUS_SURVEYS  512
+
+/**
+ * Keep a retained area in the bus, so that processes
+ * can retain messages in it, see `bus_write_retained`
+ */
+#define BUS_RETAINED  1024
+
+/**
+ * Append every message broadcasted on the bus to a journal,
+ * a file next to the bus file, that listeners can read from
+ * with persistent cursors, see `bus_read_journal`, cannot
+ * be combined with `BUS_PARTITIONS`
+ */
+#define BUS_JOURNAL  2048
+
+/**
+ * Create the bus with `n` partitions, from 2 to `BUS_MAX_PARTITIONS`,
+ * each with its own synchronisation state and message area, see
+ * `bus_write_keyed` and `bus_subscribe`, cannot be combined
+ * with `BUS_MAPPED` or `BUS_CONCURRENT`
+ * 
+ * @param   n:int  The number of partitions
+ * @return  :int   The flag
+ */
+#define BUS_PARTITIONS(n)  ((int)(n) << 16)
+
 /**
  * Function shall fail with errno set to `EAGAIN`
  * if the it would block and this flag is used
  */
 #define BUS_NOWAIT  1
 
+/**
+ * Let `bus_write_async` broadcast the message together with adjacent
+ * queued messages, for the same bus and with this flag, as one
+ * message where they are separated by newlines
+ */
+#define BUS_BATCH  2
+
 
 
 /**
@@ -59,10 +128,126 @@
  */
 #define BUS_MEMORY_SIZE  2048
 
+/**
+ * The number of buckets in a `struct bus_histogram`
+ */
+#define BUS_HISTOGRAM_BUCKETS  32
+
+/**
+ * The number of listeners the registry of a bus can hold,
+ * additional listeners are not registered
+ */
+#define BUS_REGISTRY_SLOTS  64
+
+/**
+ * The number of calls, see `bus_call`, that
+ * can await a reply on a bus at the same time
+ */
+#define BUS_CALL_SLOTS  64
+
+/**
+ * The number of responses, see `bus_respond`, that a
+ * survey can collect, additional responses are refused
+ */
+#define BUS_SURVEY_SLOTS  64
+
+/**
+ * The maximum size of a response to a survey,
+ * including the NUL-termination
+ */
+#define BUS_RESPONSE_SIZE  256
+
+/**
+ * The number of messages that can be queued in each
+ * direction of a channel, see `bus_channel_offer`
+ */
+#define BUS_CHANNEL_SLOTS  16
+
+/**
+ * The number of keys, see `bus_write_retained`,
+ * that messages can be retained under
+ */
+#define BUS_RETAINED_SLOTS  64
+
+/**
+ * The maximum size of a key that messages are retained
+ * under, including the NUL-termination
+ */
+#define BUS_RETAINED_KEY_SIZE  64
+
+/**
+ * The number of messages the journal of a bus, see
+ * `BUS_JOURNAL`, holds before the oldest are overwritten
+ */
+#define BUS_JOURNAL_SLOTS  1024
+
+/**
+ * The number of cursors, see `bus_read_journal`,
+ * that the journal of a bus can hold
+ */
+#define BUS_JOURNAL_CURSORS  64
+
+/**
+ * The maximum size of the name of a cursor,
+ * including the NUL-termination
+ */
+#define BUS_CURSOR_NAME_SIZE  64
+
+/**
+ * The number of messages, see `bus_write_async`,
+ * that can be queued in a process at the same time
+ */
+#define BUS_ASYNC_SLOTS  256
+
+/**
+ * The maximum number of partitions of a bus, see `BUS_PARTITIONS`
+ */
+#define BUS_MAX_PARTITIONS  64
+
+/**
+ * The bits of the key of an XSI semaphore array or an XSI
+ * shared memory that are fixed for objects created by
+ * `bus_create`, see `BUS_KEY_TAG`
+ */
+#define BUS_KEY_MASK  0x7F000000L
+
+/**
+ * The keys of the XSI semaphore arrays and XSI shared memories
+ * created by `bus_create` satisfy `(key & BUS_KEY_MASK) == BUS_KEY_TAG`,
+ * this lets `bus gc` find objects left over by removed buses
+ */
+#define BUS_KEY_TAG  0x62000000L
+
+
+
+/**
+ * Control block of a bus, internal to libbus
+ */
+struct bus_control;
+
+/**
+ * Header of a bus created with `BUS_MAPPED`, internal to libbus
+ */
+struct bus_map;
+
+/**
+ * Shared memory of a channel, internal to libbus
+ */
+struct bus_channel_memory;
+
+/**
+ * Header of the journal of a bus created with `BUS_JOURNAL`, internal to libbus
+ */
+struct bus_journal;
+
 
 
 /**
  * Bus information
+ * 
+ * Applications allocate this structure themselves, so adding,
+ * removing or reordering its members changes the ABI of the
+ * library and requires a new major version of it
  */
 typedef struct bus
 {
@@ -93,9 +278,350 @@ typedef struct bus
 	 */
 	int first_poll;
 
+	/**
+	 * The control block of the bus, `NULL` if the bus
+	 * was not created with any feature that requires it
+	 */
+	struct bus_control *control;
+
+	/**
+	 * When `bus_poll` last received a message, used
+	 * for statistics
+	 */
+	uint64_t received;
+
+	/**
+	 * The index of the slot in the listener registry that
+	 * `bus_poll_start` registered the thread in, -1 if none
+	 */
+	int slot;
+
+	/**
+	 * The mapped bus file, `NULL` if the bus was
+	 * not created with `BUS_MAPPED`
+	 */
+	struct bus_map *map;
+
+	/**
+	 * The file descriptor of the mapped bus file,
+	 * -1 if the bus was not created with `BUS_MAPPED`
+	 */
+	int map_fd;
+
+	/**
+	 * The index of the slot in the mapped bus file
+	 * that `bus_poll_start` claimed for the thread
+	 */
+	int map_slot;
+
+	/**
+	 * Non-zero if the bus uses the synchronous
+	 * protocol variant, see `bus_create`
+	 */
+	int synchronous;
+
+	/**
+	 * The number of partitions of the bus, 1 unless
+	 * the bus was created with `BUS_PARTITIONS`
+	 */
+	int partitions;
+
+	/**
+	 * The partitions of the bus, each opened as a bus of its
+	 * own, `NULL` unless the bus has more than one partition
+	 */
+	struct bus *partition;
+
+	/**
+	 * The partitions that `bus_read` and `bus_poll` listen
+	 * on, bit `i` is set for partition `i`, see `bus_subscribe`
+	 */
+	uint64_t subscribed;
+
+	/**
+	 * The mapped journal file, `NULL` if the bus
+	 * was not created with `BUS_JOURNAL`
+	 */
+	struct bus_journal *journal;
+
 } bus_t;
 
 
+/**
+ * One end of a channel, see `bus_channel_offer`
+ */
+typedef struct bus_channel
+{
+	/**
+	 * The shared memory of the channel
+	 */
+	struct bus_channel_memory *memory;
+
+	/**
+	 * 0 for the offering end, 1 for the accepting end
+	 */
+	int end;
+
+	/**
+	 * Non-zero if the message last returned by
+	 * `bus_channel_receive` has not been released
+	 */
+	int pending;
+
+} bus_channel_t;
+
+
+/**
+ * Distribution of durations measured on a bus
+ */
+struct bus_histogram
+{
+	/**
+	 * The number of measurements
+	 */
+	uint64_t count;
+
+	/**
+	 * The sum of the measurements, in nanoseconds
+	 */
+	uint64_t total;
+
+	/**
+	 * The number of measurements, in nanoseconds, whose
+	 * base-2 logarithm, rounded down, is the index, except
+	 * that the first bucket includes 0 and the last bucket
+	 * includes all longer measurements
+	 */
+	uint64_t buckets[BUS_HISTOGRAM_BUCKETS];
+};
+
+
+/**
+ * Statistics of a bus, see `bus_stats`
+ */
+struct bus_stats
+{
+	/**
+	 * The number of broadcasted messages
+	 */
+	uint64_t messages;
+
+	/**
+	 * The number of bytes in the broadcasted
+	 * messages, excluding NUL-termination
+	 */
+	uint64_t bytes;
+
+	/**
+	 * The number of failed broadcasts, including
+	 * those that failed because they would block
+	 */
+	uint64_t failed;
+
+	/**
+	 * The number of times a listener has
+	 * acknowledged a message
+	 */
+	uint64_t deliveries;
+
+	/**
+	 * The number of times a listener has skipped a message
+	 * because it had expired, see `bus_write_expiring`
+	 */
+	uint64_t expired;
+
+	/**
+	 * How long broadcasting processes have waited for
+	 * exclusive access to the bus, that is, for the
+	 * previous broadcast and its listeners to finish
+	 */
+	struct bus_histogram lock;
+
+	/**
+	 * How long broadcasting processes have waited for
+	 * every listener to acknowledge their messages
+	 */
+	struct bus_histogram broadcast;
+
+	/**
+	 * How long listeners have taken to acknowledge
+	 * messages, from when they received them
+	 */
+	struct bus_histogram acknowledge;
+};
+
+
+/**
+ * Decoded snapshot of the internal state of a bus
+ */
+struct bus_state
+{
+	/**
+	 * The number of processes listening on the bus
+	 */
+	unsigned long listeners;
+
+	/**
+	 * The number of listeners that are waiting for a message
+	 */
+	unsigned long waiting_listeners;
+
+	/**
+	 * The number of listeners that have not yet acknowledged
+	 * the message that is being broadcasted, 0 if no
+	 * message is being broadcasted
+	 */
+	unsigned long unacknowledged;
+
+	/**
+	 * The number of listeners that have acknowledged the
+	 * last message but have not yet started waiting for
+	 * the next message
+	 */
+	unsigned long acknowledging;
+
+	/**
+	 * Non-zero if and only if a message is being broadcasted
+	 */
+	int broadcasting;
+
+	/**
+	 * The number of processes that are waiting to
+	 * broadcast a message, not counting the process
+	 * that is broadcasting
+	 */
+	unsigned long waiting_writers;
+
+	/**
+	 * The values of the bus's semaphores, in the order
+	 * S, W, X, Q, N, see the protocol for their meaning
+	 */
+	unsigned short semaphores[5];
+
+	/**
+	 * The number of used elements in `semaphores`,
+	 * 0 if the bus was created with `BUS_MAPPED`
+	 */
+	int semaphore_count;
+
+	/**
+	 * The size of the shared memory, in bytes
+	 */
+	size_t size;
+
+	/**
+	 * The number of times the shared memory is attached,
+	 * 0 if the bus was created with `BUS_MAPPED`
+	 */
+	unsigned long attached;
+
+	/**
+	 * The user ID of the bus's owner
+	 */
+	uid_t uid;
+
+	/**
+	 * The group ID of the bus's group
+	 */
+	gid_t gid;
+
+	/**
+	 * The permissions of the bus
+	 */
+	mode_t mode;
+
+	/**
+	 * The ID of the process that created the bus
+	 */
+	pid_t creator;
+
+	/**
+	 * The last time a process operated on the
+	 * bus's semaphores, 0 if never
+	 */
+	time_t last_operation;
+
+	/**
+	 * The sequence number of the last broadcasted message,
+	 * 0 if the bus was not created with `BUS_MAPPED` or
+	 * any feature that requires a control block
+	 */
+	uint64_t sequence;
+
+	/**
+	 * Non-zero if the bus uses the synchronous
+	 * protocol variant, see `bus_create`
+	 */
+	int synchronous;
+
+	/**
+	 * The number of messages that can be broadcasted
+	 * concurrently, which is 1 unless the bus was
+	 * created with `BUS_CONCURRENT`
+	 */
+	unsigned long slots;
+
+	/**
+	 * The number of partitions of the bus, 1 unless it was
+	 * created with `BUS_PARTITIONS`, in which case the other
+	 * counters are summed over the partitions
+	 */
+	unsigned long partitions;
+
+	/**
+	 * The number of calls that are awaiting a reply, 0
+	 * unless the bus was created with `BUS_CALLS`
+	 */
+	unsigned long calls;
+};
+
+
+/**
+ * Entry in the listener registry of a bus, see `bus_listeners`
+ */
+struct bus_listener
+{
+	/**
+	 * The ID of the listening process
+	 */
+	pid_t pid;
+
+	/**
+	 * Non-zero unless the process has died without
+	 * unregistering itself, such entries are reused
+	 * when another listener registers
+	 */
+	int alive;
+
+	/**
+	 * When the listener registered, in nanoseconds
+	 * since the Epoch
+	 */
+	uint64_t registered;
+
+	/**
+	 * The sequence number of the last message the
+	 * listener received
+	 */
+	uint64_t received;
+
+	/**
+	 * The sequence number of the last message the
+	 * listener acknowledged, if this is less than
+	 * `received` the listener is still processing
+	 * the message
+	 */
+	uint64_t acknowledged;
+
+	/**
+	 * When the listener last acknowledged a message, or
+	 * registered if it has not acknowledged any message,
+	 * in nanoseconds since the Epoch
+	 */
+	uint64_t acknowledged_at;
+};
+
+
 
 /**
  * Create a new bus
@@ -104,7 +630,17 @@ typedef struct bus
  * @param   flags     `BUS_EXCL` (if `file` is not `NULL`) to fail if the file
  *                    already exists, otherwise if the file exists, nothing
  *                    will happen;
- *                    `BUS_INTR` to fail if interrupted
+ *                    `BUS_INTR` to fail if interrupted;
+ *                    `BUS_STATS` to maintain statistics in the bus;
+ *                    `BUS_REGISTRY` to keep a registry of the listeners;
+ *                    `BUS_MAPPED` to store the bus in its file rather
+ *                    than in XSI IPC objects;
+ *                    `BUS_CALLS` to keep a reply area for `bus_call`;
+ *                    `BUS_SURVEYS` to keep a response area for `bus_survey`;
+ *                    `BUS_RETAINED` to keep a retained area for
+ *                    `bus_write_retained`;
+ *                    `BUS_JOURNAL` to append the messages to a journal
+ *                    for `bus_read_journal`
  * @param   out_file  Output parameter for the pathname of the bus
  * @return            0 on success, -1 on error
  */
@@ -133,6 +669,26 @@ int bus_unlink(const char *);
 BUS_COMPILER_GCC(__attribute__((__nonnull__, __warn_unused_result__)))
 int bus_open(bus_t *restrict, const char *restrict, int);
 
+/**
+ * Open an existing bus by its name
+ * 
+ * The pathname of the bus is taken from the environment variable
+ * `BUS_${name}` if `name` is one of the standard names, otherwise
+ * from `${name}_BUS`, and if the variable is not set, the bus
+ * `$XDG_RUNTIME_DIR/bus/${name}` is used. The keys and IDs of
+ * buses that have been opened before, including buses with
+ * partitions, are cached, so opening them again does not require
+ * reading their file, but their shared memory is still attached
+ * 
+ * @param   bus    Bus information to fill
+ * @param   name   The name of the bus, e.g. "GENERIC"
+ * @param   flags  `BUS_RDONLY`, `BUS_WRONLY` or `BUS_RDWR`,
+ *                 the value must not be negative
+ * @return         0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__, __warn_unused_result__)))
+int bus_open_named(bus_t *restrict, const char *restrict, int);
+
 /**
  * Close a bus
  * 
@@ -172,6 +728,178 @@ int bus_write(const bus_t *, const char *, int);
 BUS_COMPILER_GCC(__attribute__((__nonnull__(1, 2), __warn_unused_result__)))
 int bus_write_timed(const bus_t *, const char *, const struct timespec *, clockid_t);
 
+/**
+ * Broadcast a message on the partition of a bus that a key maps to,
+ * messages with the same key are received in the order they were
+ * broadcasted, on a bus without partitions this is `bus_write`
+ * 
+ * The partition is the 32-bit FNV-1a hash of the
+ * key modulo the number of partitions
+ * 
+ * @param   bus      Bus information
+ * @param   key      The key of the message
+ * @param   message  The message to write, may not be longer than
+ *                   `BUS_MEMORY_SIZE` including the NUL-termination
+ * @param   flags    `BUS_NOWAIT` if this function shall fail if
+ *                   another process is currently running this
+ *                   procedure
+ * @return           0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__, __warn_unused_result__)))
+int bus_write_keyed(const bus_t *, const char *, const char *, int);
+
+/**
+ * Broadcast a message on a bus, that listeners shall skip, without
+ * passing it to the application, if they receive it after a deadline
+ * 
+ * The deadline is stored at the beginning of the message, and
+ * removed when the message is received
+ * 
+ * @param   bus      Bus information
+ * @param   key      The key to broadcast the message with, see
+ *                   `bus_write_keyed`, `NULL` for none
+ * @param   message  The message to write, may not be longer than
+ *                   `BUS_MEMORY_SIZE` including the NUL-termination
+ *                   and the deadline, which takes up to 21 bytes
+ * @param   expires  The time the message expires
+ * @param   clockid  The ID of the clock `expires` is measured with
+ * @param   flags    `BUS_NOWAIT` if this function shall fail if
+ *                   another process is currently running this
+ *                   procedure
+ * @return           0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__(1, 3, 4), __warn_unused_result__)))
+int bus_write_expiring(const bus_t *, const char *, const char *, const struct timespec *, clockid_t, int);
+
+/**
+ * Retain a message under a key, replacing the message that was retained
+ * under it, and broadcast it with the key, see `bus_write_keyed`, the
+ * bus must have been created with `BUS_RETAINED`
+ * 
+ * The retained area stays locked until the message has been broadcasted,
+ * and if the broadcast fails, the message that was retained under the
+ * key before is restored
+ * 
+ * @param   bus      Bus information
+ * @param   key      The key, shorter than `BUS_RETAINED_KEY_SIZE` bytes
+ * @param   message  The message to write, may not be longer than
+ *                   `BUS_MEMORY_SIZE` including the NUL-termination,
+ *                   `NULL` to remove the message retained under
+ *                   `key` without broadcasting anything
+ * @param   flags    `BUS_NOWAIT` if this function shall fail if
+ *                   another process is currently running this
+ *                   procedure
+ * @return           0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__(1, 2), __warn_unused_result__)))
+int bus_write_retained(const bus_t *, const char *, const char *, int);
+
+/**
+ * Get the messages that are retained on a bus, see `bus_write_retained`,
+ * without waiting for them to be broadcasted again
+ * 
+ * The messages are read without locking the bus, a listener that
+ * calls this function from its callback function when it has started
+ * listening, that is, when the message is `NULL`, misses no state,
+ * but may receive a message both from this function and from the bus
+ * 
+ * @param   bus        Bus information
+ * @param   callback   Function to call with each retained message and
+ *                     `user_data`, the message must have been parsed or
+ *                     copied when `callback` returns, `callback` should
+ *                     return either of the the values:
+ *                       *  0:  stop
+ *                       *  1:  continue
+ *                       * -1:  an error has occurred
+ * @param   user_data  Parameter passed to `callback`
+ * @return             0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__(1, 2), __warn_unused_result__)))
+int bus_read_retained(const bus_t *, int (*)(const char *, void *), void *);
+
+/**
+ * Read the messages in the journal of a bus, see `BUS_JOURNAL`,
+ * from where a cursor was last left, the bus must have been
+ * created with `BUS_JOURNAL`
+ * 
+ * The cursor is stored in the journal, and advances past a message
+ * once `callback` has returned 0 or 1 for it, so a process that
+ * restarts resumes with the first message it had not processed,
+ * a new cursor starts at the end of the journal, and a cursor that
+ * falls more than `BUS_JOURNAL_SLOTS` messages behind loses the
+ * oldest messages, in which case the function fails with `errno`
+ * set to `EOVERFLOW` and the cursor is moved past the lost messages,
+ * only one thread at a time can read with a cursor
+ * 
+ * @param   bus        Bus information
+ * @param   cursor     The name of the cursor, shorter
+ *                     than `BUS_CURSOR_NAME_SIZE` bytes
+ * @param   callback   Function to call with each message and `user_data`,
+ *                     and with `NULL` once the cursor has been claimed,
+ *                     the message must have been parsed or copied when
+ *                     `callback` returns, `callback` should return
+ *                     either of the the values:
+ *                       *  0:  stop reading
+ *                       *  1:  continue reading
+ *                       * -1:  an error has occurred, the message
+ *                              will be read again
+ * @param   user_data  Parameter passed to `callback`
+ * @param   flags      `BUS_NOWAIT` to return once every message
+ *                     in the journal has been read, rather than
+ *                     wait for more messages
+ * @return             0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__(1, 2, 3), __warn_unused_result__)))
+int bus_read_journal(const bus_t *, const char *, int (*)(const char *, void *), void *, int);
+
+/**
+ * Remove a cursor from the journal of a bus, see `bus_read_journal`
+ * 
+ * @param   bus     Bus information
+ * @param   cursor  The name of the cursor
+ * @return          0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__, __warn_unused_result__)))
+int bus_forget_cursor(const bus_t *, const char *);
+
+/**
+ * Queue a message to be broadcasted on a bus, and return without
+ * waiting for it to be broadcasted
+ * 
+ * The messages are broadcasted, in the order they were queued, by
+ * a publisher thread that libbus starts the first time this function
+ * is called, the queue is shared by every bus in the process
+ * 
+ * A child process created with fork(2) starts its own publisher
+ * thread, and its queue does not contain the messages that the
+ * parent process had queued
+ * 
+ * @param   bus                            Bus information, the bus must not be closed
+ *                                         until the message has been broadcasted
+ * @param   message                        The message to write, may not be longer than
+ *                                         `BUS_MEMORY_SIZE` including the NUL-termination
+ * @param   completion                     Function to call, from the publisher thread, when
+ *            (message, error, user_data)  the message has been broadcasted, or failed to be,
+ *                                         the input parameters will be the message, 0 or the
+ *                                         `errno` value `bus_write` failed with, and
+ *                                         `user_data`; `NULL` if no function shall be called
+ * @param   user_data                      Parameter passed to `completion`
+ * @param   flags                          `BUS_NOWAIT` if this function shall fail with `errno`
+ *                                         set to `EAGAIN` if `BUS_ASYNC_SLOTS` messages are
+ *                                         already queued; `BUS_BATCH` if the message may be
+ *                                         broadcasted together with adjacent messages
+ * @return                                 0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__(1, 2), __warn_unused_result__)))
+int bus_write_async(const bus_t *, const char *, void (*)(const char *, int, void *), void *, int);
+
+/**
+ * Wait until every message that was queued with `bus_write_async`
+ * before this function was called has been broadcasted, this must
+ * not be called from the completion function of `bus_write_async`
+ */
+void bus_flush(void);
+
 
 /**
  * Listen (in a loop, forever) for new message on a bus
@@ -291,6 +1019,236 @@ const char *bus_poll(bus_t *, int);
 BUS_COMPILER_GCC(__attribute__((__nonnull__(1), __warn_unused_result__)))
 const char *bus_poll_timed(bus_t *, const struct timespec *, clockid_t);
 
+/**
+ * Select the partitions of a bus that `bus_read` and `bus_poll`
+ * shall listen on, by default they listen on all partitions,
+ * `bus_poll` waits on them one at a time
+ * 
+ * @param   bus         Bus information
+ * @param   partitions  The partitions, bit `i` is set for partition `i`
+ * @return              0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__, __warn_unused_result__)))
+int bus_subscribe(bus_t *, uint64_t);
+
+/**
+ * Listen (in a loop, until the callback function stops it) for
+ * new messages on a bus, and pass them to a pool of worker threads
+ * 
+ * Each message is copied into one of a fixed number of buffers
+ * and queued for the workers, and the bus is polled again, which
+ * acknowledges the message, directly. When every buffer is in use,
+ * the bus is not polled again until a worker has returned one
+ * 
+ * @param   bus                     Bus information
+ * @param   callback                Function to call, from one of the worker threads,
+ *            (message, user_data)  when a message is received, see `bus_read`, it
+ *                                  may be called concurrently by different workers.
+ *                                  The message remains valid until `callback` returns,
+ *                                  unless it is held with `bus_dispatch_hold`. When
+ *                                  `callback` returns 0 or -1, no more messages are
+ *                                  received, but the workers still pass those that
+ *                                  have been received to `callback`. `callback` is
+ *                                  invoked with `message` set to `NULL` one time,
+ *                                  from the calling thread, directly after it has
+ *                                  started listening on the bus
+ * @param   user_data               Parameter passed to `callback`
+ * @param   workers                 The number of worker threads
+ * @param   buffers                 The number of message buffers, that is, the
+ *                                  number of messages that can be queued or
+ *                                  held at the same time
+ * @return                          0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__(1, 2), __warn_unused_result__)))
+int bus_dispatch(bus_t *, int (*)(const char *, void *), void *, size_t, size_t);
+
+/**
+ * Keep a message passed to the callback function of `bus_dispatch`
+ * after it returns, without copying it, the message must be released
+ * with `bus_dispatch_release` before `bus_dispatch` can return, and
+ * its buffer cannot be reused until then
+ * 
+ * @param  message  The message
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__)))
+void bus_dispatch_hold(const char *);
+
+/**
+ * Release a message held with `bus_dispatch_hold`
+ * 
+ * @param  message  The message
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__)))
+void bus_dispatch_release(const char *);
+
+
+/**
+ * Broadcast a request on a bus and wait for a reply to it,
+ * the bus must have been created with `BUS_CALLS`
+ * 
+ * The request is broadcasted as "<pid> call <id> <request>",
+ * where <id> is the correlation ID of the call, and the reply,
+ * sent with `bus_reply`, is delivered only to the caller
+ * 
+ * @param   bus      Bus information
+ * @param   request  The request, the broadcasted message may not
+ *                   be longer than `BUS_MEMORY_SIZE` including
+ *                   the NUL-termination
+ * @param   reply    Output parameter for the reply, must be able
+ *                   to hold `BUS_MEMORY_SIZE` bytes
+ * @param   timeout  The time the operation shall fail with errno set
+ *                   to `EAGAIN` if no reply has been received,
+ *                   `NULL` to wait for ever
+ * @param   clockid  The ID of the clock the `timeout` is measured with,
+ *                   it most be a predictable clock
+ * @return           0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__(1, 2, 3), __warn_unused_result__)))
+int bus_call(const bus_t *, const char *, char *, const struct timespec *, clockid_t);
+
+/**
+ * Reply to a call received on a bus, see `bus_call`, only
+ * the first reply to a call is delivered to the caller
+ * 
+ * @param   bus      Bus information
+ * @param   call     The received message with the call
+ * @param   reply    The reply, may not be longer than `BUS_MEMORY_SIZE`
+ *                   including the NUL-termination
+ * @return           0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__, __warn_unused_result__)))
+int bus_reply(const bus_t *, const char *, const char *);
+
+/**
+ * Broadcast a query on a bus and collect the responses that the
+ * listeners attach to it before they acknowledge it, the bus must
+ * have been created with `BUS_SURVEYS`
+ * 
+ * The query is broadcasted as "<pid> survey <id> <query>", where
+ * <id> identifies the survey, and listeners respond with `bus_respond`
+ * 
+ * The function waits, without limit, for every listener to acknowledge
+ * the query, so a listener that does not acknowledge it blocks the
+ * surveying process, and other surveying processes until they time out
+ * 
+ * @param   bus                     Bus information
+ * @param   query                   The query, the broadcasted message may not
+ *                                  be longer than `BUS_MEMORY_SIZE` including
+ *                                  the NUL-termination
+ * @param   callback                Function to call for each response, the input
+ *            (response, user_data) parameters will be the response and `user_data`
+ *                                  from `bus_survey`'s parameter with the same
+ *                                  name. `callback` should return either of the
+ *                                  values:
+ *                                    *  0:  skip the remaining responses
+ *                                    *  1:  continue with the next response
+ *                                    * -1:  an error has occurred
+ * @param   user_data               Parameter passed to `callback`
+ * @param   publish_timeout         The time the operation shall fail with errno set
+ *                                  to `EAGAIN` if the query has not been published,
+ *                                  `NULL` to wait for ever
+ * @param   clockid                 The ID of the clock the `publish_timeout` is measured
+ *                                  with, it most be a predictable clock
+ * @return                          The number of responses, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__(1, 2, 3), __warn_unused_result__)))
+int bus_survey(const bus_t *, const char *, int (*)(const char *, void *), void *,
+               const struct timespec *, clockid_t);
+
+/**
+ * Respond to a survey received on a bus, see `bus_survey`, this must
+ * be done before the survey is acknowledged, that is, from the callback
+ * function of `bus_read` or before `bus_poll` is called again
+ * 
+ * @param   bus       Bus information
+ * @param   survey    The received message with the survey
+ * @param   response  The response, may not be longer than
+ *                    `BUS_RESPONSE_SIZE` including the NUL-termination
+ * @return            0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__, __warn_unused_result__)))
+int bus_respond(const bus_t *, const char *, const char *);
+
+
+/**
+ * Offer a channel over a bus, that is, a dedicated ring in
+ * shared memory over which the offering process and the
+ * accepting process can send messages to each other without
+ * waking up the other listeners on the bus
+ * 
+ * The offer is broadcasted as "<pid> channel <id> <name>",
+ * and must be accepted with `bus_channel_accept` before
+ * it is acknowledged, otherwise it is withdrawn
+ * 
+ * @param   bus      Bus information
+ * @param   name     The name of the channel, the broadcasted message may
+ *                   not be longer than `BUS_MEMORY_SIZE` including the
+ *                   NUL-termination
+ * @param   channel  Output parameter for the offering end of the channel
+ * @param   timeout  The time the operation shall fail with errno set
+ *                   to `EAGAIN` if the offer has not been broadcasted,
+ *                   `NULL` to wait for ever
+ * @param   clockid  The ID of the clock the `timeout` is measured with,
+ *                   it most be a predictable clock
+ * @return           0 on success, -1 on error, `errno` is set to
+ *                   `ECONNREFUSED` if the offer was not accepted
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__(1, 2, 3), __warn_unused_result__)))
+int bus_channel_offer(const bus_t *, const char *, bus_channel_t *, const struct timespec *, clockid_t);
+
+/**
+ * Accept a channel offered over a bus, see `bus_channel_offer`,
+ * only the first process to accept an offer gets the channel
+ * 
+ * @param   offer    The received message with the offer
+ * @param   channel  Output parameter for the accepting end of the channel
+ * @return           0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__, __warn_unused_result__)))
+int bus_channel_accept(const char *, bus_channel_t *);
+
+/**
+ * Send a message over a channel to the other end
+ * 
+ * @param   channel  The channel
+ * @param   message  The message, may not be longer than
+ *                   `BUS_MEMORY_SIZE` including the NUL-termination
+ * @param   flags    `BUS_NOWAIT` if this function shall fail with
+ *                   `errno` set to `EAGAIN` if `BUS_CHANNEL_SLOTS`
+ *                   messages are already waiting to be received
+ * @return           0 on success, -1 on error, `errno` is set to
+ *                   `EPIPE` if the other end has been closed
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__, __warn_unused_result__)))
+int bus_channel_send(const bus_channel_t *, const char *, int);
+
+/**
+ * Receive a message sent over a channel by the other end
+ * 
+ * The message remains valid until `bus_channel_receive`
+ * or `bus_channel_close` is called again
+ * 
+ * @param   channel  The channel
+ * @param   flags    `BUS_NOWAIT` if this function shall fail with
+ *                   `errno` set to `EAGAIN` if there isn't already
+ *                   a message available on the channel
+ * @return           The received message, `NULL` on error, `errno`
+ *                   is set to `EPIPE` if the other end has been closed
+ *                   and every message it sent has been received
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__, __warn_unused_result__)))
+const char *bus_channel_receive(bus_channel_t *, int);
+
+/**
+ * Close one end of a channel, the channel is
+ * removed once both ends have been closed
+ * 
+ * @param   channel  The channel
+ * @return           0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__)))
+int bus_channel_close(bus_channel_t *);
+
 
 /**
  * Change the ownership of a bus
@@ -320,6 +1278,54 @@ BUS_COMPILER_GCC(__attribute__((__nonnull__, __warn_unused_result__)))
 int bus_chmod(const char *, mode_t);
 
 
+/**
+ * Get a snapshot of the internal state of a bus
+ * 
+ * The state is read without locking the bus, and is
+ * therefore only a best-effort snapshot if processes
+ * are using the bus
+ * 
+ * @param   bus    Bus information
+ * @param   state  Output parameter for the state of the bus
+ * @return         0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__, __warn_unused_result__)))
+int bus_state(const bus_t *restrict, struct bus_state *restrict);
+
+/**
+ * Get the statistics of a bus, the bus must have
+ * been created with `BUS_STATS`
+ * 
+ * The statistics are read without locking the bus, and
+ * are therefore not necessarily consistent with each
+ * other if processes are using the bus
+ * 
+ * @param   bus    Bus information
+ * @param   stats  Output parameter for the statistics
+ * @return         0 on success, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__, __warn_unused_result__)))
+int bus_stats(const bus_t *restrict, struct bus_stats *restrict);
+
+/**
+ * Get the listeners in the registry of a bus, the bus
+ * must have been created with `BUS_REGISTRY`
+ * 
+ * The registry is read without locking the bus, and
+ * is therefore only a best-effort snapshot if
+ * processes are using the bus
+ * 
+ * @param   bus        Bus information
+ * @param   listeners  Output parameter for the listeners
+ * @param   n          The number of elements in `listeners`
+ * @return             The number of registered listeners, which
+ *                     may exceed `n`, in which case only the first
+ *                     `n` are stored, -1 on error
+ */
+BUS_COMPILER_GCC(__attribute__((__nonnull__(1), __warn_unused_result__)))
+int bus_listeners(const bus_t *restrict, struct bus_listener *restrict, size_t);
+
+
 
 #endif
 
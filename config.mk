@@ -2,7 +2,8 @@ PREFIX    = /usr/local
 MANPREFIX = $(PREFIX)/share/man
 
 CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_GNU_SOURCE
-CFLAGS   = -std=c99 -Wall -Wextra -pedantic -O2 $(CPPFLAGS)
-LDFLAGS  = -s -lrt
+CFLAGS   = -std=c99 -Wall -Wextra -pedantic -O2 -pthread $(CPPFLAGS)
+LDFLAGS  = -s -lrt -pthread
 
 # Add -DSEMUN_ALREADY_DEFINED to CPPFLAGS if `union semun` is already defined by libc
+# Add -DBUS_USDT to CPPFLAGS to add USDT probes, for perf(1), bpftrace(8) and SystemTap, to libbus, this requires <sys/sdt.h>
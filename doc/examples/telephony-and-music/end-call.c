@@ -8,6 +8,7 @@
 
 
 static char message[BUS_MEMORY_SIZE];
+static char key[BUS_RETAINED_KEY_SIZE];
 
 
 
@@ -16,8 +17,10 @@ main()
 {
 	bus_t bus;
 	sprintf(message, "%ji unforce-pause", (intmax_t)getppid());
+	sprintf(key, "call %ji", (intmax_t)getppid());
 	/* Yes, PPID; in this example we pretend the shell is the telephony process. */
 	t(bus_open(&bus, "/tmp/example-bus", BUS_WRONLY));
+	t(bus_write_retained(&bus, key, NULL, 0));
 	t(bus_write(&bus, message, 0));
 	bus_close(&bus);
 	return 0;
@@ -4,6 +4,6 @@
 int
 main()
 {
-	return bus_create("/tmp/example-bus", 0, NULL) && (perror("init"), 1);
+	return bus_create("/tmp/example-bus", BUS_RETAINED, NULL) && (perror("init"), 1);
 }
 
@@ -10,6 +10,7 @@
 static size_t pauser_count = 0;
 static size_t pausers_size = 0;
 static char* pausers = NULL;
+static bus_t bus;
 
 
 
@@ -31,8 +32,8 @@ callback(const char *message, void *user_data)
 {
  	char *msg = NULL;
 	size_t len = 0;
-	if (message == 0)
-		return 1;
+	if (message == 0) /* Learn about the calls that are already active. */
+		return bus_read_retained(&bus, callback, NULL) ? -1 : 1;
 	while ((len < 2047) && message[len])
 		len++;
 	msg = malloc((len + 1) * sizeof(char));
@@ -88,7 +89,6 @@ done:
 int
 main()
 {
-	bus_t bus;
 	t(bus_open(&bus, "/tmp/example-bus", BUS_RDONLY));
 	t(bus_read(&bus, callback, NULL));
 	bus_close(&bus);
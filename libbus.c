@@ -2,29 +2,39 @@
 #include "bus.h"
 
 #include <sys/ipc.h>
+#include <sys/mman.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <linux/futex.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <time.h>
 #include <unistd.h>
 
-
-#ifdef BUS_SEMAPHORES_ARE_SYNCHRONOUS_ME_EVEN_HARDER
-# ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS_ME_HARDER
-#  define BUS_SEMAPHORES_ARE_SYNCHRONOUS_ME_HARDER
-# endif
+#ifdef BUS_USDT
+# include <sys/sdt.h>
 #endif
-#ifdef BUS_SEMAPHORES_ARE_SYNCHRONOUS_ME_HARDER
-# ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS
-#  define BUS_SEMAPHORES_ARE_SYNCHRONOUS
-# endif
+
+
+/* Buses are always created with the default protocol variant, the
+ * synchronous variant is only followed for buses whose file records
+ * it, as it makes broadcasts stall where semaphore operations are not
+ * synchronous, which they are not on Linux. */
+#if defined(BUS_SEMAPHORES_ARE_SYNCHRONOUS) || defined(BUS_SEMAPHORES_ARE_SYNCHRONOUS_ME_HARDER) || \
+    defined(BUS_SEMAPHORES_ARE_SYNCHRONOUS_ME_EVEN_HARDER)
+# error "BUS_SEMAPHORES_ARE_SYNCHRONOUS is no longer supported"
 #endif
 
 
@@ -48,25 +58,1138 @@
  */
 #define Q  3
 
-#ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS_ME_EVEN_HARDER
 /**
- * Semaphore used to notify `bus_read` that it may restore `S`
+ * Semaphore used to notify `bus_read` that it may restore `S`,
+ * not used by buses with the synchronous protocol variant
  */
-# define N  4
+#define N  4
 
 /**
  * The number of semaphores in the semaphore array
+ * 
+ * @param   bus:const bus_t *  The bus
+ * @return  :int               The number of semaphores
  */
-# define BUS_SEMAPHORES  5
-#else
-# define BUS_SEMAPHORES  4
-#endif
+#define BUS_SEMAPHORES(bus)  ((bus)->synchronous ? 4 : 5)
+
+/**
+ * The maximum number of semaphores in the semaphore array
+ */
+#define MAX_SEMAPHORES  5
 
 /**
  * The default permission mits of the bus
  */
 #define DEFAULT_MODE  0600
 
+/**
+ * Magic number that identifies the control block of a bus
+ */
+#define CONTROL_MAGIC  0x42555343UL
+
+/**
+ * Flags for `bus_create` that require a control block
+ */
+#define CONTROL_FLAGS  (BUS_STATS | BUS_REGISTRY | BUS_CALLS | BUS_SURVEYS | BUS_RETAINED | BUS_JOURNAL)
+
+/**
+ * Magic string that starts the file of a bus created with `BUS_MAPPED`
+ */
+#define MAP_MAGIC  "\177BUSMAP\n"
+
+/**
+ * The version of the format of the file of a bus created with `BUS_MAPPED`
+ */
+#define MAP_VERSION  1
+
+/**
+ * The version of the format of the file of a bus created with
+ * `BUS_CONCURRENT`, it is not understood by older versions of libbus
+ */
+#define MAP_VERSION_CONCURRENT  2
+
+/**
+ * The number of message slots in a bus created with `BUS_CONCURRENT`,
+ * which is the number of messages that can be broadcasted concurrently
+ */
+#define MAP_SLOTS  32
+
+/**
+ * The number of listeners a bus created with `BUS_MAPPED` can have
+ */
+#define MAP_LISTENERS  256
+
+/**
+ * How often, in nanoseconds, a process that is waiting on a bus
+ * created with `BUS_MAPPED` checks whether the processes it is
+ * waiting for have died
+ */
+#define MAP_CHECK_INTERVAL  100000000L
+
+/**
+ * The number of partitions requested by the flags of `bus_create`,
+ * 0 or 1 if the bus shall not be partitioned
+ */
+#define PARTITIONS(flags)  ((flags) >> 16)
+
+/**
+ * The size of a buffer that can hold the file of a bus that was not
+ * created with `BUS_MAPPED`: the keys of each partition, the protocol
+ * variant and the number of partitions
+ */
+#define BUS_FILE_SIZE  (2 * BUS_MAX_PARTITIONS * (3 * sizeof(ssize_t) + 2) + 8)
+
+/**
+ * How often, in nanoseconds, the threads that listen on
+ * the partitions of a bus check whether they shall stop
+ */
+#define PARTITION_CHECK_INTERVAL  100000000L
+
+/**
+ * How long, in nanoseconds, `bus_poll` waits on each
+ * subscribed partition of a bus before moving on
+ */
+#define PARTITION_POLL_INTERVAL  1000000L
+
+/**
+ * How often, in nanoseconds, the thread that polls
+ * the bus in `bus_dispatch` checks whether it shall stop
+ */
+#define DISPATCH_CHECK_INTERVAL  100000000L
+
+/**
+ * The first byte of a message written with `bus_write_expiring`,
+ * it is followed by the time the message expires, in nanoseconds
+ * of the monotonic clock, a space, and the message itself
+ */
+#define EXPIRES_MARK  '\001'
+
+/**
+ * Magic string that starts the journal of a bus created with `BUS_JOURNAL`
+ */
+#define JOURNAL_MAGIC  "\177BUSJRN\n"
+
+/**
+ * The version of the format of the journal of a bus
+ */
+#define JOURNAL_VERSION  1
+
+/**
+ * The suffix that is appended to the pathname
+ * of a bus to get the pathname of its journal
+ */
+#define JOURNAL_SUFFIX  ".journal"
+
+
+
+/**
+ * Slot in the listener registry
+ */
+struct registry_slot
+{
+	/**
+	 * The ID of the process the slot is registered
+	 * to, 0 if the slot is free
+	 */
+	int32_t pid;
+
+	/**
+	 * Reserved, always 0
+	 */
+	uint32_t reserved;
+
+	/**
+	 * When the slot was registered, as returned by `realtime_now`
+	 */
+	uint64_t registered;
+
+	/**
+	 * The sequence number of the last received message
+	 */
+	uint64_t received;
+
+	/**
+	 * The sequence number of the last acknowledged message
+	 */
+	uint64_t acknowledged;
+
+	/**
+	 * When the last message was acknowledged, as returned by `realtime_now`
+	 */
+	uint64_t acknowledged_at;
+};
+
+
+/**
+ * Listener slot in the file of a bus created with `BUS_MAPPED`
+ */
+struct map_listener
+{
+	/**
+	 * Robust mutex that the listener holds while it is
+	 * listening, so that other processes can tell
+	 * whether it has died
+	 */
+	pthread_mutex_t alive;
+
+	/**
+	 * Non-zero if the slot is in use
+	 */
+	uint32_t used;
+
+	/**
+	 * The sequence number of the last received message
+	 */
+	uint32_t received;
+
+	/**
+	 * The sequence number of the last acknowledged message
+	 */
+	uint32_t acknowledged;
+
+	/**
+	 * Reserved, always 0
+	 */
+	uint32_t reserved;
+};
+
+
+/**
+ * Message slot in the file of a bus created with `BUS_CONCURRENT`
+ */
+struct map_slot
+{
+	/**
+	 * Robust mutex that the broadcasting process holds from when it
+	 * claims the slot until it has written the message, so that the
+	 * listeners can tell whether it died before it wrote the message
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * The sequence number of the message in the slot,
+	 * listeners wait for it to change
+	 */
+	uint32_t sequence;
+
+	/**
+	 * Non-zero if the broadcasting process died
+	 * before it wrote the message
+	 */
+	uint32_t abandoned;
+
+	/**
+	 * The message
+	 */
+	char message[BUS_MEMORY_SIZE];
+};
+
+
+/**
+ * The file of a bus created with `BUS_MAPPED`, it is
+ * followed by the control block, if the bus has one,
+ * and the message slots, if it was created with
+ * `BUS_CONCURRENT`
+ */
+struct bus_map
+{
+	/**
+	 * `MAP_MAGIC`, written last when the bus is created
+	 */
+	char magic[8];
+
+	/**
+	 * `MAP_VERSION`
+	 */
+	uint32_t version;
+
+	/**
+	 * The size of the file
+	 */
+	uint32_t size;
+
+	/**
+	 * The flags, from `CONTROL_FLAGS`, the bus was created with
+	 */
+	uint32_t flags;
+
+	/**
+	 * The ID of the process that created the bus
+	 */
+	int32_t creator;
+
+	/**
+	 * Robust mutex that the broadcasting process holds,
+	 * this corresponds to `X` for other buses
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * The ID of the broadcasting process, 0 if none
+	 */
+	uint32_t writer;
+
+	/**
+	 * The sequence number of the last broadcasted message,
+	 * listeners wait for it to change, or for buses created
+	 * with `BUS_CONCURRENT`, the last claimed message slot
+	 */
+	uint32_t sequence;
+
+	/**
+	 * Incremented whenever a listener acknowledges a message
+	 * or stops listening, the broadcasting process waits for
+	 * it to change
+	 */
+	uint32_t acknowledgements;
+
+	/**
+	 * The number of message slots, stored at the end of
+	 * the file, 0 unless the bus was created with `BUS_CONCURRENT`
+	 */
+	uint32_t slots;
+
+	/**
+	 * The last time a message was broadcasted, 0 if never
+	 */
+	int64_t last_operation;
+
+	/**
+	 * The listeners
+	 */
+	struct map_listener listeners[MAP_LISTENERS];
+
+	/**
+	 * The message
+	 */
+	char message[BUS_MEMORY_SIZE];
+};
+
+
+/**
+ * Control block, stored in the shared memory directly
+ * after the message, of buses created with features
+ * that require it
+ */
+struct bus_control
+{
+	/**
+	 * `CONTROL_MAGIC`
+	 */
+	uint32_t magic;
+
+	/**
+	 * The size of this structure when the bus was created
+	 */
+	uint32_t size;
+
+	/**
+	 * The flags, from `CONTROL_FLAGS`, the bus was created with
+	 */
+	uint32_t flags;
+
+	/**
+	 * Reserved, always 0
+	 */
+	uint32_t reserved;
+
+	/**
+	 * The sequence number of the last broadcasted message
+	 */
+	uint64_t sequence;
+
+	/**
+	 * Statistics, maintained if `flags & BUS_STATS`
+	 */
+	struct bus_stats stats;
+
+	/**
+	 * The listener registry, maintained if `flags & BUS_REGISTRY`
+	 */
+	struct registry_slot listeners[BUS_REGISTRY_SLOTS];
+};
+
+
+/**
+ * Slot in the reply area, which directly follows the control
+ * block of buses created with `BUS_CALLS`, the correlation
+ * ID of a call is `generation * BUS_CALL_SLOTS + index`
+ */
+struct call_slot
+{
+	/**
+	 * The ID of the calling process, 0 if the slot is free
+	 */
+	int32_t pid;
+
+	/**
+	 * Incremented, skipping 0, whenever the slot is claimed
+	 */
+	uint32_t generation;
+
+	/**
+	 * The generation of the call that is awaiting a reply, 0 if
+	 * none, the replying process clears it before it writes the
+	 * reply, so that only one reply is written
+	 */
+	uint32_t waiting;
+
+	/**
+	 * The generation of the last call that was replied to,
+	 * the calling process waits for it to change
+	 */
+	uint32_t replied;
+
+	/**
+	 * The reply
+	 */
+	char reply[BUS_MEMORY_SIZE];
+};
+
+
+/**
+ * Response in the response area of a bus created with `BUS_SURVEYS`
+ */
+struct survey_response
+{
+	/**
+	 * The generation of the survey the response is to,
+	 * written after the response
+	 */
+	uint32_t survey;
+
+	/**
+	 * Reserved, always 0
+	 */
+	uint32_t reserved;
+
+	/**
+	 * The response
+	 */
+	char response[BUS_RESPONSE_SIZE];
+};
+
+
+/**
+ * The response area, which follows the reply area, if any,
+ * after the control block of buses created with `BUS_SURVEYS`
+ */
+struct survey_area
+{
+	/**
+	 * The ID of the process that is surveying the
+	 * listeners, 0 if none, only one process can
+	 * survey the listeners at a time
+	 */
+	int32_t surveyor;
+
+	/**
+	 * Incremented whenever `surveyor` is cleared, processes
+	 * that wait to survey the listeners wait for it to change
+	 */
+	uint32_t released;
+
+	/**
+	 * Incremented, skipping 0, for each survey
+	 */
+	uint32_t generation;
+
+	/**
+	 * The generation of the survey that accepts responses, 0 if none
+	 */
+	uint32_t active;
+
+	/**
+	 * The number of claimed elements in `responses`
+	 */
+	uint32_t count;
+
+	/**
+	 * Reserved, always 0
+	 */
+	uint32_t reserved;
+
+	/**
+	 * The responses
+	 */
+	struct survey_response responses[BUS_SURVEY_SLOTS];
+};
+
+
+/**
+ * Message in the retained area of a bus created with `BUS_RETAINED`
+ */
+struct retained_slot
+{
+	/**
+	 * Incremented before and after the slot is
+	 * written, so it is odd while it is written
+	 */
+	uint32_t sequence;
+
+	/**
+	 * Reserved, always 0
+	 */
+	uint32_t reserved;
+
+	/**
+	 * The key the message is retained under, empty if the slot is free
+	 */
+	char key[BUS_RETAINED_KEY_SIZE];
+
+	/**
+	 * The message
+	 */
+	char message[BUS_MEMORY_SIZE];
+};
+
+
+/**
+ * The retained area, which follows the response area, if any,
+ * after the control block of buses created with `BUS_RETAINED`
+ */
+struct retained_area
+{
+	/**
+	 * The ID of the process that is writing to the
+	 * area, or broadcasting a message it has retained,
+	 * 0 if none, only one process can write to the
+	 * area at a time
+	 */
+	int32_t writer;
+
+	/**
+	 * Incremented whenever `writer` is cleared, processes
+	 * that wait to write to the area wait for it to change
+	 */
+	uint32_t released;
+
+	/**
+	 * The retained messages
+	 */
+	struct retained_slot slots[BUS_RETAINED_SLOTS];
+};
+
+
+/**
+ * Message in the journal of a bus created with `BUS_JOURNAL`
+ */
+struct journal_record
+{
+	/**
+	 * The sequence number of the message, the first message
+	 * is 1, 0 while the record is written
+	 */
+	uint64_t sequence;
+
+	/**
+	 * The message
+	 */
+	char message[BUS_MEMORY_SIZE];
+};
+
+
+/**
+ * Persistent position of a reader in the journal of a bus
+ */
+struct journal_cursor
+{
+	/**
+	 * The name of the cursor, empty if the slot is free
+	 */
+	char name[BUS_CURSOR_NAME_SIZE];
+
+	/**
+	 * The ID of the process that is reading with
+	 * the cursor, 0 if none
+	 */
+	int32_t reader;
+
+	/**
+	 * Reserved, always 0
+	 */
+	uint32_t reserved;
+
+	/**
+	 * The sequence number of the last message
+	 * the reader has processed
+	 */
+	uint64_t acknowledged;
+};
+
+
+/**
+ * Header of the journal of a bus created with `BUS_JOURNAL`,
+ * it is followed by `slots` records, a ring where the message
+ * with the sequence number `n` is stored at `(n - 1) % slots`
+ */
+struct bus_journal
+{
+	/**
+	 * `JOURNAL_MAGIC`, written last when the journal is created
+	 */
+	char magic[8];
+
+	/**
+	 * `JOURNAL_VERSION`
+	 */
+	uint32_t version;
+
+	/**
+	 * The number of records
+	 */
+	uint32_t slots;
+
+	/**
+	 * The size of the file
+	 */
+	uint64_t size;
+
+	/**
+	 * The sequence number of the last appended message,
+	 * messages are appended while the bus is locked for
+	 * broadcasting, so only one process appends at a time
+	 */
+	uint64_t sequence;
+
+	/**
+	 * The sequence number of the last message that
+	 * has been flushed to disk
+	 */
+	uint64_t synced;
+
+	/**
+	 * The ID of the process that is flushing the journal
+	 * to disk, 0 if none, only one process flushes it at
+	 * a time, and the others wait for it
+	 */
+	int32_t syncer;
+
+	/**
+	 * Incremented whenever `syncer` is cleared, processes
+	 * that wait for the journal to be flushed wait for it
+	 * to change
+	 */
+	uint32_t flushed;
+
+	/**
+	 * Incremented whenever a message is appended,
+	 * readers wait for it to change
+	 */
+	uint32_t appended;
+
+	/**
+	 * The number of readers waiting for `appended` to change
+	 */
+	uint32_t waiting;
+
+	/**
+	 * The ID of the process that is claiming or removing
+	 * a cursor, 0 if none, only one process can do so
+	 * at a time
+	 */
+	int32_t editor;
+
+	/**
+	 * Incremented whenever `editor` is cleared, processes that
+	 * wait to claim or remove a cursor wait for it to change
+	 */
+	uint32_t released;
+
+	/**
+	 * The cursors
+	 */
+	struct journal_cursor cursors[BUS_JOURNAL_CURSORS];
+};
+
+
+/**
+ * One direction of a channel, a ring of messages
+ * with one sending and one receiving process
+ */
+struct channel_ring
+{
+	/**
+	 * The number of messages that have been sent,
+	 * the receiving process waits for it to change
+	 */
+	uint32_t sent;
+
+	/**
+	 * The number of messages that have been released by the
+	 * receiving process, the sending process waits for it
+	 * to change when the ring is full
+	 */
+	uint32_t released;
+
+	/**
+	 * Non-zero while the receiving process is waiting for
+	 * `sent` to change, so that it is only woken up then
+	 */
+	uint32_t receiver_waiting;
+
+	/**
+	 * Non-zero while the sending process is waiting for
+	 * `released` to change, so that it is only woken up then
+	 */
+	uint32_t sender_waiting;
+
+	/**
+	 * The messages, message `i` is stored
+	 * in element `i % BUS_CHANNEL_SLOTS`
+	 */
+	char messages[BUS_CHANNEL_SLOTS][BUS_MEMORY_SIZE];
+};
+
+
+/**
+ * Shared memory of a channel, see `bus_channel_offer`
+ */
+struct bus_channel_memory
+{
+	/**
+	 * The IDs of the offering process and of the accepting
+	 * process, the latter is 0 until the channel has been
+	 * accepted and -1 if the offer has been withdrawn
+	 */
+	int32_t pid[2];
+
+	/**
+	 * Non-zero for each end that has been closed
+	 */
+	uint32_t closed[2];
+
+	/**
+	 * The rings, `rings[i]` is sent on by end `i`,
+	 * the offering process is end 0
+	 */
+	struct channel_ring rings[2];
+};
+
+
+/**
+ * Keys and IDs of a partition of a bus opened with `bus_open_named`
+ */
+struct named_partition
+{
+	/**
+	 * The key for the semaphore array
+	 */
+	key_t key_sem;
+
+	/**
+	 * The key for the shared memory
+	 */
+	key_t key_shm;
+
+	/**
+	 * The ID of the semaphore array
+	 */
+	int sem_id;
+
+	/**
+	 * The ID of the shared memory
+	 */
+	int shm_id;
+};
+
+
+/**
+ * Cached resolution of a bus opened with `bus_open_named`
+ */
+struct named_bus
+{
+	/**
+	 * The next entry in the cache
+	 */
+	struct named_bus *next;
+
+	/**
+	 * The pathname of the bus
+	 */
+	char *path;
+
+	/**
+	 * The device of the file of the bus when it was cached
+	 */
+	dev_t dev;
+
+	/**
+	 * The inode of the file of the bus when it was cached
+	 */
+	ino_t ino;
+
+	/**
+	 * The modification time of the file of the bus when it was cached
+	 */
+	struct timespec mtime;
+
+	/**
+	 * Whether the bus was created with `BUS_MAPPED`
+	 */
+	int mapped;
+
+	/**
+	 * Whether the bus uses the synchronous protocol variant
+	 */
+	int synchronous;
+
+	/**
+	 * The number of partitions, 1 if the bus does not have
+	 * partitions, and 0 if it was created with `BUS_MAPPED`
+	 */
+	int partitions;
+
+	/**
+	 * The keys and IDs of the partitions, `partitions` of them
+	 */
+	struct named_partition *parts;
+};
+
+
+/**
+ * State shared by the threads that listen on
+ * the partitions of a bus in `bus_read`
+ */
+struct partitioned_read
+{
+	/**
+	 * Lock for this structure, it is held while
+	 * the callback function is running
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * Signalled when a thread has started listening, or
+	 * when the threads may start calling `callback`
+	 */
+	pthread_cond_t cond;
+
+	/**
+	 * The function to call when a message is received
+	 */
+	int (*callback)(const char *message, void *user_data);
+
+	/**
+	 * Parameter passed to `callback`
+	 */
+	void *user_data;
+
+	/**
+	 * The time the operation shall fail, `NULL` for never
+	 */
+	const struct timespec *timeout;
+
+	/**
+	 * The ID of the clock `timeout` is measured with,
+	 * the threads also use it for their check interval
+	 */
+	clockid_t clockid;
+
+	/**
+	 * The number of threads that have started
+	 * listening, or failed to do so
+	 */
+	int started;
+
+	/**
+	 * Non-zero when the threads may start calling `callback`
+	 */
+	int ready;
+
+	/**
+	 * Non-zero when the threads shall stop listening
+	 */
+	int stop;
+
+	/**
+	 * Non-zero if a thread, or the callback function, has failed
+	 */
+	int failed;
+
+	/**
+	 * The error of the first failure
+	 */
+	int error;
+};
+
+
+/**
+ * A thread that listens on a partition of a bus in `bus_read`
+ */
+struct partition_listener
+{
+	/**
+	 * The state shared by the threads
+	 */
+	struct partitioned_read *read;
+
+	/**
+	 * The partition, this is a copy so that the
+	 * thread has its own `bus_poll` state
+	 */
+	bus_t bus;
+
+	/**
+	 * The thread
+	 */
+	pthread_t thread;
+};
+
+
+/**
+ * Pooled buffer for a message dispatched by `bus_dispatch`
+ */
+struct dispatch_buffer
+{
+	/**
+	 * The dispatcher the buffer belongs to
+	 */
+	struct dispatcher *dispatcher;
+
+	/**
+	 * The number of references to the buffer, it is
+	 * returned to the pool when this becomes 0
+	 */
+	uint32_t references;
+
+	/**
+	 * The index, plus 1, of the next free
+	 * buffer in the pool, 0 if none
+	 */
+	uint32_t next;
+
+	/**
+	 * The message
+	 */
+	char message[BUS_MEMORY_SIZE];
+};
+
+
+/**
+ * Element in the queue of messages in `bus_dispatch`
+ */
+struct dispatch_cell
+{
+	/**
+	 * The position in the queue that the cell is
+	 * written at next, plus 1 once it has been written
+	 */
+	uint32_t sequence;
+
+	/**
+	 * The index of the buffer with the message
+	 */
+	uint32_t buffer;
+};
+
+
+/**
+ * State shared by the threads in `bus_dispatch`
+ */
+struct dispatcher
+{
+	/**
+	 * The function to call when a message is received
+	 */
+	int (*callback)(const char *message, void *user_data);
+
+	/**
+	 * Parameter passed to `callback`
+	 */
+	void *user_data;
+
+	/**
+	 * The buffers
+	 */
+	struct dispatch_buffer *buffers;
+
+	/**
+	 * The index, plus 1, of the first free buffer, 0 if none,
+	 * the workers return buffers and only the polling thread
+	 * takes them, so taking a buffer cannot suffer from ABA
+	 */
+	uint32_t pool;
+
+	/**
+	 * The number of buffers that are not in the pool, the
+	 * polling thread waits for it to change when it is full
+	 */
+	uint32_t used;
+
+	/**
+	 * Non-zero while the polling thread is waiting for `used`
+	 */
+	uint32_t polling_waiting;
+
+	/**
+	 * The queue of messages, it has a power of two
+	 * elements, at least as many as there are buffers
+	 */
+	struct dispatch_cell *queue;
+
+	/**
+	 * The number of elements in `queue`, minus 1
+	 */
+	uint32_t mask;
+
+	/**
+	 * The position of the next message the workers take
+	 */
+	uint32_t head;
+
+	/**
+	 * The position of the next message the
+	 * polling thread adds, only it uses this
+	 */
+	uint32_t tail;
+
+	/**
+	 * Incremented whenever a message is added, or the
+	 * threads shall stop, the workers wait for it to change
+	 */
+	uint32_t queued;
+
+	/**
+	 * The number of workers that are waiting for `queued`
+	 */
+	uint32_t idle;
+
+	/**
+	 * Non-zero when no more messages shall be polled
+	 */
+	uint32_t stop;
+
+	/**
+	 * Lock for `failed` and `error`
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * Non-zero if a thread, or the callback function, has failed
+	 */
+	int failed;
+
+	/**
+	 * The error of the first failure
+	 */
+	int error;
+};
+
+
+/**
+ * Message queued with `bus_write_async`
+ */
+struct async_entry
+{
+	/**
+	 * The position in the queue that the entry is
+	 * written at next, plus 1 once it has been written
+	 */
+	uint32_t sequence;
+
+	/**
+	 * The flags the message was queued with
+	 */
+	int flags;
+
+	/**
+	 * The bus to broadcast the message on
+	 */
+	const bus_t *bus;
+
+	/**
+	 * Function to call when the message has been broadcasted, or
+	 * failed to be, `NULL` if none
+	 */
+	void (*completion)(const char *message, int error, void *user_data);
+
+	/**
+	 * Parameter passed to `completion`
+	 */
+	void *user_data;
+
+	/**
+	 * The message
+	 */
+	char message[BUS_MEMORY_SIZE];
+};
+
+
+/**
+ * The queue of messages that the publisher thread
+ * broadcasts, for `bus_write_async`, it is shared
+ * by every bus in the process
+ */
+struct async_queue
+{
+	/**
+	 * The entries, `BUS_ASYNC_SLOTS` of them
+	 */
+	struct async_entry *entries;
+
+	/**
+	 * The position of the next message to queue
+	 */
+	uint32_t tail;
+
+	/**
+	 * The position of the next message to broadcast,
+	 * only the publisher thread uses this
+	 */
+	uint32_t head;
+
+	/**
+	 * The position of the first message that has not been
+	 * broadcasted, `bus_flush` waits for it to change
+	 */
+	uint32_t published;
+
+	/**
+	 * Non-zero while the publisher thread is waiting for a message
+	 */
+	uint32_t publisher_waiting;
+
+	/**
+	 * The number of threads that are waiting for
+	 * an entry to be free, or in `bus_flush`
+	 */
+	uint32_t waiting;
+
+	/**
+	 * The error the queue, or the publisher
+	 * thread, failed to be created with, 0 if none
+	 */
+	int error;
+};
+
+
+/**
+ * Buses that have been opened with `bus_open_named`
+ */
+static struct named_bus *named_buses = NULL;
+
+/**
+ * Lock for `named_buses`
+ */
+static pthread_mutex_t named_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The queue of `bus_write_async`
+ */
+static struct async_queue async_queue;
+
+/**
+ * Ensures that `async_queue` and the publisher thread are created
+ * once, it is reset in child processes, see `async_forked`
+ */
+static pthread_once_t async_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Whether `async_forked` has been registered with `pthread_atfork`
+ */
+static int async_atfork_registered = 0;
+
 
 
 /**
@@ -147,7 +1270,7 @@
  * @return  :int               0 on success, -1 on error
  */
 #define open_semaphores(bus) \
-	(((bus)->sem_id = semget((bus)->key_sem, BUS_SEMAPHORES, 0)) == -1 ? -1 : 0)
+	(((bus)->sem_id = semget((bus)->key_sem, BUS_SEMAPHORES(bus), 0)) == -1 ? -1 : 0)
 
 /**
  * Write a message to the shared memory
@@ -194,43 +1317,283 @@
 #define t(inst) \
 	do { if ((inst) == -1) goto fail; } while (0)
 
+/* The counters, the registry, and the slots and queues that
+ * processes and threads claim without a lock rely on these
+ * being atomic, so there is no fallback without them. */
+#if !defined(__GNUC__)
+# error "libbus requires GCC-compatible __atomic builtins"
+#endif
 
+/**
+ * Add to a counter in the shared memory, atomically
+ * 
+ * @param   var:uint64_t    The counter
+ * @param   value:uint64_t  The value to add
+ */
+#define ATOMIC_ADD(var, value) \
+	((void) __atomic_fetch_add(&(var), (value), __ATOMIC_RELAXED))
 
-#ifndef SEMUN_ALREADY_DEFINED
-union semun {
-	int val;
-	struct semid_ds *buf;
-	unsigned short *array;
-};
-#endif
+/**
+ * Read a variable in the shared memory, atomically
+ * 
+ * @param   var:uint32_t  The variable
+ * @return  :uint32_t     The value of the variable
+ */
+#define ATOMIC_LOAD(var) \
+	__atomic_load_n(&(var), __ATOMIC_ACQUIRE)
 
+/**
+ * Set a variable in the shared memory, atomically
+ * 
+ * @param   var:uint32_t    The variable
+ * @param   value:uint32_t  The new value
+ */
+#define ATOMIC_STORE(var, value) \
+	__atomic_store_n(&(var), (value), __ATOMIC_RELEASE)
 
+/**
+ * Replace the value of a variable in the shared memory
+ * if it has an expected value, atomically
+ * 
+ * @param   var:int32_t       The variable
+ * @param   expected:int32_t  The expected value, set to the
+ *                            actual value on failure
+ * @param   desired:int32_t   The new value
+ * @return  :int              Non-zero if the value was replaced
+ */
+#define ATOMIC_CAS(var, expected, desired) \
+	__atomic_compare_exchange_n(&(var), &(expected), (desired), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
 
 /**
- * Create a semaphore array for the bus
+ * Subtract 1 from a variable, atomically
  * 
- * @param   bus  Bus information to fill with the key of the created semaphore array
- * @return       0 on success, -1 on error
+ * @param   var:uint32_t  The variable
+ * @return  :uint32_t     The new value of the variable
  */
-static int
-create_semaphores(bus_t *bus)
-{
-	int id = -1, rint, saved_errno;
-	double r;
-	union semun values;
+#define ATOMIC_DECREMENT(var) \
+	__atomic_sub_fetch(&(var), 1, __ATOMIC_ACQ_REL)
 
-	values.array = NULL;
+/**
+ * Order all earlier stores before all later
+ * loads, this is a full barrier
+ */
+#define ATOMIC_FENCE() \
+	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/**
+ * Whether statistics are maintained on a bus
+ * 
+ * @param   bus:const bus_t *  The bus
+ * @return  :int               Non-zero if statistics are maintained
+ */
+#define HAVE_STATS(bus) \
+	((bus)->control && ((bus)->control->flags & BUS_STATS))
+
+/**
+ * Whether a listener registry is maintained on a bus
+ * 
+ * @param   bus:const bus_t *  The bus
+ * @return  :int               Non-zero if a listener registry is maintained
+ */
+#define HAVE_REGISTRY(bus) \
+	((bus)->control && ((bus)->control->flags & BUS_REGISTRY))
+
+/**
+ * Whether a reply area is maintained on a bus
+ * 
+ * @param   bus:const bus_t *  The bus
+ * @return  :int               Non-zero if a reply area is maintained
+ */
+#define HAVE_CALLS(bus) \
+	((bus)->control && ((bus)->control->flags & BUS_CALLS))
+
+/**
+ * Get a slot in the reply area of a bus
+ * 
+ * @param   bus:const bus_t *     The bus, must have a reply area
+ * @param   i:int                 The index of the slot
+ * @return  :struct call_slot *   The slot
+ */
+#define CALL_SLOT(bus, i) \
+	((struct call_slot *)((char *)(bus)->control + (bus)->control->size) + (i))
+
+/**
+ * Whether a response area is maintained on a bus
+ * 
+ * @param   bus:const bus_t *  The bus
+ * @return  :int               Non-zero if a response area is maintained
+ */
+#define HAVE_SURVEYS(bus) \
+	((bus)->control && ((bus)->control->flags & BUS_SURVEYS))
+
+/**
+ * The size of the reply area of a bus
+ * 
+ * @param   flags:int  The flags the bus is created with
+ * @return  :size_t    The size, 0 if the bus has no reply area
+ */
+#define CALLS_SIZE(flags) \
+	(((flags) & BUS_CALLS) ? BUS_CALL_SLOTS * sizeof(struct call_slot) : (size_t)0)
+
+/**
+ * The size of the response area of a bus
+ * 
+ * @param   flags:int  The flags the bus is created with
+ * @return  :size_t    The size, 0 if the bus has no response area
+ */
+#define SURVEYS_SIZE(flags) \
+	(((flags) & BUS_SURVEYS) ? sizeof(struct survey_area) : (size_t)0)
+
+/**
+ * Whether a retained area is maintained on a bus
+ * 
+ * @param   bus:const bus_t *  The bus
+ * @return  :int               Non-zero if a retained area is maintained
+ */
+#define HAVE_RETAINED(bus) \
+	((bus)->control && ((bus)->control->flags & BUS_RETAINED))
+
+/**
+ * The size of the areas that follow the control block of a bus
+ * 
+ * @param   flags:int  The flags the bus is created with
+ * @return  :size_t    The size of the reply area, the
+ *                     response area and the retained area
+ */
+#define AREAS_SIZE(flags) \
+	(CALLS_SIZE(flags) + SURVEYS_SIZE(flags) + \
+	 (((flags) & BUS_RETAINED) ? sizeof(struct retained_area) : (size_t)0))
+
+/**
+ * The size of the control block, and the areas that follow it, of a bus
+ * 
+ * @param   flags:int  The flags the bus is created with
+ * @return  :size_t    The size, 0 if the bus has no control block
+ */
+#define CONTROL_SIZE(flags) \
+	(!((flags) & CONTROL_FLAGS) ? (size_t)0 : sizeof(struct bus_control) + AREAS_SIZE(flags))
+
+/**
+ * Get the response area of a bus
+ * 
+ * @param   bus:const bus_t *       The bus, must have a response area
+ * @return  :struct survey_area *   The response area
+ */
+#define SURVEY_AREA(bus) \
+	((struct survey_area *)((char *)(bus)->control + (bus)->control->size + \
+	                        CALLS_SIZE((bus)->control->flags)))
+
+/**
+ * Get the retained area of a bus
+ * 
+ * @param   bus:const bus_t *         The bus, must have a retained area
+ * @return  :struct retained_area *   The retained area
+ */
+#define RETAINED_AREA(bus) \
+	((struct retained_area *)((char *)(bus)->control + (bus)->control->size + \
+	                          CALLS_SIZE((bus)->control->flags) + \
+	                          SURVEYS_SIZE((bus)->control->flags)))
+
+/**
+ * Get the record of a message in the journal of a bus
+ * 
+ * @param   journal:struct bus_journal *  The journal
+ * @param   sequence:uint64_t             The sequence number of the message
+ * @return  :struct journal_record *      The record
+ */
+#define JOURNAL_RECORD(journal, sequence) \
+	((struct journal_record *)((journal) + 1) + ((sequence) - 1) % (journal)->slots)
+
+/**
+ * Get a partition of a bus
+ * 
+ * @param   bus:const bus_t *  The bus
+ * @param   i:int              The index of the partition
+ * @return  :const bus_t *     The partition, `bus` itself if
+ *                             the bus does not have partitions
+ */
+#define PARTITION(bus, i) \
+	((bus)->partition ? (const bus_t *)&(bus)->partition[i] : (const bus_t *)(bus))
+
+/**
+ * Get the pooled buffer of a message passed to
+ * the callback function of `bus_dispatch`
+ * 
+ * @param   message:const char *       The message
+ * @return  :struct dispatch_buffer *  The buffer
+ */
+#define DISPATCH_BUFFER(message) \
+	((struct dispatch_buffer *)(uintptr_t)((message) - offsetof(struct dispatch_buffer, message)))
+
+/**
+ * Fire a USDT probe, with the provider `libbus`, if compiled with
+ * `BUS_USDT`, otherwise this macro does nothing and its arguments
+ * are not evaluated
+ * 
+ * The arguments of the probe are the key of the bus's semaphore
+ * array, the length of the message and the bus's sequence number,
+ * which is 0 if the bus has no control block
+ * 
+ * @param  name:identifier    The name of the probe
+ * @param  bus:const bus_t *  The bus
+ * @param  length:size_t      The length of the message, 0 if none
+ */
+#ifdef BUS_USDT
+# define PROBE(name, bus, length) \
+	STAP_PROBE3(libbus, name, (long)(bus)->key_sem, (unsigned long)(length), \
+	            (unsigned long long)((bus)->control ? (bus)->control->sequence : 0))
+#else
+# define PROBE(name, bus, length)  ((void)0)
+#endif
+
+
+
+#ifndef SEMUN_ALREADY_DEFINED
+union semun {
+	int val;
+	struct semid_ds *buf;
+	unsigned short *array;
+};
+#endif
+
+
+
+/**
+ * Generate a random key for an XSI semaphore array or an XSI shared memory
+ * 
+ * The key is tagged with `BUS_KEY_TAG` so that objects
+ * left behind by removed buses can be identified
+ * 
+ * @return  The key, never `IPC_PRIVATE`
+ */
+static key_t
+random_key(void)
+{
+	double r = (double)rand();
+	r /= (double)RAND_MAX + 1;
+	r *= (double)(~BUS_KEY_MASK & 0x7FFFFFFFL);
+	return (key_t)(BUS_KEY_TAG | (long)r);
+}
+
+
+/**
+ * Create a semaphore array for the bus
+ * 
+ * @param   bus  Bus information to fill with the key of the created semaphore array
+ * @return       0 on success, -1 on error
+ */
+static int
+create_semaphores(bus_t *bus)
+{
+	int id = -1, saved_errno;
+	union semun values;
+
+	values.array = NULL;
 
 	/* Create semaphore array. */
 	for (;;) {
-		rint = rand();
-		r = (double)rint;
-		r /= (double)RAND_MAX + 1;
-		r *= (1 << (8 * sizeof(key_t) - 2)) - 1;
-		bus->key_sem = (key_t)r + 1;
-		if (bus->key_sem == IPC_PRIVATE)
-			continue;
-		id = semget(bus->key_sem, BUS_SEMAPHORES, IPC_CREAT | IPC_EXCL | DEFAULT_MODE);
+		bus->key_sem = random_key();
+		id = semget(bus->key_sem, BUS_SEMAPHORES(bus), IPC_CREAT | IPC_EXCL | DEFAULT_MODE);
 		if (id != -1)
 			break;
 		if ((errno != EEXIST) && (errno != EINTR))
@@ -238,7 +1601,7 @@ create_semaphores(bus_t *bus)
 	}
 
 	/* Initialise the array. */
-	values.array = calloc((size_t)BUS_SEMAPHORES, sizeof(unsigned short));
+	values.array = calloc((size_t)BUS_SEMAPHORES(bus), sizeof(unsigned short));
 	if (!values.array)
 		goto fail;
 	values.array[X] = 1;
@@ -253,47 +1616,73 @@ fail:
 	saved_errno = errno;
 	if (id != -1)
 		semctl(id, 0, IPC_RMID);
+	bus->key_sem = -1;
 	free(values.array);
 	errno = saved_errno;
 	return -1;
 }
 
 
+/**
+ * Initialise a control block, which must be zero-initialised
+ * 
+ * @param  control  The control block
+ * @param  flags    The flags the bus is created with
+ */
+static void
+init_control(struct bus_control *control, int flags)
+{
+	control->magic = CONTROL_MAGIC;
+	control->size = (uint32_t)sizeof(*control);
+	control->flags = (uint32_t)(flags & CONTROL_FLAGS);
+}
+
+
 /**
  * Create a shared memory for the bus
  * 
- * @param   bus  Bus information to fill with the key of the created shared memory
- * @return       0 on success, -1 on error
+ * @param   bus    Bus information to fill with the key of the created shared memory
+ * @param   flags  The flags the bus is created with, a control block is
+ *                 created if `flags` contains any of `CONTROL_FLAGS`
+ * @return         0 on success, -1 on error
  */
 static int
-create_shared_memory(bus_t *bus)
+create_shared_memory(bus_t *bus, int flags)
 {
-	int id = -1, rint, saved_errno;
-	double r;
+	int id = -1, saved_errno;
 	struct shmid_ds _info;
+	struct bus_control *control;
+	void *address;
+	size_t size = (size_t)BUS_MEMORY_SIZE + CONTROL_SIZE(flags);
 
 	/* Create shared memory. */
 	for (;;) {
-		rint = rand();
-		r = (double)rint;
-		r /= (double)RAND_MAX + 1;
-		r *= (1 << (8 * sizeof(key_t) - 2)) - 1;
-		bus->key_shm = (key_t)r + 1;
-		if (bus->key_shm == IPC_PRIVATE)
-			continue;
-		id = shmget(bus->key_shm, (size_t)BUS_MEMORY_SIZE, IPC_CREAT | IPC_EXCL | DEFAULT_MODE);
+		bus->key_shm = random_key();
+		id = shmget(bus->key_shm, size, IPC_CREAT | IPC_EXCL | DEFAULT_MODE);
 		if (id != -1)
 			break;
 		if ((errno != EEXIST) && (errno != EINTR))
 			goto fail;
 	}
 
+	/* Initialise the control block, the rest of it
+	 * is zero-initialised by the system. */
+	if (flags & CONTROL_FLAGS) {
+		address = shmat(id, NULL, 0);
+		if ((address == (void *)-1) || !address)
+			goto fail;
+		control = (struct bus_control *)((char *)address + BUS_MEMORY_SIZE);
+		init_control(control, flags);
+		t(shmdt(address));
+	}
+
 	return 0;
 
 fail:
 	saved_errno = errno;
 	if (id != -1)
 		shmctl(id, IPC_RMID, &_info);
+	bus->key_shm = -1;
 	errno = saved_errno;
 	return -1;
 }
@@ -308,7 +1697,7 @@ fail:
 static int
 remove_semaphores(const bus_t *bus)
 {
-	int id = semget(bus->key_sem, BUS_SEMAPHORES, 0);
+	int id = semget(bus->key_sem, 0, 0);
 	return ((id == -1) || (semctl(id, 0, IPC_RMID) == -1)) ? -1 : 0;
 }
 
@@ -386,23 +1775,326 @@ write_semaphore(const bus_t *bus, unsigned semaphore, int value)
 }
 
 
+/**
+ * Register the process as a listener, that is, once no process is
+ * broadcasting on the bus, `V(S)` and `V(Q)`, atomically
+ * 
+ * Had `V(S)` and `V(Q)` not been done atomically, or while a
+ * message was being broadcasted, the broadcasting process could
+ * wait for the listener to acknowledge a message it will never
+ * receive
+ * 
+ * @param   bus      Bus information
+ * @param   timeout  The amount of time to wait before failing, `NULL` for no timeout
+ * @return           0 on success, -1 on error
+ */
+static int
+start_listening(const bus_t *bus, const struct timespec *timeout)
+{
+	struct sembuf ops[4];
+	ops[0].sem_num = X, ops[0].sem_op = -1, ops[0].sem_flg = 0;
+	ops[1].sem_num = X, ops[1].sem_op = +1, ops[1].sem_flg = 0;
+	ops[2].sem_num = S, ops[2].sem_op = +1, ops[2].sem_flg = SEM_UNDO;
+	ops[3].sem_num = Q, ops[3].sem_op = +1, ops[3].sem_flg = 0;
+	return semtimedop(bus->sem_id, ops, (size_t)4, timeout);
+}
+
+
+/**
+ * Finish the acknowledgement of a message and start waiting
+ * for the next message, that is, `P(W)` and `V(Q)`, atomically
+ * 
+ * Had `P(W)` and `V(Q)` not been done atomically, the next
+ * broadcasting process could set `Q` to 0 before `V(Q)`,
+ * making the listener miss the message
+ * 
+ * @param   bus  Bus information
+ * @return       0 on success, -1 on error
+ */
+static int
+continue_listening(const bus_t *bus)
+{
+	struct sembuf ops[2];
+	ops[0].sem_num = W, ops[0].sem_op = -1, ops[0].sem_flg = SEM_UNDO;
+	ops[1].sem_num = Q, ops[1].sem_op = +1, ops[1].sem_flg = 0;
+	return semop(bus->sem_id, ops, (size_t)2);
+}
+
+
+/**
+ * Get the current time, for statistics
+ * 
+ * @param   bus  Bus information
+ * @return       The current time, in nanoseconds, of the monotonic
+ *               clock, 0 if statistics are not maintained on the bus
+ */
+static uint64_t
+stats_now(const bus_t *bus)
+{
+	struct timespec now;
+	if (!HAVE_STATS(bus) || clock_gettime(CLOCK_MONOTONIC, &now))
+		return 0;
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+
+/**
+ * Add a measurement to a histogram in the control block
+ * 
+ * @param  histogram  The histogram
+ * @param  start      When the measurement started, as returned by `stats_now`
+ * @param  end        When the measurement ended, as returned by `stats_now`
+ */
+static void
+stats_measure(struct bus_histogram *histogram, uint64_t start, uint64_t end)
+{
+	uint64_t duration = end > start ? end - start : 0, v;
+	unsigned bucket = 0;
+	for (v = duration; (v >>= 1) && (bucket < BUS_HISTOGRAM_BUCKETS - 1);)
+		bucket++;
+	ATOMIC_ADD(histogram->count, 1);
+	ATOMIC_ADD(histogram->total, duration);
+	ATOMIC_ADD(histogram->buckets[bucket], 1);
+}
+
+
+/**
+ * Update the statistics after a broadcast
+ * 
+ * @param  bus      Bus information
+ * @param  message  The broadcasted message, `NULL` if the broadcast failed
+ * @param  start    When `bus_write` was called, as returned by `stats_now`
+ * @param  locked   When the bus was locked, as returned by `stats_now`
+ */
+static void
+stats_wrote(const bus_t *bus, const char *message, uint64_t start, uint64_t locked)
+{
+	uint64_t end = stats_now(bus);
+	if (!end)
+		return;
+	if (!message) {
+		ATOMIC_ADD(bus->control->stats.failed, 1);
+		return;
+	}
+	ATOMIC_ADD(bus->control->stats.messages, 1);
+	ATOMIC_ADD(bus->control->stats.bytes, (uint64_t)strlen(message));
+	stats_measure(&bus->control->stats.lock, start, locked);
+	stats_measure(&bus->control->stats.broadcast, locked, end);
+}
+
+
+/**
+ * Update the statistics after a message has been acknowledged
+ * 
+ * @param  bus       Bus information
+ * @param  received  When the message was received, as returned by `stats_now`
+ */
+static void
+stats_acknowledged(const bus_t *bus, uint64_t received)
+{
+	uint64_t end = stats_now(bus);
+	if (!end || !received)
+		return;
+	ATOMIC_ADD(bus->control->stats.deliveries, 1);
+	stats_measure(&bus->control->stats.acknowledge, received, end);
+}
+
+
+/**
+ * Get the message that shall be passed to the application,
+ * that is, the received message without its expiration time,
+ * see `bus_write_expiring`, unless it has expired
+ * 
+ * @param   bus      Bus information
+ * @param   message  The received message
+ * @return           The message to pass on, `NULL` if it has expired
+ */
+static const char *
+unexpired(const bus_t *bus, const char *message)
+{
+	unsigned long long deadline = 0;
+	struct timespec now;
+	const char *p;
+
+	if (*message != EXPIRES_MARK)
+		return message;
+	for (p = &message[1]; '0' <= *p && *p <= '9'; p++)
+		deadline = deadline * 10 + (unsigned long long)(*p - '0');
+	if (p == &message[1] || *p != ' ')
+		return message;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) ||
+	    (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec < deadline)
+		return p + 1;
+	if (HAVE_STATS(bus))
+		ATOMIC_ADD(bus->control->stats.expired, 1);
+	return NULL;
+}
+
+
+/**
+ * Get the current time, for the listener registry
+ * 
+ * @return  The current time, in nanoseconds since the Epoch
+ */
+static uint64_t
+realtime_now(void)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_REALTIME, &now))
+		return 0;
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+
+/**
+ * Check whether a process that is registered
+ * in the listener registry still exists
+ * 
+ * @param   pid  The ID of the process
+ * @return       Zero if the process does not exist
+ */
+static int
+process_exists(pid_t pid)
+{
+	int saved_errno = errno, r;
+	r = kill(pid, 0) == 0 || errno != ESRCH;
+	errno = saved_errno;
+	return r;
+}
+
+
+/**
+ * Advance the sequence number of the bus, must be done
+ * by the broadcasting process before it writes the
+ * message to the shared memory
+ * 
+ * @param  bus  Bus information
+ */
+static void
+advance_sequence(const bus_t *bus)
+{
+	if (bus->control)
+		ATOMIC_ADD(bus->control->sequence, 1);
+}
+
+
+/**
+ * Register the process in the listener registry, reusing
+ * slots registered to processes that have died
+ * 
+ * @param   bus  Bus information
+ * @return       The index of the slot, -1 if the bus has no
+ *               listener registry or if the registry is full
+ */
+static int
+register_listener(const bus_t *bus)
+{
+	struct registry_slot *slot;
+	int32_t pid = (int32_t)getpid(), expected;
+	uint64_t now;
+	int i;
+
+	if (!HAVE_REGISTRY(bus))
+		return -1;
+
+	for (i = 0; i < BUS_REGISTRY_SLOTS; i++) {
+		slot = &bus->control->listeners[i];
+		expected = slot->pid;
+		if (expected && process_exists((pid_t)expected))
+			continue;
+		if (!ATOMIC_CAS(slot->pid, expected, pid))
+			continue;
+		now = realtime_now();
+		slot->registered = now;
+		slot->received = slot->acknowledged = bus->control->sequence;
+		slot->acknowledged_at = now;
+		return i;
+	}
+
+	return -1;
+}
+
+
+/**
+ * Remove the process from the listener registry
+ * 
+ * @param  bus   Bus information
+ * @param  slot  The index of the slot, as returned by
+ *               `register_listener`, -1 for none
+ */
+static void
+unregister_listener(const bus_t *bus, int slot)
+{
+	int32_t expected = (int32_t)getpid();
+	if (slot >= 0 && HAVE_REGISTRY(bus))
+		ATOMIC_CAS(bus->control->listeners[slot].pid, expected, 0);
+}
+
+
+/**
+ * Record in the listener registry that the
+ * process has received the current message
+ * 
+ * @param  bus   Bus information
+ * @param  slot  The index of the slot, as returned by
+ *               `register_listener`, -1 for none
+ */
+static void
+listener_received(const bus_t *bus, int slot)
+{
+	if (slot >= 0 && HAVE_REGISTRY(bus))
+		bus->control->listeners[slot].received = bus->control->sequence;
+}
+
+
+/**
+ * Record in the listener registry that the process
+ * has acknowledged the last message it received
+ * 
+ * @param  bus   Bus information
+ * @param  slot  The index of the slot, as returned by
+ *               `register_listener`, -1 for none
+ */
+static void
+listener_acknowledged(const bus_t *bus, int slot)
+{
+	struct registry_slot *entry;
+	if (slot < 0 || !HAVE_REGISTRY(bus))
+		return;
+	entry = &bus->control->listeners[slot];
+	entry->acknowledged = entry->received;
+	entry->acknowledged_at = realtime_now();
+}
+
+
 /**
  * Open the shared memory for the bus
  * 
  * @param   bus    Bus information
+ * @param   id     The ID of the shared memory, -1 to look it up by its key
  * @param   flags  `BUS_RDONLY`, `BUS_WRONLY` or `BUS_RDWR`
  * @return         0 on success, -1 on error
  */
 static int
-open_shared_memory(bus_t *bus, int flags)
+open_shared_memory(bus_t *bus, int id, int flags)
 {
-	int id;
+	int control;
 	void *address;
-	t(id = shmget(bus->key_shm, (size_t)BUS_MEMORY_SIZE, 0));
-	address = shmat(id, NULL, (flags & BUS_RDONLY) ? SHM_RDONLY : 0);
+	struct shmid_ds info;
+	if (id == -1)
+		t(id = shmget(bus->key_shm, (size_t)BUS_MEMORY_SIZE, 0));
+	t(shmctl(id, IPC_STAT, &info));
+	/* Listeners update the control block too. */
+	control = (size_t)info.shm_segsz >= BUS_MEMORY_SIZE + sizeof(struct bus_control);
+	address = shmat(id, NULL, ((flags & BUS_RDONLY) && !control) ? SHM_RDONLY : 0);
 	if ((address == (void *)-1) || !address)
 		goto fail;
 	bus->message = (char *)address;
+	bus->control = (struct bus_control *)(bus->message + BUS_MEMORY_SIZE);
+	if (!control || bus->control->magic != CONTROL_MAGIC || bus->control->size < sizeof(struct bus_control))
+		bus->control = NULL;
+	else if ((size_t)info.shm_segsz < BUS_MEMORY_SIZE + bus->control->size + AREAS_SIZE(bus->control->flags))
+		bus->control = NULL;
 	return 0;
 fail:
 	return -1;
@@ -420,6 +2112,7 @@ close_shared_memory(bus_t *bus)
 {
 	t(shmdt(bus->message));
 	bus->message = NULL;
+	bus->control = NULL;
 	return 0;
 fail:
 	return -1;
@@ -504,42 +2197,2111 @@ absolute_time_to_delta_time(struct timespec *delta, const struct timespec *absol
 }
 
 
-
 /**
- * Create a new bus
+ * Check whether a sequence number in the file of a bus created
+ * with `BUS_MAPPED` has reached another, allowing for wrap-around
  * 
- * @param   file      The pathname of the bus, `NULL` to create a random one
- * @param   flags     `BUS_EXCL` (if `file` is not `NULL`) to fail if the file
- *                    already exists, otherwise if the file exists, nothing
- *                    will happen;
- *                    `BUS_INTR` to fail if interrupted
- * @param   out_file  Output parameter for the pathname of the bus
- * @return            0 on success, -1 on error
+ * @param   have:uint32_t  The sequence number
+ * @param   want:uint32_t  The sequence number it shall have reached
+ * @return  :int           Non-zero if `have` is `want` or later
+ */
+#define SEQUENCE_REACHED(have, want) \
+	((int32_t)((uint32_t)(have) - (uint32_t)(want)) >= 0)
+
+/**
+ * Get the message slot for a message on a bus created with `BUS_CONCURRENT`
+ * 
+ * @param   bus:const bus_t *    The bus
+ * @param   sequence:uint32_t    The sequence number of the message
+ * @return  :struct map_slot *   The slot
+ */
+#define MAP_SLOT(bus, sequence) \
+	((struct map_slot *)((char *)(bus)->map + (bus)->map->size - \
+	                     (bus)->map->slots * sizeof(struct map_slot)) + \
+	 (uint32_t)(sequence) % (bus)->map->slots)
+
+
+/**
+ * Wait for a word in the file of a bus created with `BUS_MAPPED`
+ * to change, this is interrupted by signals
+ * 
+ * @param   word     The word
+ * @param   value    The value the word had when it was checked
+ * @param   timeout  The time to wait for before failing with `errno`
+ *                   set to `EAGAIN`, `NULL` to wait for ever
+ * @param   clockid  The ID of the clock `timeout` is measured with
+ * @return           0 if the word may have changed, 1 if it has not changed
+ *                   within `MAP_CHECK_INTERVAL` nanoseconds, -1 on error
+ */
+static int
+map_wait(uint32_t *word, uint32_t value, const struct timespec *timeout, clockid_t clockid)
+{
+	struct timespec delta;
+	if (timeout) {
+		DELTA;
+		if (delta.tv_sec || delta.tv_nsec > MAP_CHECK_INTERVAL)
+			delta.tv_sec = 0, delta.tv_nsec = MAP_CHECK_INTERVAL;
+	} else {
+		delta.tv_sec = 0, delta.tv_nsec = MAP_CHECK_INTERVAL;
+	}
+	if (!syscall(SYS_futex, word, FUTEX_WAIT, value, &delta, NULL, 0) || errno == EAGAIN)
+		return 0;
+	if (errno == ETIMEDOUT)
+		return 1;
+fail:
+	return -1;
+}
+
+
+/**
+ * Wake all processes waiting for a word in the
+ * file of a bus created with `BUS_MAPPED`
+ * 
+ * @param  word  The word
+ */
+static void
+map_wake(uint32_t *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+/**
+ * Wake one of the threads waiting for a word, see `map_wake`
+ * 
+ * @param  word  The word
+ */
+static void
+map_wake_one(uint32_t *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+
+/**
+ * Append a message to the journal of the bus, if it has
+ * one, must be done by the broadcasting process, while
+ * it has exclusive access, before it publishes the message
+ * 
+ * @param  bus      Bus information
+ * @param  message  The message
+ */
+static void
+journal_append(const bus_t *bus, const char *message)
+{
+	struct bus_journal *journal = bus->journal;
+	struct journal_record *record;
+	uint64_t sequence;
+	if (!journal)
+		return;
+
+	/* Readers copy the record without locking the journal,
+	 * and skip it if its sequence number changes meanwhile.
+	 * If this process dies before the message is appended,
+	 * the next message is written to the same record. */
+	sequence = journal->sequence + 1;
+	record = JOURNAL_RECORD(journal, sequence);
+	ATOMIC_STORE(record->sequence, 0);
+	ATOMIC_FENCE();
+	memcpy(record->message, message, strlen(message) + 1);
+	ATOMIC_STORE(record->sequence, sequence);
+	ATOMIC_STORE(journal->sequence, sequence);
+
+	ATOMIC_ADD(journal->appended, 1);
+	ATOMIC_FENCE();
+	if (ATOMIC_LOAD(journal->waiting))
+		map_wake(&journal->appended);
+}
+
+
+/**
+ * Flush the journal of the bus, if it has one, to disk, and return
+ * once the messages appended so far have been flushed, must be done
+ * by the broadcasting process after it has appended its message
+ * 
+ * @param  bus  Bus information
+ */
+static void
+journal_sync(const bus_t *bus)
+{
+	struct bus_journal *journal = bus->journal;
+	int32_t pid = (int32_t)getpid(), expected;
+	uint64_t sequence;
+	uint32_t flushed;
+	int saved_errno = errno;
+	if (!journal)
+		return;
+
+	/* Only one process flushes the journal at a time. The others
+	 * wait for it, and then flush the journal themselves unless
+	 * their messages were included, so messages that are appended
+	 * during a flush are flushed together by the next flush. */
+	sequence = ATOMIC_LOAD(journal->sequence);
+	for (;;) {
+		flushed = ATOMIC_LOAD(journal->flushed);
+		if (ATOMIC_LOAD(journal->synced) >= sequence)
+			goto out;
+		expected = ATOMIC_LOAD(journal->syncer);
+		if (!expected || !process_exists((pid_t)expected)) {
+			if (ATOMIC_CAS(journal->syncer, expected, pid))
+				break;
+			continue;
+		}
+		if (map_wait(&journal->flushed, flushed, NULL, 0) < 0 && errno != EINTR)
+			goto out;
+	}
+
+	sequence = ATOMIC_LOAD(journal->sequence);
+	if (!msync(journal, (size_t)journal->size, MS_SYNC))
+		ATOMIC_STORE(journal->synced, sequence);
+	ATOMIC_STORE(journal->syncer, 0);
+	ATOMIC_ADD(journal->flushed, 1);
+	map_wake(&journal->flushed);
+out:
+	errno = saved_errno;
+}
+
+
+/**
+ * Check whether the listener in a slot, in the file of a
+ * bus created with `BUS_MAPPED`, is alive, and release
+ * the slot if the listener has died
+ * 
+ * @param   slot  The slot
+ * @return        Zero if the slot no longer is in use
+ */
+static int
+map_alive(struct map_listener *slot)
+{
+	int r = pthread_mutex_trylock(&slot->alive);
+	if (r == EBUSY)
+		return 1;
+	if (r == EOWNERDEAD) {
+		ATOMIC_STORE(slot->used, 0);
+		pthread_mutex_consistent(&slot->alive);
+	}
+	if (!r || r == EOWNERDEAD)
+		pthread_mutex_unlock(&slot->alive);
+	return 0;
+}
+
+
+/**
+ * Wait until every listener on a bus created with `BUS_MAPPED`
+ * has acknowledged a message, or stopped listening or died
+ * 
+ * @param   bus       Bus information
+ * @param   sequence  The sequence number of the message
+ * @param   nowait    Non-zero to fail with `errno` set to `EAGAIN`
+ *                    rather than wait
+ * @param   timeout   The time to wait for before failing with `errno`
+ *                    set to `EAGAIN`, `NULL` to wait for ever
+ * @param   clockid   The ID of the clock `timeout` is measured with
+ * @return            0 on success, -1 on error
+ */
+static int
+map_wait_acknowledged(const bus_t *bus, uint32_t sequence, int nowait,
+                      const struct timespec *timeout, clockid_t clockid)
+{
+	struct map_listener *slot;
+	uint32_t acknowledgements;
+	int i, check = 0, pending;
+	for (;;) {
+		acknowledgements = ATOMIC_LOAD(bus->map->acknowledgements);
+		for (pending = 0, i = 0; i < MAP_LISTENERS; i++) {
+			slot = &bus->map->listeners[i];
+			if (!ATOMIC_LOAD(slot->used) || SEQUENCE_REACHED(ATOMIC_LOAD(slot->acknowledged), sequence))
+				continue;
+			/* Only look for dead listeners when the wait is
+			 * taking long, otherwise this would be done for
+			 * every acknowledgement. */
+			if (check && !map_alive(slot))
+				continue;
+			pending = 1;
+			if (!check)
+				break;
+		}
+		if (!pending)
+			return 0;
+		if (nowait) {
+			errno = EAGAIN;
+			return -1;
+		}
+		t(check = map_wait(&bus->map->acknowledgements, acknowledgements, timeout, clockid));
+	}
+fail:
+	return -1;
+}
+
+
+/**
+ * Acquire exclusive access to a bus created with `BUS_MAPPED`
+ * 
+ * @param   bus      Bus information
+ * @param   nowait   Non-zero to fail with `errno` set to `EAGAIN`
+ *                   if another process has exclusive access
+ * @param   timeout  The time to wait for before failing with `errno`
+ *                   set to `EAGAIN`, `NULL` to wait for ever
+ * @param   clockid  The ID of the clock `timeout` is measured with
+ * @return           0 on success, -1 on error
+ */
+static int
+map_lock(const bus_t *bus, int nowait, const struct timespec *timeout, clockid_t clockid)
+{
+	struct timespec delta, deadline;
+	int r;
+	if (nowait) {
+		r = pthread_mutex_trylock(&bus->map->lock);
+	} else if (timeout) {
+		DELTA;
+		t(clock_gettime(CLOCK_REALTIME, &deadline));
+		deadline.tv_sec += delta.tv_sec;
+		deadline.tv_nsec += delta.tv_nsec;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_nsec -= 1000000000L;
+			deadline.tv_sec += 1;
+		}
+		r = pthread_mutex_timedlock(&bus->map->lock, &deadline);
+	} else {
+		r = pthread_mutex_lock(&bus->map->lock);
+	}
+	/* The previous broadcasting process died, its listeners
+	 * are taken care of by `map_wait_acknowledged`. */
+	if (r == EOWNERDEAD)
+		r = pthread_mutex_consistent(&bus->map->lock);
+	if (r) {
+		errno = (r == EBUSY || r == ETIMEDOUT) ? EAGAIN : r;
+		return -1;
+	}
+	ATOMIC_STORE(bus->map->writer, (uint32_t)getpid());
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Release exclusive access to a bus created with `BUS_MAPPED`
+ * 
+ * @param  bus  Bus information
+ */
+static void
+map_unlock(const bus_t *bus)
+{
+	ATOMIC_STORE(bus->map->writer, 0);
+	pthread_mutex_unlock(&bus->map->lock);
+}
+
+
+/**
+ * Broadcast a message on a bus created with `BUS_CONCURRENT`
+ * 
+ * The exclusive access to the bus is only held while the next message
+ * slot is claimed, the message is written and its acknowledgements are
+ * waited for while other processes broadcast their messages
+ * 
+ * @param   bus      Bus information
+ * @param   message  The message to write
+ * @param   nowait   Non-zero to fail with `errno` set to `EAGAIN` if the
+ *                   message cannot be broadcasted without waiting
+ * @param   timeout  The time to wait for a message slot before failing
+ *                   with `errno` set to `EAGAIN`, `NULL` to wait for ever
+ * @param   clockid  The ID of the clock `timeout` is measured with
+ * @return           0 on success, -1 on error
+ */
+static int
+map_write_concurrent(const bus_t *bus, const char *message, int nowait,
+                     const struct timespec *timeout, clockid_t clockid)
+{
+	int saved_errno, r;
+	uint32_t sequence;
+	struct map_slot *slot;
+	uint64_t start = stats_now(bus), locked;
+	PROBE(write_start, bus, strlen(message));
+	if (map_lock(bus, nowait, timeout, clockid) == -1)
+		goto fail;
+
+	/* Claim the next slot once every listener has acknowledged
+	 * the message that was last broadcasted in it. Its lock is
+	 * taken before the slot is published as claimed, so that
+	 * listeners can tell if this process dies before it has
+	 * written the message. */
+	sequence = ATOMIC_LOAD(bus->map->sequence) + 1;
+	slot = MAP_SLOT(bus, sequence);
+	if (map_wait_acknowledged(bus, sequence - bus->map->slots, nowait, timeout, clockid) == -1) {
+		saved_errno = errno;
+		map_unlock(bus);
+		errno = saved_errno;
+		goto fail;
+	}
+	r = pthread_mutex_lock(&slot->lock);
+	if (r == EOWNERDEAD)
+		r = pthread_mutex_consistent(&slot->lock);
+	if (r) {
+		map_unlock(bus);
+		errno = r;
+		goto fail;
+	}
+	ATOMIC_STORE(bus->map->sequence, sequence);
+	advance_sequence(bus);
+	journal_append(bus, message);
+	map_unlock(bus);
+
+	locked = stats_now(bus);
+	PROBE(write_locked, bus, strlen(message));
+	memcpy(slot->message, message, strlen(message) + 1);
+	slot->abandoned = 0;
+	bus->map->last_operation = (int64_t)time(NULL);
+	ATOMIC_STORE(slot->sequence, sequence);
+	pthread_mutex_unlock(&slot->lock);
+	map_wake(&slot->sequence);
+	PROBE(write_published, bus, strlen(message));
+	t(map_wait_acknowledged(bus, sequence, 0, NULL, 0));
+	PROBE(write_acknowledged, bus, strlen(message));
+	stats_wrote(bus, message, start, locked);
+	journal_sync(bus);
+	PROBE(write_done, bus, strlen(message));
+	return 0;
+
+fail:
+	saved_errno = errno;
+	stats_wrote(bus, NULL, start, 0);
+	PROBE(write_failed, bus, strlen(message));
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Broadcast a message on a bus created with `BUS_MAPPED`
+ * 
+ * @param   bus      Bus information
+ * @param   message  The message to write
+ * @param   nowait   Non-zero to fail with `errno` set to `EAGAIN` if
+ *                   another process is currently broadcasting
+ * @param   timeout  The time to wait for exclusive access before failing
+ *                   with `errno` set to `EAGAIN`, `NULL` to wait for ever
+ * @param   clockid  The ID of the clock `timeout` is measured with
+ * @return           0 on success, -1 on error
+ */
+static int
+map_write(const bus_t *bus, const char *message, int nowait, const struct timespec *timeout, clockid_t clockid)
+{
+	int saved_errno;
+	uint32_t sequence;
+	uint64_t start, locked;
+	if (bus->map->slots)
+		return map_write_concurrent(bus, message, nowait, timeout, clockid);
+	start = stats_now(bus);
+	PROBE(write_start, bus, strlen(message));
+	if (map_lock(bus, nowait, timeout, clockid) == -1) {
+		saved_errno = errno;
+		stats_wrote(bus, NULL, start, 0);
+		PROBE(write_failed, bus, strlen(message));
+		errno = saved_errno;
+		return -1;
+	}
+	/* If the previous broadcast failed, its listeners may still be
+	 * reading the message, this corresponds to `Z(W)` for other buses. */
+	sequence = ATOMIC_LOAD(bus->map->sequence);
+	t(map_wait_acknowledged(bus, sequence, 0, timeout, clockid));
+	locked = stats_now(bus);
+	advance_sequence(bus);
+	journal_append(bus, message);
+	PROBE(write_locked, bus, strlen(message));
+	write_shared_memory(bus, message);
+	bus->map->last_operation = (int64_t)time(NULL);
+	ATOMIC_STORE(bus->map->sequence, ++sequence);
+	map_wake(&bus->map->sequence);
+	PROBE(write_published, bus, strlen(message));
+	t(map_wait_acknowledged(bus, sequence, 0, NULL, 0));
+	PROBE(write_acknowledged, bus, strlen(message));
+	stats_wrote(bus, message, start, locked);
+	map_unlock(bus);
+	journal_sync(bus);
+	PROBE(write_done, bus, strlen(message));
+	return 0;
+
+fail:
+	saved_errno = errno;
+	map_unlock(bus);
+	stats_wrote(bus, NULL, start, 0);
+	PROBE(write_failed, bus, strlen(message));
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Start listening on a bus created with `BUS_MAPPED`
+ * by claiming a slot for the thread, the thread must
+ * stop listening before it exits
+ * 
+ * @param   bus  Bus information
+ * @return       The index of the slot, -1 on error
+ */
+static int
+map_start_listening(const bus_t *bus)
+{
+	struct map_listener *slot;
+	int i, r;
+	/* On buses created with `BUS_CONCURRENT`, the listener must not
+	 * start at a message whose slot a process is claiming, so the
+	 * last claimed message is read while holding exclusive access. */
+	if (bus->map->slots && map_lock(bus, 0, NULL, 0) == -1)
+		return -1;
+	for (i = 0; i < MAP_LISTENERS; i++) {
+		slot = &bus->map->listeners[i];
+		r = pthread_mutex_trylock(&slot->alive);
+		if (r == EOWNERDEAD)
+			r = pthread_mutex_consistent(&slot->alive);
+		if (r)
+			continue;
+		/* If a message is broadcasted before `used` is set, the
+		 * listener receives it, but the next message cannot be
+		 * written until the listener has acknowledged it. */
+		slot->received = ATOMIC_LOAD(bus->map->sequence);
+		ATOMIC_STORE(slot->acknowledged, slot->received);
+		ATOMIC_STORE(slot->used, 1);
+		if (bus->map->slots)
+			map_unlock(bus);
+		return i;
+	}
+	if (bus->map->slots)
+		map_unlock(bus);
+	errno = ENOSPC;
+	return -1;
+}
+
+
+/**
+ * Stop listening on a bus created with `BUS_MAPPED`
+ * 
+ * @param  bus   Bus information
+ * @param  slot  The index of the slot, as returned by `map_start_listening`
+ */
+static void
+map_stop_listening(const bus_t *bus, int slot)
+{
+	ATOMIC_STORE(bus->map->listeners[slot].used, 0);
+	pthread_mutex_unlock(&bus->map->listeners[slot].alive);
+	ATOMIC_ADD(bus->map->acknowledgements, 1);
+	map_wake(&bus->map->acknowledgements);
+}
+
+
+/**
+ * Acknowledge the last received message on a bus created with `BUS_MAPPED`
+ * 
+ * @param  bus   Bus information
+ * @param  slot  The index of the slot, as returned by `map_start_listening`
+ */
+static void
+map_acknowledge(const bus_t *bus, int slot)
+{
+	struct map_listener *entry = &bus->map->listeners[slot];
+	ATOMIC_STORE(entry->acknowledged, entry->received);
+	ATOMIC_ADD(bus->map->acknowledgements, 1);
+	map_wake(&bus->map->acknowledgements);
+}
+
+
+/**
+ * Check whether the process that claimed a message slot, on
+ * a bus created with `BUS_CONCURRENT`, died before it wrote
+ * its message, and if so, mark the message as abandoned
+ * 
+ * @param  slot      The message slot
+ * @param  sequence  The sequence number of the message
+ */
+static void
+map_check_abandoned(struct map_slot *slot, uint32_t sequence)
+{
+	int r = pthread_mutex_trylock(&slot->lock);
+	if (r == EOWNERDEAD) {
+		if (ATOMIC_LOAD(slot->sequence) != sequence) {
+			slot->abandoned = 1;
+			ATOMIC_STORE(slot->sequence, sequence);
+			map_wake(&slot->sequence);
+		}
+		pthread_mutex_consistent(&slot->lock);
+	}
+	if (!r || r == EOWNERDEAD)
+		pthread_mutex_unlock(&slot->lock);
+}
+
+
+/**
+ * Wait for a message to be broadcasted on a bus created with `BUS_MAPPED`
+ * 
+ * @param   bus      Bus information
+ * @param   slot     The index of the slot, as returned by `map_start_listening`
+ * @param   nowait   Non-zero to fail with `errno` set to `EAGAIN`
+ *                   if there is no new message
+ * @param   timeout  The time to wait for before failing with `errno`
+ *                   set to `EAGAIN`, `NULL` to wait for ever
+ * @param   clockid  The ID of the clock `timeout` is measured with
+ * @return           The received message, `NULL` on error
+ */
+static const char *
+map_receive(const bus_t *bus, int slot, int nowait, const struct timespec *timeout, clockid_t clockid)
+{
+	struct map_listener *entry = &bus->map->listeners[slot];
+	struct map_slot *message;
+	uint32_t sequence, have;
+	int r;
+
+	if (!bus->map->slots) {
+		while ((sequence = ATOMIC_LOAD(bus->map->sequence)) == entry->acknowledged) {
+			if (nowait) {
+				errno = EAGAIN;
+				return NULL;
+			}
+			if (map_wait(&bus->map->sequence, sequence, timeout, clockid) == -1)
+				return NULL;
+		}
+		entry->received = sequence;
+		return bus->message;
+	}
+
+	/* Messages are received in order, skipping those whose
+	 * broadcasting process died before writing them. */
+	for (;;) {
+		sequence = entry->acknowledged + 1;
+		message = MAP_SLOT(bus, sequence);
+		while ((have = ATOMIC_LOAD(message->sequence)) != sequence) {
+			if (nowait) {
+				errno = EAGAIN;
+				return NULL;
+			}
+			if ((r = map_wait(&message->sequence, have, timeout, clockid)) == -1)
+				return NULL;
+			if (r && SEQUENCE_REACHED(ATOMIC_LOAD(bus->map->sequence), sequence))
+				map_check_abandoned(message, sequence);
+		}
+		entry->received = sequence;
+		if (!message->abandoned)
+			return message->message;
+		map_acknowledge(bus, slot);
+	}
+}
+
+
+/**
+ * Listen on a bus created with `BUS_MAPPED`, see `bus_read`
+ * 
+ * @param   bus        Bus information
+ * @param   callback   Function to call when a message is received
+ * @param   user_data  Parameter passed to `callback`
+ * @param   timeout    The time to wait for a message before failing with
+ *                     `errno` set to `EAGAIN`, `NULL` to wait for ever
+ * @param   clockid    The ID of the clock `timeout` is measured with
+ * @return             0 on success, -1 on error
+ */
+static int
+map_read(const bus_t *bus, int (*callback)(const char *message, void *user_data),
+         void *user_data, const struct timespec *timeout, clockid_t clockid)
+{
+	int r, saved_errno, map_slot, slot;
+	uint64_t received;
+	const char *message;
+	if ((map_slot = map_start_listening(bus)) == -1)
+		return -1;
+	slot = register_listener(bus);
+	PROBE(read_start, bus, 0);
+	t(r = callback(NULL, user_data));
+	if (!r)  goto done;
+	for (;;) {
+		if (!(message = map_receive(bus, map_slot, 0, timeout, clockid)))
+			goto fail;
+		received = stats_now(bus);
+		listener_received(bus, slot);
+		PROBE(read_received, bus, strlen(message));
+		if ((message = unexpired(bus, message))) {
+			t(r = callback(message, user_data));
+			PROBE(read_handled, bus, strlen(message));
+			if (!r)  goto done;
+		}
+		map_acknowledge(bus, map_slot);
+		stats_acknowledged(bus, received);
+		listener_acknowledged(bus, slot);
+		PROBE(read_acknowledged, bus, 0);
+	}
+
+fail:
+	saved_errno = errno;
+	map_stop_listening(bus, map_slot);
+	unregister_listener(bus, slot);
+	PROBE(read_stop, bus, 0);
+	errno = saved_errno;
+	return -1;
+
+done:
+	map_stop_listening(bus, map_slot);
+	unregister_listener(bus, slot);
+	PROBE(read_stop, bus, 0);
+	return 0;
+}
+
+
+/**
+ * Acknowledge the message that `bus_poll` returned last,
+ * unless it has already been acknowledged
+ * 
+ * @param   bus  Bus information, it must not have partitions
+ * @return       0 on success, -1 on error
+ */
+static int
+poll_acknowledge(bus_t *bus)
+{
+	int state = 0, saved_errno;
+	if (bus->first_poll)
+		return 0;
+	if (bus->map) {
+		map_acknowledge(bus, bus->map_slot);
+	} else {
+		t(release_semaphore(bus, W, SEM_UNDO));  state++;
+		t(acquire_semaphore(bus, S, SEM_UNDO));  state++;
+		if (bus->synchronous)
+			t(zero_semaphore(bus, S, 0));
+		else
+			t(zero_semaphore(bus, N, 0));
+		t(release_semaphore(bus, S, SEM_UNDO));  state--;
+		t(continue_listening(bus));  state--;
+	}
+	stats_acknowledged(bus, bus->received);
+	listener_acknowledged(bus, bus->slot);
+	PROBE(poll_acknowledged, bus, 0);
+	bus->first_poll = 1;
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (state > 1)
+		release_semaphore(bus, S, SEM_UNDO);
+	if (state > 0)
+		acquire_semaphore(bus, W, SEM_UNDO);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Wait for a message on a bus created with `BUS_MAPPED`, see `bus_poll`
+ * 
+ * @param   bus      Bus information
+ * @param   nowait   Non-zero to fail with `errno` set to `EAGAIN`
+ *                   if there is no new message
+ * @param   timeout  The time to wait for before failing with `errno`
+ *                   set to `EAGAIN`, `NULL` to wait for ever
+ * @param   clockid  The ID of the clock `timeout` is measured with
+ * @return           The received message, `NULL` on error
+ */
+static const char *
+map_poll(bus_t *bus, int nowait, const struct timespec *timeout, clockid_t clockid)
+{
+	const char *message;
+again:
+	if (poll_acknowledge(bus))
+		return NULL;
+	if (!(message = map_receive(bus, bus->map_slot, nowait, timeout, clockid)))
+		return NULL;
+	bus->first_poll = 0;
+	bus->received = stats_now(bus);
+	listener_received(bus, bus->slot);
+	PROBE(poll_received, bus, strlen(message));
+	if (!(message = unexpired(bus, message)))
+		goto again;
+	return message;
+}
+
+
+/**
+ * Read the beginning of the file of a bus
+ * 
+ * @param   file  The pathname of the bus
+ * @param   buf   Output buffer, it will be NUL-terminated
+ * @param   size  The size of `buf`
+ * @return        The number of read bytes, -1 on error
+ */
+static ssize_t
+read_bus_file(const char *file, char *buf, size_t size)
+{
+	size_t off = 0;
+	ssize_t r;
+	int fd, saved_errno;
+	t(fd = open(file, O_RDONLY));
+	while (off < size - 1) {
+		r = read(fd, buf + off, size - 1 - off);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			saved_errno = errno;
+			close(fd);
+			errno = saved_errno;
+			return -1;
+		}
+		if (!r)
+			break;
+		off += (size_t)r;
+	}
+	close(fd);
+	buf[off] = '\0';
+	return (ssize_t)off;
+fail:
+	return -1;
+}
+
+
+/**
+ * Check whether the beginning of the file of
+ * a bus identifies it as created with `BUS_MAPPED`
+ * 
+ * @param   buf:const char *  The beginning of the file
+ * @param   n:ssize_t         The number of bytes in `buf`
+ * @return  :int              Non-zero if the bus was created with `BUS_MAPPED`
+ */
+#define IS_MAPPED(buf, n) \
+	(((size_t)(n) >= sizeof(MAP_MAGIC) - 1) && !memcmp(buf, MAP_MAGIC, sizeof(MAP_MAGIC) - 1))
+
+
+/**
+ * Check whether a bus was created with `BUS_MAPPED`
+ * 
+ * @param   file  The pathname of the bus
+ * @return        1 if the bus was created with `BUS_MAPPED`,
+ *                0 if it was not, -1 on error
+ */
+static int
+is_mapped(const char *file)
+{
+	char buf[sizeof(MAP_MAGIC)];
+	ssize_t n;
+	t(n = read_bus_file(file, buf, sizeof(buf)));
+	return IS_MAPPED(buf, n);
+fail:
+	return -1;
+}
+
+
+/**
+ * Initialise the file of a bus created with `BUS_MAPPED`
+ * 
+ * @param   fd     File descriptor for the empty bus file,
+ *                 opened for reading and writing
+ * @param   flags  The flags the bus is created with
+ * @return         0 on success, -1 on error
+ */
+static int
+create_map(int fd, int flags)
+{
+	int i, saved_errno, have_attr = 0;
+	pthread_mutexattr_t attr;
+	struct bus_map *map = MAP_FAILED;
+	struct map_slot *slots;
+	size_t size = sizeof(struct bus_map);
+	uint32_t nslots = (flags & BUS_CONCURRENT) ? MAP_SLOTS : 0;
+
+	size += CONTROL_SIZE(flags);
+	size += nslots * sizeof(struct map_slot);
+
+	/* The file is zero-filled by `ftruncate`. */
+	t(ftruncate(fd, (off_t)size));
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+
+	if ((errno = pthread_mutexattr_init(&attr)))
+		goto fail;
+	have_attr = 1;
+	if ((errno = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)) ||
+	    (errno = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) ||
+	    (errno = pthread_mutex_init(&map->lock, &attr)))
+		goto fail;
+	for (i = 0; i < MAP_LISTENERS; i++)
+		if ((errno = pthread_mutex_init(&map->listeners[i].alive, &attr)))
+			goto fail;
+	slots = (struct map_slot *)((char *)map + size) - nslots;
+	for (i = 0; i < (int)nslots; i++)
+		if ((errno = pthread_mutex_init(&slots[i].lock, &attr)))
+			goto fail;
+	pthread_mutexattr_destroy(&attr);
+	have_attr = 0;
+
+	map->version = nslots ? MAP_VERSION_CONCURRENT : MAP_VERSION;
+	map->size = (uint32_t)size;
+	map->slots = nslots;
+	map->flags = (uint32_t)(flags & CONTROL_FLAGS);
+	map->creator = (int32_t)getpid();
+	if (flags & CONTROL_FLAGS)
+		init_control((struct bus_control *)(map->message + BUS_MEMORY_SIZE), flags);
+	memcpy(map->magic, MAP_MAGIC, sizeof(map->magic));
+
+	t(munmap(map, size));
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (have_attr)
+		pthread_mutexattr_destroy(&attr);
+	if (map != MAP_FAILED)
+		munmap(map, size);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Open the file of a bus created with `BUS_MAPPED`
+ * 
+ * @param   bus   Bus information to fill
+ * @param   file  The pathname of the bus
+ * @return        0 on success, -1 on error
+ */
+static int
+open_map(bus_t *bus, const char *file)
+{
+	int fd = -1, saved_errno;
+	struct stat attr;
+	struct bus_map *map = MAP_FAILED;
+	struct bus_control *control;
+	size_t size = 0, slots_size;
+
+	/* Listeners update the file too. */
+	t(fd = open(file, O_RDWR));
+	t(fstat(fd, &attr));
+	size = (size_t)attr.st_size;
+	if (size < sizeof(struct bus_map)) {
+		errno = EINVAL;
+		goto fail;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	slots_size = (size_t)map->slots * sizeof(struct map_slot);
+	if (memcmp(map->magic, MAP_MAGIC, sizeof(map->magic)) || ((size_t)map->size != size) ||
+	    (map->version != (map->slots ? MAP_VERSION_CONCURRENT : MAP_VERSION)) ||
+	    (size < sizeof(struct bus_map) + slots_size)) {
+		errno = EINVAL;
+		goto fail;
+	}
+	size -= slots_size;
+
+	bus->map = map;
+	bus->map_fd = fd;
+	bus->message = map->message;
+	control = (struct bus_control *)(map->message + BUS_MEMORY_SIZE);
+	if (size >= sizeof(struct bus_map) + sizeof(*control) &&
+	    control->magic == CONTROL_MAGIC && control->size >= sizeof(*control))
+		bus->control = control;
+	if (bus->control && size < sizeof(struct bus_map) + control->size + AREAS_SIZE(control->flags))
+		bus->control = NULL;
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (map != MAP_FAILED)
+		munmap(map, size);
+	if (fd != -1)
+		close(fd);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Get the pathname of the journal of a bus
+ * 
+ * @param   file  The pathname of the bus
+ * @return        The pathname of the journal, which the caller
+ *                shall free with `free`, `NULL` on error
+ */
+static char *
+journal_pathname(const char *file)
+{
+	size_t len = strlen(file);
+	char *path = malloc(len + sizeof(JOURNAL_SUFFIX));
+	if (!path)
+		return NULL;
+	memcpy(path, file, len);
+	memcpy(path + len, JOURNAL_SUFFIX, sizeof(JOURNAL_SUFFIX));
+	return path;
+}
+
+
+/**
+ * Create the journal of a bus created with `BUS_JOURNAL`,
+ * replacing any journal a removed bus left behind
+ * 
+ * @param   file  The pathname of the bus
+ * @return        0 on success, -1 on error
+ */
+static int
+create_journal(const char *file)
+{
+	int fd = -1, saved_errno;
+	struct bus_journal *journal = MAP_FAILED;
+	size_t size = sizeof(struct bus_journal) + BUS_JOURNAL_SLOTS * sizeof(struct journal_record);
+	char *path;
+
+	if (!(path = journal_pathname(file)))
+		return -1;
+	t(fd = open(path, O_RDWR | O_CREAT | O_TRUNC, DEFAULT_MODE));
+
+	/* The file is zero-filled by `ftruncate`. */
+	t(ftruncate(fd, (off_t)size));
+	journal = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (journal == MAP_FAILED)
+		goto fail;
+	journal->version = JOURNAL_VERSION;
+	journal->slots = BUS_JOURNAL_SLOTS;
+	journal->size = (uint64_t)size;
+	memcpy(journal->magic, JOURNAL_MAGIC, sizeof(journal->magic));
+	t(msync(journal, size, MS_SYNC));
+
+	t(munmap(journal, size));
+	close(fd);
+	free(path);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (journal != MAP_FAILED)
+		munmap(journal, size);
+	if (fd != -1) {
+		close(fd);
+		unlink(path);
+	}
+	free(path);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Map the journal of a bus created with `BUS_JOURNAL`
+ * 
+ * @param   bus   Bus information to fill
+ * @param   file  The pathname of the bus
+ * @return        0 on success, -1 on error
+ */
+static int
+open_journal(bus_t *bus, const char *file)
+{
+	int fd = -1, saved_errno;
+	struct stat attr;
+	struct bus_journal *journal = MAP_FAILED;
+	size_t size = 0;
+	char *path;
+
+	/* Readers update the file too. */
+	if (!(path = journal_pathname(file)))
+		return -1;
+	t(fd = open(path, O_RDWR));
+	t(fstat(fd, &attr));
+	size = (size_t)attr.st_size;
+	if (size < sizeof(struct bus_journal)) {
+		errno = EINVAL;
+		goto fail;
+	}
+	journal = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (journal == MAP_FAILED)
+		goto fail;
+	if (memcmp(journal->magic, JOURNAL_MAGIC, sizeof(journal->magic)) ||
+	    (journal->version != JOURNAL_VERSION) || ((size_t)journal->size != size) || !journal->slots ||
+	    (size < sizeof(struct bus_journal) + journal->slots * sizeof(struct journal_record))) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	/* The mapping outlives the file descriptor. */
+	close(fd);
+	free(path);
+	bus->journal = journal;
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (journal != MAP_FAILED)
+		munmap(journal, size);
+	if (fd != -1)
+		close(fd);
+	free(path);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Parse the ID of a call or a survey from a message
+ * of the form "<pid> <kind> <id> <request>"
+ * 
+ * @param   message  The message
+ * @param   kind     The kind of message, "call" or "survey"
+ * @param   id       Output parameter for the ID
+ * @return           0 on success, -1 with `errno` set
+ *                   to `EINVAL` if the message is not
+ *                   of the specified kind
+ */
+static int
+parse_tagged(const char *message, const char *kind, unsigned long long *id)
+{
+	const char *p = message;
+	size_t len = strlen(kind);
+	char *end;
+
+	while ('0' <= *p && *p <= '9')
+		p++;
+	if (p == message || *p++ != ' ' || strncmp(p, kind, len) || p[len] != ' ')
+		goto invalid;
+	p += len + 1;
+	if (!('0' <= *p && *p <= '9'))
+		goto invalid;
+	errno = 0;
+	*id = strtoull(p, &end, 10);
+	if (errno || (*end && *end != ' '))
+		goto invalid;
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+
+/**
+ * Count the calls that are awaiting a reply on a bus
+ * 
+ * @param   bus  Bus information
+ * @return       The number of calls, 0 if the bus has no reply area
+ */
+static unsigned long
+pending_calls(const bus_t *bus)
+{
+	struct call_slot *slot;
+	unsigned long n = 0;
+	int32_t pid;
+	int i;
+
+	if (!HAVE_CALLS(bus))
+		return 0;
+	for (i = 0; i < BUS_CALL_SLOTS; i++) {
+		slot = CALL_SLOT(bus, i);
+		pid = ATOMIC_LOAD(slot->pid);
+		if (pid && ATOMIC_LOAD(slot->waiting) && process_exists((pid_t)pid))
+			n += 1;
+	}
+	return n;
+}
+
+
+/**
+ * Claim a slot in the reply area of a bus, reusing
+ * slots claimed by processes that have died
+ * 
+ * @param   bus         Bus information, must have a reply area
+ * @param   generation  Output parameter for the generation of the call
+ * @return              The index of the slot, -1 on error
+ */
+static int
+claim_call(const bus_t *bus, uint32_t *generation)
+{
+	struct call_slot *slot;
+	int32_t pid = (int32_t)getpid(), expected;
+	uint32_t next;
+	int i;
+
+	for (i = 0; i < BUS_CALL_SLOTS; i++) {
+		slot = CALL_SLOT(bus, i);
+		expected = ATOMIC_LOAD(slot->pid);
+		if (expected && process_exists((pid_t)expected))
+			continue;
+		if (!ATOMIC_CAS(slot->pid, expected, pid))
+			continue;
+		next = slot->generation + 1;
+		next += !next;
+		slot->generation = next;
+		ATOMIC_STORE(slot->waiting, next);
+		*generation = next;
+		return i;
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+
+/**
+ * Release a slot in the reply area of a bus, the call is cancelled
+ * if it is still awaiting a reply, but if a process has started to
+ * write the reply, the reply is waited for, for a short while in
+ * case that process has died
+ * 
+ * @param   bus         Bus information, must have a reply area
+ * @param   index       The index of the slot, as returned by `claim_call`
+ * @param   generation  The generation of the call
+ * @param   reply       Output parameter for the reply
+ * @return              1 if the reply was received, 0 otherwise
+ */
+static int
+finish_call(const bus_t *bus, int index, uint32_t generation, char *reply)
+{
+	struct call_slot *slot = CALL_SLOT(bus, index);
+	uint32_t expected = generation, replied;
+	int saved_errno = errno, received = 0, checks = 0, r;
+	size_t len;
+
+	if (!ATOMIC_CAS(slot->waiting, expected, 0)) {
+		while ((replied = ATOMIC_LOAD(slot->replied)) != generation && checks < 2) {
+			r = map_wait(&slot->replied, replied, NULL, 0);
+			if (r < 0 && errno != EINTR)
+				break;
+			checks += r == 1;
+		}
+		if (replied == generation) {
+			len = strnlen(slot->reply, BUS_MEMORY_SIZE - 1);
+			memcpy(reply, slot->reply, len);
+			reply[len] = '\0';
+			received = 1;
+		}
+	}
+
+	ATOMIC_STORE(slot->pid, 0);
+	errno = saved_errno;
+	return received;
+}
+
+
+/**
+ * Get the permissions that a channel offered over a bus
+ * shall be created with, the same as the bus's
+ * 
+ * @param   bus  Bus information
+ * @return       The permissions, -1 on error
+ */
+static int
+channel_mode(const bus_t *bus)
+{
+	struct shmid_ds shm_stat;
+	struct stat attr;
+	int shm_id;
+
+	if (bus->map) {
+		t(fstat(bus->map_fd, &attr));
+		return (int)(attr.st_mode & 0666);
+	}
+	t(shm_id = shmget(bus->key_shm, (size_t)BUS_MEMORY_SIZE, 0));
+	t(shmctl(shm_id, IPC_STAT, &shm_stat));
+	return (int)(shm_stat.shm_perm.mode & 0666);
+fail:
+	return -1;
+}
+
+
+/**
+ * Close one end of a channel, and wake up
+ * the other end if it is waiting
+ * 
+ * @param  memory  The shared memory of the channel
+ * @param  end     The end, 0 for the offering process
+ */
+static void
+close_channel_end(struct bus_channel_memory *memory, int end)
+{
+	ATOMIC_STORE(memory->closed[end], 1);
+	map_wake(&memory->rings[end].sent);
+	map_wake(&memory->rings[!end].released);
+}
+
+
+/**
+ * Wait for a word in a ring of a channel to change, unless the
+ * other end has been closed or its process has died
+ * 
+ * @param   channel  The channel
+ * @param   word     The word
+ * @param   value    The value the word had when it was checked
+ * @param   waiting  The flag that tells the other end to wake the process
+ * @param   nowait   Non-zero to fail with `errno` set to `EAGAIN`
+ *                   rather than wait
+ * @return           0 if the word may have changed, -1 on error
+ */
+static int
+channel_wait(const bus_channel_t *channel, uint32_t *word, uint32_t value, uint32_t *waiting, int nowait)
+{
+	struct bus_channel_memory *memory = channel->memory;
+	int peer = !channel->end, r;
+
+	/* The other end changes the word before it closes its end. */
+	if (ATOMIC_LOAD(memory->closed[peer]))
+		goto closed;
+	if (nowait) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* The other end changes the word before it checks the
+	 * flag, so either it wakes the process, or the process
+	 * sees that the word has changed. */
+	ATOMIC_STORE(*waiting, 1);
+	ATOMIC_FENCE();
+	r = ATOMIC_LOAD(*word) == value ? map_wait(word, value, NULL, 0) : 0;
+	ATOMIC_STORE(*waiting, 0);
+	if (r < 0)
+		return errno == EINTR ? 0 : -1;
+	if (r && !process_exists((pid_t)ATOMIC_LOAD(memory->pid[peer])))
+		goto closed;
+	return 0;
+
+closed:
+	if (ATOMIC_LOAD(*word) != value)
+		return 0;
+	errno = EPIPE;
+	return -1;
+}
+
+
+/**
+ * Get a snapshot of the state of a bus created with `BUS_MAPPED`
+ * 
+ * @param   bus    Bus information
+ * @param   state  Zero-initialised output parameter for the state of the bus
+ * @return         0 on success, -1 on error
+ */
+static int
+map_state(const bus_t *bus, struct bus_state *state)
+{
+	struct stat attr;
+	struct map_listener *slot;
+	uint32_t sequence = ATOMIC_LOAD(bus->map->sequence);
+	int i;
+
+	t(fstat(bus->map_fd, &attr));
+
+	/* On buses created with `BUS_CONCURRENT`, a message is
+	 * being broadcasted if any listener is behind. */
+	state->broadcasting = ATOMIC_LOAD(bus->map->writer) != 0;
+	for (i = 0; i < MAP_LISTENERS; i++) {
+		slot = &bus->map->listeners[i];
+		if (!ATOMIC_LOAD(slot->used) || !map_alive(slot))
+			continue;
+		state->listeners += 1;
+		if (ATOMIC_LOAD(slot->acknowledged) == sequence)
+			state->waiting_listeners += 1;
+		else if (bus->map->slots)
+			state->broadcasting = 1;
+		if (ATOMIC_LOAD(slot->acknowledged) != sequence && state->broadcasting)
+			state->unacknowledged += 1;
+	}
+
+	state->size = (size_t)bus->map->size;
+	state->uid = attr.st_uid;
+	state->gid = attr.st_gid;
+	state->mode = (mode_t)(attr.st_mode & 0777);
+	state->creator = (pid_t)bus->map->creator;
+	state->last_operation = (time_t)bus->map->last_operation;
+	state->sequence = bus->control ? bus->control->sequence : (uint64_t)sequence;
+	state->slots = bus->map->slots ? (unsigned long)bus->map->slots : 1;
+	state->partitions = 1;
+	state->calls = pending_calls(bus);
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+
+/**
+ * Reset a bus information structure to describe no bus
+ * 
+ * @param  bus  The bus information
+ */
+static void
+clear_bus(bus_t *bus)
+{
+	bus->sem_id = -1;
+	bus->key_sem = -1;
+	bus->key_shm = -1;
+	bus->message = NULL;
+	bus->control = NULL;
+	bus->slot = -1;
+	bus->map = NULL;
+	bus->map_fd = -1;
+	bus->map_slot = -1;
+	bus->synchronous = 0;
+	bus->partitions = 1;
+	bus->partition = NULL;
+	bus->subscribed = 1;
+	bus->journal = NULL;
+}
+
+
+/**
+ * Allocate the partitions of a bus, without their keys
+ * 
+ * @param   bus  The bus, with its protocol variant set
+ * @param   n    The number of partitions, at least 2
+ * @return       0 on success, -1 on error
+ */
+static int
+make_partitions(bus_t *bus, int n)
+{
+	int i;
+	if (!(bus->partition = malloc((size_t)n * sizeof(*bus->partition))))
+		return -1;
+	for (i = 0; i < n; i++) {
+		clear_bus(&bus->partition[i]);
+		bus->partition[i].synchronous = bus->synchronous;
+	}
+	bus->partitions = n;
+	bus->subscribed = UINT64_MAX >> (64 - n);
+	return 0;
+}
+
+
+/**
+ * Parse the partitions listed in the file of a bus
+ * 
+ * @param   bus  The bus, the keys of its first partition
+ *               and its protocol variant shall be set
+ * @param   str  The part of the file after the protocol variant
+ * @return       0 on success, -1 on error
+ */
+static int
+parse_partitions(bus_t *bus, const char *str)
+{
+	int i, n = atoi(str);
+
+	if (n < 2 || n > BUS_MAX_PARTITIONS) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (make_partitions(bus, n))
+		return -1;
+	bus->partition[0].key_sem = bus->key_sem;
+	bus->partition[0].key_shm = bus->key_shm;
+	for (i = 1; i < n; i++) {
+		if (!(str = strchr(str, '\n')) || !*++str)
+			goto invalid;
+		bus->partition[i].key_sem = (key_t)atoll(str);
+		if (!(str = strchr(str, '\n')) || !*++str)
+			goto invalid;
+		bus->partition[i].key_shm = (key_t)atoll(str);
+	}
+	return 0;
+
+invalid:
+	free(bus->partition);
+	bus->partition = NULL;
+	bus->partitions = 1;
+	bus->subscribed = 1;
+	errno = EINVAL;
+	return -1;
+}
+
+
+/**
+ * Get the partition of a bus that a key maps to
+ * 
+ * @param   bus  The bus
+ * @param   key  The key
+ * @return       The partition, `bus` itself if it does not have partitions
+ */
+static const bus_t *
+key_partition(const bus_t *bus, const char *key)
+{
+	uint32_t h = 2166136261UL;
+	if (!bus->partition)
+		return bus;
+	while (*key)
+		h = (h ^ (unsigned char)*key++) * 16777619UL;
+	return &bus->partition[h % (uint32_t)bus->partitions];
+}
+
+
+/**
+ * Wait for a message on the subscribed partitions of a bus,
+ * waiting on one partition at a time, see `bus_poll_timed`
+ * 
+ * @param   bus      The bus, it must have partitions
+ * @param   nowait   Non-zero to fail with `errno` set to `EAGAIN`
+ *                   if there is no new message
+ * @param   timeout  The time to wait for before failing with `errno`
+ *                   set to `EAGAIN`, `NULL` to wait for ever
+ * @param   clockid  The ID of the clock `timeout` is measured with
+ * @return           The received message, `NULL` on error
+ */
+static const char *
+partitioned_poll(const bus_t *bus, int nowait, const struct timespec *timeout, clockid_t clockid)
+{
+	struct timespec until;
+	const char *message;
+	bus_t *part;
+	int i, n = 0, start = 0, last;
+
+	/* Acknowledge the message returned last, and continue with
+	 * the next partition so that a busy partition cannot keep
+	 * the others from being polled. */
+	for (i = 0; i < bus->partitions; i++) {
+		part = &bus->partition[i];
+		if (((bus->subscribed >> i) & 1) && !part->first_poll) {
+			if (poll_acknowledge(part))
+				return NULL;
+			start = i + 1;
+			break;
+		}
+	}
+
+	for (i = start;; i++) {
+		if (i == bus->partitions)
+			i = 0;
+		if (nowait && n++ == bus->partitions) {
+			errno = EAGAIN;
+			return NULL;
+		}
+		if (!((bus->subscribed >> i) & 1))
+			continue;
+		part = &bus->partition[i];
+		if (nowait) {
+			if ((message = bus_poll(part, BUS_NOWAIT)) || errno != EAGAIN)
+				return message;
+			continue;
+		}
+		clock_gettime(timeout ? clockid : CLOCK_MONOTONIC, &until);
+		until.tv_nsec += PARTITION_POLL_INTERVAL;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec += 1;
+			until.tv_nsec -= 1000000000L;
+		}
+		last = timeout && (until.tv_sec > timeout->tv_sec ||
+		                   (until.tv_sec == timeout->tv_sec &&
+		                    until.tv_nsec >= timeout->tv_nsec));
+		if (last)
+			until = *timeout;
+		message = bus_poll_timed(part, &until, timeout ? clockid : CLOCK_MONOTONIC);
+		if (message || errno != EAGAIN || last)
+			return message;
+	}
+}
+
+
+/**
+ * Stop listening on some of the partitions of a bus,
+ * see `bus_poll_stop`, the others are stopped even
+ * if one of them fails
+ * 
+ * @param   bus         The bus, it must have partitions
+ * @param   partitions  The partitions, bit `i` is set for partition `i`
+ * @return              0 on success, -1 on error
+ */
+static int
+partitioned_poll_stop(const bus_t *bus, uint64_t partitions)
+{
+	int i, r = 0, saved_errno = 0;
+	for (i = 0; i < bus->partitions; i++) {
+		if (((partitions >> i) & 1) && bus_poll_stop(&bus->partition[i])) {
+			saved_errno = errno;
+			r = -1;
+		}
+	}
+	if (r)
+		errno = saved_errno;
+	return r;
+}
+
+
+/**
+ * Make the threads that listen on the partitions of a bus
+ * stop, the caller must hold the lock of `read`
+ * 
+ * @param  read    The state shared by the threads
+ * @param  failed  Non-zero if they stop because of an error
+ * @param  error   The error, ignored unless `failed` is non-zero
+ */
+static void
+partitioned_stop(struct partitioned_read *read, int failed, int error)
+{
+	if (failed && !read->failed) {
+		read->failed = 1;
+		read->error = error;
+	}
+	read->stop = 1;
+	pthread_cond_broadcast(&read->cond);
+}
+
+
+/**
+ * Listen on a partition of a bus, for `bus_read`
+ * 
+ * @param   data  The thread, `struct partition_listener *`
+ * @return        `NULL`
+ */
+static void *
+partition_listen(void *data)
+{
+	struct partition_listener *listener = data;
+	struct partitioned_read *read = listener->read;
+	struct timespec until;
+	const char *message;
+	int r, error, last;
+
+	error = bus_poll_start(&listener->bus) ? errno : 0;
+	pthread_mutex_lock(&read->lock);
+	read->started++;
+	if (error)
+		partitioned_stop(read, 1, error);
+	pthread_cond_broadcast(&read->cond);
+	while (!read->ready && !read->stop)
+		pthread_cond_wait(&read->cond, &read->lock);
+	pthread_mutex_unlock(&read->lock);
+	if (error)
+		return NULL;
+
+	for (;;) {
+		/* Wake up regularly to check whether another
+		 * thread has stopped or the time is up. */
+		clock_gettime(read->clockid, &until);
+		until.tv_nsec += PARTITION_CHECK_INTERVAL;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec += 1;
+			until.tv_nsec -= 1000000000L;
+		}
+		last = read->timeout && (until.tv_sec > read->timeout->tv_sec ||
+		                         (until.tv_sec == read->timeout->tv_sec &&
+		                          until.tv_nsec >= read->timeout->tv_nsec));
+		if (last)
+			until = *read->timeout;
+		message = bus_poll_timed(&listener->bus, &until, read->clockid);
+		error = errno;
+
+		pthread_mutex_lock(&read->lock);
+		if (read->stop) {
+			/* Another thread has stopped. */
+		} else if (message) {
+			r = read->callback(message, read->user_data);
+			if (r <= 0)
+				partitioned_stop(read, r < 0, errno);
+		} else if (error != EAGAIN && error != EINTR) {
+			partitioned_stop(read, 1, error);
+		} else if (last) {
+			partitioned_stop(read, 1, EAGAIN);
+		}
+		r = read->stop;
+		pthread_mutex_unlock(&read->lock);
+		if (r)
+			break;
+	}
+
+	if (bus_poll_stop(&listener->bus)) {
+		error = errno;
+		pthread_mutex_lock(&read->lock);
+		partitioned_stop(read, 1, error);
+		pthread_mutex_unlock(&read->lock);
+	}
+	return NULL;
+}
+
+
+/**
+ * Listen on the subscribed partitions of a bus, with one thread
+ * per partition, the callback function is called by one thread
+ * at a time, see `bus_read_timed`
+ * 
+ * @param   bus        The bus, it must have partitions
+ * @param   callback   Function to call when a message is received
+ * @param   user_data  Parameter passed to `callback`
+ * @param   timeout    The time the operation shall fail with errno
+ *                     set to `EAGAIN`, `NULL` for never
+ * @param   clockid    The ID of the clock `timeout` is measured with
+ * @return             0 on success, -1 on error
+ */
+static int
+partitioned_read(const bus_t *bus, int (*callback)(const char *message, void *user_data),
+                 void *user_data, const struct timespec *timeout, clockid_t clockid)
+{
+	struct partitioned_read read;
+	struct partition_listener *listeners;
+	int i, n = 0, r, created;
+
+	listeners = malloc((size_t)bus->partitions * sizeof(*listeners));
+	if (!listeners)
+		return -1;
+	for (i = 0; i < bus->partitions; i++) {
+		if (!((bus->subscribed >> i) & 1))
+			continue;
+		listeners[n].read = &read;
+		listeners[n].bus = bus->partition[i];
+		n++;
+	}
+
+	pthread_mutex_init(&read.lock, NULL);
+	pthread_cond_init(&read.cond, NULL);
+	read.callback = callback;
+	read.user_data = user_data;
+	read.timeout = timeout;
+	read.clockid = timeout ? clockid : CLOCK_MONOTONIC;
+	read.started = read.ready = read.stop = 0;
+	read.failed = read.error = 0;
+
+	/* The callback function is called with `NULL` once every
+	 * thread is listening, before any message is passed to it. */
+	pthread_mutex_lock(&read.lock);
+	for (created = 0; created < n; created++) {
+		r = pthread_create(&listeners[created].thread, NULL, partition_listen, &listeners[created]);
+		if (r) {
+			partitioned_stop(&read, 1, r);
+			break;
+		}
+	}
+	while (read.started < created)
+		pthread_cond_wait(&read.cond, &read.lock);
+	if (!read.stop) {
+		r = callback(NULL, user_data);
+		if (r <= 0)
+			partitioned_stop(&read, r < 0, errno);
+	}
+	read.ready = 1;
+	pthread_cond_broadcast(&read.cond);
+	pthread_mutex_unlock(&read.lock);
+
+	for (i = 0; i < created; i++)
+		pthread_join(listeners[i].thread, NULL);
+	pthread_cond_destroy(&read.cond);
+	pthread_mutex_destroy(&read.lock);
+	free(listeners);
+
+	if (read.failed) {
+		errno = read.error;
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Make the threads in `bus_dispatch` stop, the workers
+ * still pass the queued messages to the callback function
+ * 
+ * @param  dispatcher  The state shared by the threads
+ * @param  failed      Non-zero if they stop because of an error
+ * @param  error       The error, ignored unless `failed` is non-zero
+ */
+static void
+dispatch_stop(struct dispatcher *dispatcher, int failed, int error)
+{
+	if (failed) {
+		pthread_mutex_lock(&dispatcher->lock);
+		if (!dispatcher->failed) {
+			dispatcher->failed = 1;
+			dispatcher->error = error;
+		}
+		pthread_mutex_unlock(&dispatcher->lock);
+	}
+	ATOMIC_STORE(dispatcher->stop, 1);
+	ATOMIC_ADD(dispatcher->queued, 1);
+	map_wake(&dispatcher->queued);
+}
+
+
+/**
+ * Take a buffer from the pool in `bus_dispatch`,
+ * waiting until one is returned if the pool is empty,
+ * only the polling thread may call this function
+ * 
+ * @param   dispatcher  The state shared by the threads
+ * @return              The index of the buffer
+ */
+static uint32_t
+dispatch_take(struct dispatcher *dispatcher)
+{
+	uint32_t first, used;
+
+	for (;;) {
+		used = ATOMIC_LOAD(dispatcher->used);
+		first = ATOMIC_LOAD(dispatcher->pool);
+		if (first) {
+			if (!ATOMIC_CAS(dispatcher->pool, first, dispatcher->buffers[first - 1].next))
+				continue;
+			ATOMIC_ADD(dispatcher->used, 1);
+			dispatcher->buffers[first - 1].references = 1;
+			return first - 1;
+		}
+
+		/* Every buffer is in use, so the message that was polled
+		 * last is not acknowledged until a worker is done. */
+		ATOMIC_STORE(dispatcher->polling_waiting, 1);
+		ATOMIC_FENCE();
+		if (!ATOMIC_LOAD(dispatcher->pool) && ATOMIC_LOAD(dispatcher->used) == used)
+			map_wait(&dispatcher->used, used, NULL, 0);
+		ATOMIC_STORE(dispatcher->polling_waiting, 0);
+	}
+}
+
+
+/**
+ * Return a buffer, whose last reference has
+ * been released, to the pool in `bus_dispatch`
+ * 
+ * @param  buffer  The buffer
+ */
+static void
+dispatch_return(struct dispatch_buffer *buffer)
+{
+	struct dispatcher *dispatcher = buffer->dispatcher;
+	uint32_t index = (uint32_t)(buffer - dispatcher->buffers) + 1, first;
+
+	do {
+		first = ATOMIC_LOAD(dispatcher->pool);
+		buffer->next = first;
+	} while (!ATOMIC_CAS(dispatcher->pool, first, index));
+	ATOMIC_DECREMENT(dispatcher->used);
+	ATOMIC_FENCE();
+	if (ATOMIC_LOAD(dispatcher->polling_waiting))
+		map_wake(&dispatcher->used);
+}
+
+
+/**
+ * Add a message to the queue in `bus_dispatch`,
+ * only the polling thread may call this function
+ * 
+ * @param  dispatcher  The state shared by the threads
+ * @param  index       The index of the buffer with the message
+ */
+static void
+dispatch_enqueue(struct dispatcher *dispatcher, uint32_t index)
+{
+	uint32_t tail = dispatcher->tail;
+	struct dispatch_cell *cell = &dispatcher->queue[tail & dispatcher->mask];
+
+	/* There are at least as many cells as buffers, but the worker
+	 * that took the last message in the cell may not yet have
+	 * marked the cell as free. */
+	while (ATOMIC_LOAD(cell->sequence) != tail)
+		sched_yield();
+	cell->buffer = index;
+	ATOMIC_STORE(cell->sequence, tail + 1);
+	dispatcher->tail = tail + 1;
+
+	/* Idle workers are only woken up if there are any. */
+	ATOMIC_ADD(dispatcher->queued, 1);
+	ATOMIC_FENCE();
+	if (ATOMIC_LOAD(dispatcher->idle))
+		map_wake_one(&dispatcher->queued);
+}
+
+
+/**
+ * Take a message from the queue in `bus_dispatch`,
+ * waiting until one is added if the queue is empty
+ * 
+ * @param   dispatcher  The state shared by the threads
+ * @return              The index of the buffer with the message, -1
+ *                      if the queue is empty and the threads shall stop
+ */
+static long
+dispatch_dequeue(struct dispatcher *dispatcher)
+{
+	struct dispatch_cell *cell;
+	uint32_t head, sequence, queued, index;
+
+	for (;;) {
+		queued = ATOMIC_LOAD(dispatcher->queued);
+		head = ATOMIC_LOAD(dispatcher->head);
+		cell = &dispatcher->queue[head & dispatcher->mask];
+		sequence = ATOMIC_LOAD(cell->sequence);
+		if (sequence == head + 1) {
+			if (!ATOMIC_CAS(dispatcher->head, head, head + 1))
+				continue;
+			index = cell->buffer;
+			ATOMIC_STORE(cell->sequence, head + dispatcher->mask + 1);
+			return (long)index;
+		}
+		if (sequence != head)
+			continue;
+
+		/* The queue is empty. */
+		if (ATOMIC_LOAD(dispatcher->stop))
+			return -1;
+		ATOMIC_ADD(dispatcher->idle, 1);
+		ATOMIC_FENCE();
+		if (ATOMIC_LOAD(dispatcher->queued) == queued)
+			map_wait(&dispatcher->queued, queued, NULL, 0);
+		ATOMIC_DECREMENT(dispatcher->idle);
+	}
+}
+
+
+/**
+ * Pass queued messages to the callback function, for `bus_dispatch`
+ * 
+ * @param   data  The state shared by the threads, `struct dispatcher *`
+ * @return        `NULL`
+ */
+static void *
+dispatch_work(void *data)
+{
+	struct dispatcher *dispatcher = data;
+	const char *message;
+	long index;
+	int r;
+
+	while ((index = dispatch_dequeue(dispatcher)) >= 0) {
+		message = dispatcher->buffers[index].message;
+		r = dispatcher->callback(message, dispatcher->user_data);
+		if (r <= 0)
+			dispatch_stop(dispatcher, r < 0, errno);
+		bus_dispatch_release(message);
+	}
+	return NULL;
+}
+
+
+/**
+ * Broadcast the messages queued with `bus_write_async`,
+ * this is the publisher thread
+ * 
+ * @param   data  Not used
+ * @return        Never returns
+ */
+static void *
+async_publish(void *data)
+{
+	struct async_queue *queue = &async_queue;
+	struct async_entry *entry, *next;
+	char batch[BUS_MEMORY_SIZE];
+	const char *message;
+	uint32_t head, n, i;
+	size_t len, add;
+	int error;
+
+	for (;;) {
+		head = queue->head;
+		entry = &queue->entries[head % BUS_ASYNC_SLOTS];
+		if (ATOMIC_LOAD(entry->sequence) != head + 1) {
+			ATOMIC_STORE(queue->publisher_waiting, 1);
+			ATOMIC_FENCE();
+			if (ATOMIC_LOAD(entry->sequence) == head)
+				map_wait(&entry->sequence, head, NULL, 0);
+			ATOMIC_STORE(queue->publisher_waiting, 0);
+			continue;
+		}
+
+		/* Messages that are already queued, for the same bus, are
+		 * joined if they allow it, like `bus broadcast -b` does. */
+		n = 1;
+		message = entry->message;
+		if (entry->flags & BUS_BATCH) {
+			len = strlen(entry->message);
+			for (; n < BUS_ASYNC_SLOTS; n++) {
+				next = &queue->entries[(head + n) % BUS_ASYNC_SLOTS];
+				if (ATOMIC_LOAD(next->sequence) != head + n + 1)
+					break;
+				if (next->bus != entry->bus || !(next->flags & BUS_BATCH))
+					break;
+				add = strlen(next->message);
+				if (len + 1 + add >= BUS_MEMORY_SIZE)
+					break;
+				if (n == 1)
+					memcpy(batch, entry->message, len);
+				batch[len++] = '\n';
+				memcpy(&batch[len], next->message, add);
+				len += add;
+			}
+			if (n > 1) {
+				batch[len] = '\0';
+				message = batch;
+			}
+		}
+		error = bus_write(entry->bus, message, 0) ? errno : 0;
+
+		for (i = 0; i < n; i++) {
+			entry = &queue->entries[(head + i) % BUS_ASYNC_SLOTS];
+			if (entry->completion)
+				entry->completion(entry->message, error, entry->user_data);
+			ATOMIC_STORE(entry->sequence, head + i + BUS_ASYNC_SLOTS);
+		}
+		queue->head = head + n;
+		ATOMIC_STORE(queue->published, head + n);
+		ATOMIC_FENCE();
+		if (ATOMIC_LOAD(queue->waiting))
+			map_wake(&queue->published);
+	}
+
+	return NULL;
+	(void) data;
+}
+
+
+/**
+ * Reset the queue of `bus_write_async` in a child process, which
+ * does not inherit the publisher thread, so that it is restarted
+ * the next time the child process calls `bus_write_async`
+ */
+static void
+async_forked(void)
+{
+	static const pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	/* The messages queued by the parent process are left to
+	 * its publisher thread. The entries are reused, as only
+	 * async-signal-safe functions may be called here. */
+	async_queue.tail = 0;
+	async_queue.head = 0;
+	async_queue.published = 0;
+	async_queue.publisher_waiting = 0;
+	async_queue.waiting = 0;
+	async_queue.error = 0;
+	async_once = once;
+}
+
+
+/**
+ * Create the queue of `bus_write_async` and start
+ * the publisher thread, once per process
+ */
+static void
+async_start(void)
+{
+	pthread_t thread;
+	sigset_t all, old;
+	uint32_t i;
+	int r;
+
+	if (!async_atfork_registered) {
+		r = pthread_atfork(NULL, NULL, async_forked);
+		if (r) {
+			async_queue.error = r;
+			return;
+		}
+		async_atfork_registered = 1;
+	}
+
+	if (!async_queue.entries)
+		async_queue.entries = malloc(BUS_ASYNC_SLOTS * sizeof(*async_queue.entries));
+	if (!async_queue.entries) {
+		async_queue.error = ENOMEM;
+		return;
+	}
+	for (i = 0; i < BUS_ASYNC_SLOTS; i++)
+		async_queue.entries[i].sequence = i;
+
+	/* Signals are left to the application's threads. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	r = pthread_create(&thread, NULL, async_publish, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r) {
+		free(async_queue.entries);
+		async_queue.entries = NULL;
+		async_queue.error = r;
+		return;
+	}
+	pthread_detach(thread);
+}
+
+
+/**
+ * Get a snapshot of the internal state of a bus with partitions,
+ * the counters are summed over the partitions, and the semaphores
+ * and ownership are those of the first partition
+ * 
+ * @param   bus    The bus, it must have partitions
+ * @param   state  Output parameter for the state of the bus
+ * @return         0 on success, -1 on error
+ */
+static int
+partitioned_state(const bus_t *bus, struct bus_state *state)
+{
+	struct bus_state part;
+	int i;
+
+	t(bus_state(&bus->partition[0], state));
+	for (i = 1; i < bus->partitions; i++) {
+		t(bus_state(&bus->partition[i], &part));
+		state->listeners += part.listeners;
+		state->waiting_listeners += part.waiting_listeners;
+		state->unacknowledged += part.unacknowledged;
+		state->acknowledging += part.acknowledging;
+		state->broadcasting |= part.broadcasting;
+		state->waiting_writers += part.waiting_writers;
+		state->size += part.size;
+		state->attached += part.attached;
+		if (part.last_operation > state->last_operation)
+			state->last_operation = part.last_operation;
+		state->sequence += part.sequence;
+	}
+	state->partitions = (unsigned long)bus->partitions;
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Add the measurements of a histogram to another histogram
+ * 
+ * @param  sum        The histogram to add to
+ * @param  histogram  The histogram to add
+ */
+static void
+add_histogram(struct bus_histogram *sum, const struct bus_histogram *histogram)
+{
+	int i;
+	sum->count += histogram->count;
+	sum->total += histogram->total;
+	for (i = 0; i < BUS_HISTOGRAM_BUCKETS; i++)
+		sum->buckets[i] += histogram->buckets[i];
+}
+
+
+/**
+ * Create a new bus
+ * 
+ * @param   file      The pathname of the bus, `NULL` to create a random one
+ * @param   flags     `BUS_EXCL` (if `file` is not `NULL`) to fail if the file
+ *                    already exists, otherwise if the file exists, nothing
+ *                    will happen;
+ *                    `BUS_INTR` to fail if interrupted;
+ *                    `BUS_STATS` to maintain statistics in the bus;
+ *                    `BUS_REGISTRY` to keep a registry of the listeners;
+ *                    `BUS_MAPPED` to store the bus in its file rather
+ *                    than in XSI IPC objects;
+ *                    `BUS_CONCURRENT` to let multiple processes broadcast
+ *                    concurrently, this implies `BUS_MAPPED`;
+ *                    `BUS_JOURNAL` to append the messages to a journal;
+ *                    `BUS_PARTITIONS(n)` to create the bus with `n` partitions
+ * @param   out_file  Output parameter for the pathname of the bus
+ * @return            0 on success, -1 on error
  */
 int
 bus_create(const char *restrict file, int flags, char **restrict out_file)
 {
-	int fd = -1, saved_errno;
-	bus_t bus;
-	char buf[1 + 2 * (3 * sizeof(ssize_t) + 2)];
+	int fd = -1, saved_errno, i, n = PARTITIONS(flags);
+	bus_t part[BUS_MAX_PARTITIONS];
+	char buf[BUS_FILE_SIZE];
 	size_t ptr, len;
 	ssize_t wrote;
-	char *genfile = NULL;
+	char *genfile = NULL, *journal;
 	const char *env;
 
 	if (out_file)
 		*out_file = NULL;
 
-	bus.sem_id = -1;
-	bus.key_sem = -1;
-	bus.key_shm = -1;
-	bus.message = NULL;
-	bus.first_poll = 0;
+	n = n < 1 ? 1 : n;
+	if (n > BUS_MAX_PARTITIONS || (n > 1 && (flags & (BUS_MAPPED | BUS_CONCURRENT | BUS_JOURNAL)))) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		clear_bus(&part[i]);
 
 	srand((unsigned int)time(NULL) + (unsigned int)rand());
 
 	if (file) {
-		fd = open(file, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_MODE);
+		fd = open(file, O_RDWR | O_CREAT | O_EXCL, DEFAULT_MODE);
 		if (fd == -1) {
 			if ((errno != EEXIST) || (flags & BUS_EXCL))
 				return -1;
@@ -562,7 +4324,7 @@ bus_create(const char *restrict file, int flags, char **restrict out_file)
 	retry:
 		for (ptr = 0; ptr < 30; ptr++)
 			genfile[len + ptr] = randomchar();
-		fd = open(genfile, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_MODE);
+		fd = open(genfile, O_RDWR | O_CREAT | O_EXCL, DEFAULT_MODE);
 		if (fd == -1) {
 			if (errno == EEXIST)
 				goto retry;
@@ -570,11 +4332,34 @@ bus_create(const char *restrict file, int flags, char **restrict out_file)
 		}
 	}
 
-	t(create_semaphores(&bus));
-	t(create_shared_memory(&bus));
+	/* The journal is created before the bus file is written,
+	 * so that it exists once the bus can be opened. */
+	if (flags & BUS_JOURNAL)
+		t(create_journal(genfile ? genfile : file));
+
+	if (flags & (BUS_MAPPED | BUS_CONCURRENT)) {
+		t(create_map(fd, flags));
+		close(fd);
+		goto done;
+	}
+
+	/* Calls and surveys are broadcasted on the first partition,
+	 * and messages are retained there, so the other partitions
+	 * do not need a reply area, a response area or a retained
+	 * area. */
+	for (i = 0; i < n; i++) {
+		t(create_semaphores(&part[i]));
+		t(create_shared_memory(&part[i], i ? flags & ~(BUS_CALLS | BUS_SURVEYS | BUS_RETAINED) : flags));
+	}
 
-	sprintf(buf, "%zi\n%zi\n", (ssize_t)(bus.key_sem), (ssize_t)(bus.key_shm));
-	for (len = strlen(buf), ptr = 0; ptr < len;) {
+	/* The other partitions are listed after the protocol variant,
+	 * so older versions of libbus only use the first partition. */
+	len = (size_t)sprintf(buf, "%zi\n%zi\n%i\n", (ssize_t)(part->key_sem), (ssize_t)(part->key_shm), part->synchronous);
+	if (n > 1)
+		len += (size_t)sprintf(buf + len, "%i\n", n);
+	for (i = 1; i < n; i++)
+		len += (size_t)sprintf(buf + len, "%zi\n%zi\n", (ssize_t)(part[i].key_sem), (ssize_t)(part[i].key_shm));
+	for (ptr = 0; ptr < len;) {
 		wrote = write(fd, buf + ptr, len - ptr);
 		if (wrote < 0) {
 			if ((errno != EINTR) || (flags & BUS_INTR))
@@ -597,16 +4382,23 @@ done:
 
 fail:
 	saved_errno = errno;
-	if (bus.key_sem)
-		remove_semaphores(&bus);
-	if (bus.key_shm)
-		remove_shared_memory(&bus);
-	if (fd == -1)
+	for (i = 0; i < n; i++) {
+		if (part[i].key_sem != -1)
+			remove_semaphores(&part[i]);
+		if (part[i].key_shm != -1)
+			remove_shared_memory(&part[i]);
+	}
+	if (fd != -1) {
 		close(fd);
+		unlink(genfile ? genfile : file);
+		if ((flags & BUS_JOURNAL) && (journal = journal_pathname(genfile ? genfile : file))) {
+			unlink(journal);
+			free(journal);
+		}
+	}
 	if (out_file)
 		*out_file = NULL;
 	free(genfile);
-	unlink(file);
 	errno = saved_errno;
 	return -1;
 }
@@ -621,22 +4413,43 @@ fail:
 int
 bus_unlink(const char *file)
 {
-	int r = 0, saved_errno = 0;
+	int r = 0, saved_errno = 0, mapped, i;
+	char *journal;
 	bus_t bus;
-	t(bus_open(&bus, file, -1));
+	t(mapped = is_mapped(file));
 
-	r |= remove_semaphores(&bus);
-	if (r && !saved_errno)
+	/* The journal, if any, is removed first, so that
+	 * the bus can be removed again if this fails. */
+	journal = journal_pathname(file);
+	if (!journal)
+		goto fail;
+	if (unlink(journal) && errno != ENOENT) {
 		saved_errno = errno;
+		free(journal);
+		errno = saved_errno;
+		goto fail;
+	}
+	free(journal);
 
-	r |= remove_shared_memory(&bus);
-	if (r && !saved_errno)
-		saved_errno = errno;
+	if (mapped)
+		return unlink(file);
+	t(bus_open(&bus, file, -1));
+
+	for (i = 0; i < bus.partitions; i++) {
+		r |= remove_semaphores(PARTITION(&bus, i));
+		if (r && !saved_errno)
+			saved_errno = errno;
+
+		r |= remove_shared_memory(PARTITION(&bus, i));
+		if (r && !saved_errno)
+			saved_errno = errno;
+	}
 
 	r |= unlink(file);
 	if (r && !saved_errno)
 		saved_errno = errno;
 
+	free(bus.partition);
 	errno = saved_errno;
 	return r;
 fail:
@@ -644,6 +4457,113 @@ fail:
 }
 
 
+/**
+ * Check whether a cached bus still refers to the same file
+ * 
+ * @param   entry:const struct named_bus *  The cached bus
+ * @param   attr:const struct stat *        The current attributes of the file
+ * @return  :int                            Non-zero if the file has not been replaced
+ */
+#define SAME_FILE(entry, attr) \
+	((entry)->dev == (attr)->st_dev && (entry)->ino == (attr)->st_ino && \
+	 (entry)->mtime.tv_sec == (attr)->st_mtim.tv_sec && \
+	 (entry)->mtime.tv_nsec == (attr)->st_mtim.tv_nsec)
+
+
+/**
+ * Get the pathname of a bus from its name
+ * 
+ * @param   name  The name of the bus
+ * @return        The pathname of the bus, must be freed by the caller,
+ *                `NULL` on error
+ */
+static char *
+resolve_name(const char *name)
+{
+	static const char *const standard[] = {"GENERIC", "AUDIO", "VIDEO", "INPUT", "FILES"};
+	const char *value, *dir;
+	size_t i, n = strlen(name);
+	int is_standard = 0;
+	char *var, *path;
+
+	if (!n || strchr(name, '/') || strchr(name, '=')) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (i = 0; i < sizeof(standard) / sizeof(*standard); i++)
+		if (!strcmp(name, standard[i]))
+			is_standard = 1;
+
+	if (!(var = malloc(n + sizeof("_BUS"))))
+		return NULL;
+	sprintf(var, is_standard ? "BUS_%s" : "%s_BUS", name);
+	value = getenv(var);
+	free(var);
+	if (value && *value)
+		return strdup(value);
+
+	dir = getenv("XDG_RUNTIME_DIR");
+	if (!dir || !*dir)
+		dir = "/run";
+	if (!(path = malloc(strlen(dir) + n + sizeof("/bus/"))))
+		return NULL;
+	sprintf(path, "%s/bus/%s", dir, name);
+	return path;
+}
+
+
+/**
+ * Attach to a bus whose file has been read, that is, open its
+ * semaphore arrays and attach its shared memory, or map its
+ * file, and map its journal, for `bus_open` and `bus_open_named`
+ * 
+ * @param   bus     Bus information, with the keys and partitions
+ *                  from the file of the bus
+ * @param   file    The filename of the bus
+ * @param   mapped  Whether the bus was created with `BUS_MAPPED`
+ * @param   ids     The IDs of the semaphore arrays and shared memory
+ *                  of the partitions, `NULL` to look them up by their keys
+ * @param   flags   `BUS_RDONLY`, `BUS_WRONLY` or `BUS_RDWR`
+ * @return          0 on success, -1 on error
+ */
+static int
+attach_bus(bus_t *bus, const char *file, int mapped, const struct named_partition *ids, int flags)
+{
+	int i, saved_errno;
+	bus_t *part;
+
+	if (mapped) {
+		t(open_map(bus, file));
+	} else {
+		for (i = 0; i < bus->partitions; i++) {
+			part = bus->partition ? &bus->partition[i] : bus;
+			if (ids)
+				part->sem_id = ids[i].sem_id;
+			else
+				t(open_semaphores(part));
+			t(open_shared_memory(part, ids ? ids[i].shm_id : -1, flags));
+		}
+		if (bus->partition) {
+			bus->sem_id = bus->partition->sem_id;
+			bus->message = bus->partition->message;
+			bus->control = bus->partition->control;
+		}
+	}
+
+	if (bus->control && (bus->control->flags & BUS_JOURNAL))
+		t(open_journal(bus, file));
+	return 0;
+
+fail:
+	saved_errno = errno;
+	bus_close(bus);
+	clear_bus(bus);
+	errno = saved_errno;
+	return -1;
+}
+
+
 /**
  * Open an existing bus
  * 
@@ -658,39 +4578,164 @@ fail:
 int
 bus_open(bus_t *restrict bus, const char *restrict file, int flags)
 {
-	int saved_errno;
-	char *line = NULL;
-	size_t len = 0;
-	FILE *f;
+	char buf[BUS_FILE_SIZE], *end;
+	ssize_t n;
+	int mapped;
+
+	clear_bus(bus);
+
+	/* The file is small, so it is read at once rather than with stdio. */
+	t(n = read_bus_file(file, buf, sizeof(buf)));
+	mapped = IS_MAPPED(buf, n);
+	if (!mapped) {
+		end = strchr(buf, '\n');
+		if (!end || !strchr(end + 1, '\n')) {
+			errno = EINVAL;
+			goto fail;
+		}
+		bus->key_sem = (key_t)atoll(buf);
+		bus->key_shm = (key_t)atoll(end + 1);
+
+		/* The protocol variant is on the third line, buses
+		 * created before it was recorded do not have it. */
+		end = strchr(end + 1, '\n') + 1;
+		if (*end) {
+			bus->synchronous = atoi(end);
+			if (bus->synchronous != 0 && bus->synchronous != 1) {
+				errno = ENOTSUP;
+				goto fail;
+			}
 
-	bus->sem_id = -1;
-	bus->key_sem = -1;
-	bus->key_shm = -1;
-	bus->message = NULL;
+			/* Buses with partitions have the number of partitions on
+			 * the fourth line, followed by the keys of the others. */
+			end = strchr(end, '\n');
+			if (end && *++end)
+				t(parse_partitions(bus, end));
+		}
+	}
 
-	f = fopen(file, "r");
-	if (!f)
-		goto fail;
+	if (flags < 0)
+		return 0;
+	return attach_bus(bus, file, mapped, NULL, flags);
+fail:
+	return -1;
+}
 
-	t(getline(&line, &len, f));
-	t(bus->key_sem = (key_t)atoll(line));
-	free(line), line = NULL, len = 0;
 
-	t(getline(&line, &len, f));
-	t(bus->key_shm = (key_t)atoll(line));
-	free(line), line = NULL;
+/**
+ * Open an existing bus by its name
+ * 
+ * The pathname of the bus is taken from the environment variable
+ * `BUS_${name}` if `name` is one of the standard names, otherwise
+ * from `${name}_BUS`, and if the variable is not set, the bus
+ * `$XDG_RUNTIME_DIR/bus/${name}` is used. The keys and IDs of
+ * buses that have been opened before are cached, so opening them
+ * again does not require reading their file or looking them up
+ * 
+ * @param   bus    Bus information to fill
+ * @param   name   The name of the bus, e.g. "GENERIC"
+ * @param   flags  `BUS_RDONLY`, `BUS_WRONLY` or `BUS_RDWR`
+ * @return         0 on success, -1 on error
+ */
+int
+bus_open_named(bus_t *restrict bus, const char *restrict name, int flags)
+{
+	struct named_partition ids[BUS_MAX_PARTITIONS];
+	struct named_bus *entry, **prevp;
+	const bus_t *part;
+	struct stat attr;
+	char *path;
+	int i, n = 0, mapped = 0, synchronous = 0, saved_errno;
+
+	if (flags < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!(path = resolve_name(name)))
+		return -1;
+	if (stat(path, &attr))
+		goto fail;
 
-	fclose(f);
+	/* Look for the bus in the cache, and drop it from the cache if
+	 * the bus has been recreated. The entry is copied while the
+	 * cache is locked, as another thread may drop it. */
+	pthread_mutex_lock(&named_lock);
+	for (prevp = &named_buses; (entry = *prevp); prevp = &entry->next)
+		if (!strcmp(entry->path, path))
+			break;
+	if (entry && !SAME_FILE(entry, &attr)) {
+		*prevp = entry->next;
+		free(entry->parts);
+		free(entry->path);
+		free(entry);
+		entry = NULL;
+	}
+	if (entry) {
+		mapped = entry->mapped;
+		synchronous = entry->synchronous;
+		n = entry->partitions;
+		memcpy(ids, entry->parts, (size_t)n * sizeof(*ids));
+	}
+	pthread_mutex_unlock(&named_lock);
+
+	if (entry) {
+		clear_bus(bus);
+		bus->synchronous = synchronous;
+		if (!mapped) {
+			bus->key_sem = ids[0].key_sem;
+			bus->key_shm = ids[0].key_shm;
+			if (n > 1)
+				t(make_partitions(bus, n));
+			for (i = 0; i < n && bus->partition; i++) {
+				bus->partition[i].key_sem = ids[i].key_sem;
+				bus->partition[i].key_shm = ids[i].key_shm;
+			}
+		}
+		if (attach_bus(bus, path, mapped, mapped ? NULL : ids, flags))
+			goto fail;
+		free(path);
+		return 0;
+	}
 
-	if (flags >= 0) {
-		t(open_semaphores(bus));
-		t(open_shared_memory(bus, flags));
+	t(bus_open(bus, path, flags));
+
+	/* Caching is best-effort. */
+	n = bus->map ? 0 : bus->partitions;
+	entry = calloc(1, sizeof(*entry));
+	if (!entry || (n && !(entry->parts = calloc((size_t)n, sizeof(*entry->parts)))))
+		goto uncached;
+	for (i = 0; i < n; i++) {
+		part = PARTITION(bus, i);
+		entry->parts[i].key_sem = part->key_sem;
+		entry->parts[i].key_shm = part->key_shm;
+		entry->parts[i].sem_id = part->sem_id;
+		entry->parts[i].shm_id = shmget(part->key_shm, (size_t)BUS_MEMORY_SIZE, 0);
+		if (entry->parts[i].shm_id == -1)
+			goto uncached;
 	}
+	entry->path = path;
+	entry->dev = attr.st_dev;
+	entry->ino = attr.st_ino;
+	entry->mtime = attr.st_mtim;
+	entry->mapped = bus->map != NULL;
+	entry->synchronous = bus->synchronous;
+	entry->partitions = n;
+	pthread_mutex_lock(&named_lock);
+	entry->next = named_buses;
+	named_buses = entry;
+	pthread_mutex_unlock(&named_lock);
+	return 0;
 
+uncached:
+	if (entry)
+		free(entry->parts);
+	free(entry);
+	free(path);
 	return 0;
+
 fail:
 	saved_errno = errno;
-	free(line);
+	free(path);
 	errno = saved_errno;
 	return -1;
 }
@@ -705,10 +4750,34 @@ fail:
 int
 bus_close(bus_t *bus)
 {
+	int i, r = 0;
+	if (bus->partition) {
+		for (i = 0; i < bus->partitions; i++)
+			r |= bus_close(&bus->partition[i]);
+		free(bus->partition);
+		clear_bus(bus);
+		return r;
+	}
+
+	/* Messages that have not been flushed yet are flushed now. */
+	if (bus->journal) {
+		if (ATOMIC_LOAD(bus->journal->synced) < ATOMIC_LOAD(bus->journal->sequence))
+			msync(bus->journal, (size_t)bus->journal->size, MS_SYNC);
+		t(munmap(bus->journal, (size_t)bus->journal->size));
+		bus->journal = NULL;
+	}
+
 	bus->sem_id = -1;
-	if (bus->message)
+	if (bus->map) {
+		t(munmap(bus->map, (size_t)bus->map->size));
+		close(bus->map_fd);
+		bus->map = NULL;
+		bus->map_fd = -1;
+	} else if (bus->message) {
 		t(close_shared_memory(bus));
+	}
 	bus->message = NULL;
+	bus->control = NULL;
 	return 0;
 
 fail:
@@ -730,32 +4799,51 @@ fail:
 int
 bus_write(const bus_t *bus, const char *message, int flags)
 {
-	int saved_errno;
-#ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS
-	int state = 0;
-#endif
-	if (acquire_semaphore(bus, X, SEM_UNDO | F(BUS_NOWAIT, IPC_NOWAIT)) == -1)
+	int saved_errno, state = 0;
+	uint64_t start, locked;
+	if (bus->partition)
+		return bus_write(bus->partition, message, flags);
+	if (bus->map)
+		return map_write(bus, message, flags & BUS_NOWAIT, NULL, 0);
+
+	start = stats_now(bus);
+	PROBE(write_start, bus, strlen(message));
+	if (acquire_semaphore(bus, X, SEM_UNDO | F(BUS_NOWAIT, IPC_NOWAIT)) == -1) {
+		saved_errno = errno;
+		stats_wrote(bus, NULL, start, 0);
+		PROBE(write_failed, bus, strlen(message));
+		errno = saved_errno;
 		return -1;
+	}
 	t(zero_semaphore(bus, W, 0));
+	locked = stats_now(bus);
+	advance_sequence(bus);
+	journal_append(bus, message);
+	PROBE(write_locked, bus, strlen(message));
 	write_shared_memory(bus, message);
-#ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS
-	t(release_semaphore(bus, N, SEM_UNDO));  state++;
-#endif
+	if (!bus->synchronous) {
+		t(release_semaphore(bus, N, SEM_UNDO));  state++;
+	}
 	t(write_semaphore(bus, Q, 0));
+	PROBE(write_published, bus, strlen(message));
 	t(zero_semaphore(bus, S, 0));
-#ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS
-	t(acquire_semaphore(bus, N, SEM_UNDO));  state--;
-#endif
+	PROBE(write_acknowledged, bus, strlen(message));
+	if (!bus->synchronous) {
+		t(acquire_semaphore(bus, N, SEM_UNDO));  state--;
+	}
+	stats_wrote(bus, message, start, locked);
 	t(release_semaphore(bus, X, SEM_UNDO));
+	journal_sync(bus);
+	PROBE(write_done, bus, strlen(message));
 	return 0;
 
 fail:
 	saved_errno = errno;
-#ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS
 	if (state > 0)
 		acquire_semaphore(bus, N, SEM_UNDO);
-#endif
 	release_semaphore(bus, X, SEM_UNDO);
+	stats_wrote(bus, NULL, start, 0);
+	PROBE(write_failed, bus, strlen(message));
 	errno = saved_errno;
 	return -1;
 }
@@ -776,43 +4864,654 @@ fail:
 int bus_write_timed(const bus_t *bus, const char *message,
 		    const struct timespec *timeout, clockid_t clockid)
 {
-	int saved_errno;
-#ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS
-	int state = 0;
-#endif
+	int saved_errno, state = 0;
 	struct timespec delta;
+	uint64_t start, locked;
 	if (!timeout)
 		return bus_write(bus, message, 0);
+	if (bus->partition)
+		return bus_write_timed(bus->partition, message, timeout, clockid);
+	if (bus->map)
+		return map_write(bus, message, 0, timeout, clockid);
 
+	start = stats_now(bus);
+	PROBE(write_start, bus, strlen(message));
 	DELTA;
-	if (acquire_semaphore_timed(bus, X, SEM_UNDO, &delta) == -1)
+	if (acquire_semaphore_timed(bus, X, SEM_UNDO, &delta) == -1) {
+		saved_errno = errno;
+		stats_wrote(bus, NULL, start, 0);
+		PROBE(write_failed, bus, strlen(message));
+		errno = saved_errno;
 		return -1;
+	}
 	DELTA;
 	t(zero_semaphore_timed(bus, W, 0, &delta));
+	locked = stats_now(bus);
+	advance_sequence(bus);
+	journal_append(bus, message);
+	PROBE(write_locked, bus, strlen(message));
 	write_shared_memory(bus, message);
-#ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS
-	t(release_semaphore(bus, N, SEM_UNDO));  state++;
-#endif
+	if (!bus->synchronous) {
+		t(release_semaphore(bus, N, SEM_UNDO));  state++;
+	}
 	t(write_semaphore(bus, Q, 0));
+	PROBE(write_published, bus, strlen(message));
 	t(zero_semaphore(bus, S, 0));
-#ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS
-	t(acquire_semaphore(bus, N, SEM_UNDO));  state--;
-#endif
+	PROBE(write_acknowledged, bus, strlen(message));
+	if (!bus->synchronous) {
+		t(acquire_semaphore(bus, N, SEM_UNDO));  state--;
+	}
+	stats_wrote(bus, message, start, locked);
 	t(release_semaphore(bus, X, SEM_UNDO));
+	journal_sync(bus);
+	PROBE(write_done, bus, strlen(message));
 	return 0;
 
 fail:
 	saved_errno = errno;
-#ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS
 	if (state > 0)
 		acquire_semaphore(bus, N, SEM_UNDO);
-#endif
 	release_semaphore(bus, X, SEM_UNDO);
+	stats_wrote(bus, NULL, start, 0);
+	PROBE(write_failed, bus, strlen(message));
 	errno = saved_errno;
 	return -1;
 }
 
 
+/**
+ * Broadcast a message on the partition of a bus that a key maps to
+ * 
+ * @param   bus      Bus information
+ * @param   key      The key of the message
+ * @param   message  The message to write, may not be longer than
+ *                   `BUS_MEMORY_SIZE` including the NUL-termination
+ * @param   flags    `BUS_NOWAIT` if this function shall fail if
+ *                   another process is currently running this
+ *                   procedure
+ * @return           0 on success, -1 on error
+ */
+int
+bus_write_keyed(const bus_t *bus, const char *key, const char *message, int flags)
+{
+	return bus_write(key_partition(bus, key), message, flags);
+}
+
+
+/**
+ * Broadcast a message on a bus, that listeners
+ * shall skip if they receive it after a deadline
+ * 
+ * @param   bus      Bus information
+ * @param   key      The key to broadcast the message with, see
+ *                   `bus_write_keyed`, `NULL` for none
+ * @param   message  The message to write, may not be longer than
+ *                   `BUS_MEMORY_SIZE` including the NUL-termination
+ *                   and the expiration time
+ * @param   expires  The time the message expires
+ * @param   clockid  The ID of the clock `expires` is measured with
+ * @param   flags    `BUS_NOWAIT` if this function shall fail if
+ *                   another process is currently running this
+ *                   procedure
+ * @return           0 on success, -1 on error
+ */
+int
+bus_write_expiring(const bus_t *bus, const char *key, const char *message,
+                   const struct timespec *expires, clockid_t clockid, int flags)
+{
+	char buf[BUS_MEMORY_SIZE];
+	struct timespec delta, now;
+	long long deadline;
+	int n;
+
+	/* The deadline is converted to the monotonic clock,
+	 * which every process on the machine shares. */
+	if (absolute_time_to_delta_time(&delta, expires, clockid) || clock_gettime(CLOCK_MONOTONIC, &now))
+		return -1;
+	deadline = ((long long)now.tv_sec + (long long)delta.tv_sec) * 1000000000LL;
+	deadline += (long long)now.tv_nsec + (long long)delta.tv_nsec;
+	if (deadline < 0)
+		deadline = 0;
+
+	n = snprintf(buf, sizeof(buf), "%c%lld %s", EXPIRES_MARK, deadline, message);
+	if (n < 0)
+		return -1;
+	if ((size_t)n >= sizeof(buf)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return key ? bus_write_keyed(bus, key, buf, flags) : bus_write(bus, buf, flags);
+}
+
+
+/**
+ * Write a slot in the retained area of a bus, the
+ * area must be locked by the calling process
+ * 
+ * @param  slot     The slot
+ * @param  key      The key to retain the message under
+ * @param  message  The message, `NULL` to free the slot
+ */
+static void
+retain(struct retained_slot *slot, const char *key, const char *message)
+{
+	/* Listeners read the slot without locking the area,
+	 * and retry if its sequence number is odd or changes. */
+	uint32_t sequence = slot->sequence + 1;
+	ATOMIC_STORE(slot->sequence, sequence);
+	ATOMIC_FENCE();
+	if (message) {
+		memcpy(slot->message, message, strlen(message) + 1);
+		memcpy(slot->key, key, strlen(key) + 1);
+	} else {
+		slot->key[0] = '\0';
+	}
+	ATOMIC_STORE(slot->sequence, sequence + 1);
+}
+
+
+/**
+ * Retain a message under a key, replacing the message that
+ * was retained under it, and broadcast it with the key
+ * 
+ * @param   bus      Bus information
+ * @param   key      The key, see `bus_write_keyed`, shorter
+ *                   than `BUS_RETAINED_KEY_SIZE` bytes
+ * @param   message  The message to write, may not be longer than
+ *                   `BUS_MEMORY_SIZE` including the NUL-termination,
+ *                   `NULL` to remove the message retained under
+ *                   `key` without broadcasting anything
+ * @param   flags    `BUS_NOWAIT` if this function shall fail if
+ *                   another process is currently running this
+ *                   procedure
+ * @return           0 on success, -1 on error
+ */
+int
+bus_write_retained(const bus_t *bus, const char *key, const char *message, int flags)
+{
+	const bus_t *first = PARTITION(bus, 0);
+	char previous[BUS_MEMORY_SIZE];
+	struct retained_area *area;
+	struct retained_slot *slot = NULL, *free_slot = NULL;
+	int32_t pid = (int32_t)getpid(), expected;
+	uint32_t released;
+	size_t keylen = strlen(key), len = message ? strlen(message) : 0;
+	int i, saved_errno, had_previous = 0;
+
+	if (!HAVE_RETAINED(first)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (!keylen || keylen >= BUS_RETAINED_KEY_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (len >= BUS_MEMORY_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	area = RETAINED_AREA(first);
+
+	/* Wait until no other process is writing to the area,
+	 * the area is taken over if its process has died, in
+	 * which case the slot it was writing is discarded. */
+	for (;;) {
+		released = ATOMIC_LOAD(area->released);
+		expected = ATOMIC_LOAD(area->writer);
+		if (!expected || !process_exists((pid_t)expected)) {
+			if (ATOMIC_CAS(area->writer, expected, pid))
+				break;
+			continue;
+		}
+		if (flags & BUS_NOWAIT) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (map_wait(&area->released, released, NULL, 0) < 0 && errno != EINTR)
+			return -1;
+	}
+	if (expected) {
+		for (i = 0; i < BUS_RETAINED_SLOTS; i++) {
+			if (area->slots[i].sequence & 1) {
+				area->slots[i].key[0] = '\0';
+				ATOMIC_STORE(area->slots[i].sequence, area->slots[i].sequence + 1);
+			}
+		}
+	}
+
+	for (i = 0; i < BUS_RETAINED_SLOTS; i++) {
+		if (!strcmp(area->slots[i].key, key)) {
+			slot = &area->slots[i];
+			break;
+		}
+		if (!free_slot && !area->slots[i].key[0])
+			free_slot = &area->slots[i];
+	}
+	slot = slot ? slot : message ? free_slot : NULL;
+	if (!slot && message) {
+		errno = ENOSPC;
+		goto fail;
+	}
+
+	if (slot) {
+		if ((had_previous = slot->key[0] != '\0'))
+			memcpy(previous, slot->message, sizeof(previous));
+		retain(slot, key, message);
+	}
+
+	/* The area stays locked until the message has been broadcasted,
+	 * so that messages retained under the same key are broadcasted
+	 * in the same order. If the broadcast fails, the message that
+	 * was retained before is restored. */
+	if (message && bus_write_keyed(bus, key, message, flags)) {
+		saved_errno = errno;
+		retain(slot, key, had_previous ? previous : NULL);
+		errno = saved_errno;
+		goto fail;
+	}
+
+	ATOMIC_STORE(area->writer, 0);
+	ATOMIC_ADD(area->released, 1);
+	map_wake(&area->released);
+	return 0;
+
+fail:
+	ATOMIC_STORE(area->writer, 0);
+	ATOMIC_ADD(area->released, 1);
+	map_wake(&area->released);
+	return -1;
+}
+
+
+/**
+ * Get the messages retained on a bus, see `bus_write_retained`
+ * 
+ * @param   bus        Bus information
+ * @param   callback   Function to call with each retained message,
+ *                     and `user_data`, it returns 1 to continue, 0
+ *                     to stop, and -1 on error
+ * @param   user_data  Parameter passed to `callback`
+ * @return             0 on success, -1 on error
+ */
+int
+bus_read_retained(const bus_t *bus, int (*callback)(const char *message, void *user_data), void *user_data)
+{
+	const bus_t *first = PARTITION(bus, 0);
+	char message[BUS_MEMORY_SIZE];
+	struct retained_area *area;
+	struct retained_slot *slot;
+	uint32_t sequence;
+	int32_t writer;
+	int i, r, retained;
+
+	if (!HAVE_RETAINED(first)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	area = RETAINED_AREA(first);
+
+	for (i = 0; i < BUS_RETAINED_SLOTS; i++) {
+		slot = &area->slots[i];
+		for (;;) {
+			sequence = ATOMIC_LOAD(slot->sequence);
+			if (sequence & 1) {
+				/* The slot is being written, or its
+				 * process died while writing it. */
+				writer = ATOMIC_LOAD(area->writer);
+				if (!writer || !process_exists((pid_t)writer)) {
+					retained = 0;
+					break;
+				}
+				sched_yield();
+				continue;
+			}
+			retained = slot->key[0] != '\0';
+			if (retained)
+				memcpy(message, slot->message, sizeof(message));
+			ATOMIC_FENCE();
+			if (ATOMIC_LOAD(slot->sequence) == sequence)
+				break;
+		}
+		if (!retained)
+			continue;
+		message[sizeof(message) - 1] = '\0';
+		t(r = callback(message, user_data));
+		if (!r)
+			break;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+
+/**
+ * Take exclusive access to the cursors of the journal of a bus,
+ * it is taken over if the process that held it has died
+ * 
+ * @param   journal  The journal
+ * @return           0 on success, -1 on error
+ */
+static int
+journal_lock(struct bus_journal *journal)
+{
+	int32_t pid = (int32_t)getpid(), expected;
+	uint32_t released;
+	for (;;) {
+		released = ATOMIC_LOAD(journal->released);
+		expected = ATOMIC_LOAD(journal->editor);
+		if (!expected || !process_exists((pid_t)expected)) {
+			if (ATOMIC_CAS(journal->editor, expected, pid))
+				return 0;
+			continue;
+		}
+		if (map_wait(&journal->released, released, NULL, 0) < 0)
+			return -1;
+	}
+}
+
+
+/**
+ * Release exclusive access to the cursors of the journal of a bus
+ * 
+ * @param  journal  The journal
+ */
+static void
+journal_unlock(struct bus_journal *journal)
+{
+	ATOMIC_STORE(journal->editor, 0);
+	ATOMIC_ADD(journal->released, 1);
+	map_wake(&journal->released);
+}
+
+
+/**
+ * Find a cursor in the journal of a bus, exclusive
+ * access to the cursors must be held
+ * 
+ * @param   journal  The journal
+ * @param   name     The name of the cursor
+ * @return           The cursor, `NULL` if none has the name
+ */
+static struct journal_cursor *
+journal_find_cursor(struct bus_journal *journal, const char *name)
+{
+	int i;
+	for (i = 0; i < BUS_JOURNAL_CURSORS; i++)
+		if (!strcmp(journal->cursors[i].name, name))
+			return &journal->cursors[i];
+	return NULL;
+}
+
+
+/**
+ * Read the messages in the journal of a bus, see `BUS_JOURNAL`,
+ * from where a cursor was last left
+ * 
+ * @param   bus        Bus information
+ * @param   name       The name of the cursor, shorter
+ *                     than `BUS_CURSOR_NAME_SIZE` bytes
+ * @param   callback   Function to call with each message and `user_data`,
+ *                     and with `NULL` once the cursor has been claimed,
+ *                     it returns 1 to continue, 0 to stop, and -1 on
+ *                     error, in which case the message is not acknowledged
+ * @param   user_data  Parameter passed to `callback`
+ * @param   flags      `BUS_NOWAIT` to return once every message
+ *                     in the journal has been read
+ * @return             0 on success, -1 on error
+ */
+int
+bus_read_journal(const bus_t *bus, const char *name,
+                 int (*callback)(const char *message, void *user_data), void *user_data, int flags)
+{
+	struct bus_journal *journal = bus->journal;
+	struct journal_cursor *cursor;
+	struct journal_record *record;
+	char message[BUS_MEMORY_SIZE];
+	const char *unexpired_message;
+	uint64_t next, last;
+	uint32_t appended;
+	int32_t pid = (int32_t)getpid(), reader;
+	int r, saved_errno, i;
+
+	if (!journal) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (!*name || strlen(name) >= BUS_CURSOR_NAME_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Claim the cursor, or create it at the end of the journal. */
+	if (journal_lock(journal))
+		return -1;
+	cursor = journal_find_cursor(journal, name);
+	if (cursor) {
+		reader = ATOMIC_LOAD(cursor->reader);
+		if (reader && process_exists((pid_t)reader)) {
+			journal_unlock(journal);
+			errno = EBUSY;
+			return -1;
+		}
+	} else {
+		for (i = 0; i < BUS_JOURNAL_CURSORS && !cursor; i++)
+			if (!journal->cursors[i].name[0])
+				cursor = &journal->cursors[i];
+		if (!cursor) {
+			journal_unlock(journal);
+			errno = ENOSPC;
+			return -1;
+		}
+		ATOMIC_STORE(cursor->acknowledged, ATOMIC_LOAD(journal->sequence));
+		memcpy(cursor->name, name, strlen(name) + 1);
+	}
+	ATOMIC_STORE(cursor->reader, pid);
+	journal_unlock(journal);
+
+	t(r = callback(NULL, user_data));
+	while (r) {
+		appended = ATOMIC_LOAD(journal->appended);
+		last = ATOMIC_LOAD(journal->sequence);
+		next = cursor->acknowledged + 1;
+
+		if (next > last) {
+			if (flags & BUS_NOWAIT)
+				break;
+			/* `appended` is incremented after the message is
+			 * appended, and before `waiting` is checked. */
+			ATOMIC_ADD(journal->waiting, 1);
+			ATOMIC_FENCE();
+			r = ATOMIC_LOAD(journal->sequence) != last ? 0 :
+			    map_wait(&journal->appended, appended, NULL, 0);
+			saved_errno = errno;
+			ATOMIC_DECREMENT(journal->waiting);
+			errno = saved_errno;
+			t(r);
+			r = 1;
+			continue;
+		}
+
+		if (last - next >= journal->slots)
+			goto overflow;
+		record = JOURNAL_RECORD(journal, next);
+		if (ATOMIC_LOAD(record->sequence) != next)
+			goto overflow;
+		memcpy(message, record->message, sizeof(message));
+		ATOMIC_FENCE();
+		if (ATOMIC_LOAD(record->sequence) != next)
+			goto overflow;
+		message[sizeof(message) - 1] = '\0';
+
+		/* The cursor is advanced once the message has been processed. */
+		unexpired_message = unexpired(bus, message);
+		if (unexpired_message)
+			t(r = callback(unexpired_message, user_data));
+		ATOMIC_STORE(cursor->acknowledged, next);
+	}
+
+	ATOMIC_STORE(cursor->reader, 0);
+	return 0;
+
+overflow:
+	/* Messages that have been overwritten since they were appended
+	 * are lost, the cursor is moved past them, so that the next
+	 * call continues with the oldest message in the journal. */
+	last = ATOMIC_LOAD(journal->sequence);
+	ATOMIC_STORE(cursor->acknowledged, last >= next + journal->slots ? last - journal->slots : next);
+	errno = EOVERFLOW;
+
+fail:
+	ATOMIC_STORE(cursor->reader, 0);
+	return -1;
+}
+
+
+/**
+ * Remove a cursor from the journal of a bus, see `bus_read_journal`
+ * 
+ * @param   bus   Bus information
+ * @param   name  The name of the cursor
+ * @return        0 on success, -1 on error
+ */
+int
+bus_forget_cursor(const bus_t *bus, const char *name)
+{
+	struct bus_journal *journal = bus->journal;
+	struct journal_cursor *cursor;
+	int32_t reader;
+
+	if (!journal) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (!*name) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (journal_lock(journal))
+		return -1;
+	cursor = journal_find_cursor(journal, name);
+	if (!cursor) {
+		journal_unlock(journal);
+		errno = ENOENT;
+		return -1;
+	}
+	reader = ATOMIC_LOAD(cursor->reader);
+	if (reader && process_exists((pid_t)reader)) {
+		journal_unlock(journal);
+		errno = EBUSY;
+		return -1;
+	}
+	cursor->name[0] = '\0';
+	ATOMIC_STORE(cursor->reader, 0);
+	ATOMIC_STORE(cursor->acknowledged, 0);
+	journal_unlock(journal);
+	return 0;
+}
+
+
+/**
+ * Queue a message to be broadcasted on a bus by a
+ * publisher thread, and return without waiting
+ * 
+ * @param   bus         Bus information, it must not be closed
+ *                      until the message has been broadcasted
+ * @param   message     The message to write, may not be longer than
+ *                      `BUS_MEMORY_SIZE` including the NUL-termination
+ * @param   completion  Function to call, from the publisher thread, when
+ *                      the message has been broadcasted, with the message,
+ *                      0 or the error the broadcast failed with, and
+ *                      `user_data`, `NULL` if none
+ * @param   user_data   Parameter passed to `completion`
+ * @param   flags       `BUS_NOWAIT` if this function shall fail if the
+ *                      queue is full, `BUS_BATCH` if the message may
+ *                      be joined with adjacent messages
+ * @return              0 on success, -1 on error
+ */
+int
+bus_write_async(const bus_t *bus, const char *message,
+                void (*completion)(const char *message, int error, void *user_data),
+                void *user_data, int flags)
+{
+	struct async_queue *queue = &async_queue;
+	struct async_entry *entry;
+	uint32_t tail, sequence, published;
+	size_t len = strlen(message);
+
+	if (len >= BUS_MEMORY_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	pthread_once(&async_once, async_start);
+	if (queue->error) {
+		errno = queue->error;
+		return -1;
+	}
+
+	for (;;) {
+		published = ATOMIC_LOAD(queue->published);
+		tail = ATOMIC_LOAD(queue->tail);
+		entry = &queue->entries[tail % BUS_ASYNC_SLOTS];
+		sequence = ATOMIC_LOAD(entry->sequence);
+		if (sequence == tail) {
+			if (ATOMIC_CAS(queue->tail, tail, tail + 1))
+				break;
+			continue;
+		}
+		if ((int32_t)(sequence - tail) > 0)
+			continue;
+
+		/* The queue is full. */
+		if (flags & BUS_NOWAIT) {
+			errno = EAGAIN;
+			return -1;
+		}
+		ATOMIC_ADD(queue->waiting, 1);
+		ATOMIC_FENCE();
+		if (ATOMIC_LOAD(queue->published) == published)
+			map_wait(&queue->published, published, NULL, 0);
+		ATOMIC_DECREMENT(queue->waiting);
+	}
+
+	entry->flags = flags;
+	entry->bus = bus;
+	entry->completion = completion;
+	entry->user_data = user_data;
+	memcpy(entry->message, message, len + 1);
+	ATOMIC_STORE(entry->sequence, tail + 1);
+	ATOMIC_FENCE();
+	if (ATOMIC_LOAD(queue->publisher_waiting))
+		map_wake(&entry->sequence);
+	return 0;
+}
+
+
+/**
+ * Wait until every message that was queued with `bus_write_async`,
+ * before this function was called, has been broadcasted
+ */
+void
+bus_flush(void)
+{
+	struct async_queue *queue = &async_queue;
+	uint32_t tail, published;
+
+	if (!queue->entries)
+		return;
+	tail = ATOMIC_LOAD(queue->tail);
+	while (!SEQUENCE_REACHED(published = ATOMIC_LOAD(queue->published), tail)) {
+		ATOMIC_ADD(queue->waiting, 1);
+		ATOMIC_FENCE();
+		if (ATOMIC_LOAD(queue->published) == published)
+			map_wait(&queue->published, published, NULL, 0);
+		ATOMIC_DECREMENT(queue->waiting);
+	}
+}
+
+
 /**
  * Listen (in a loop, forever) for new message on a bus
  * 
@@ -839,24 +5538,40 @@ fail:
 int
 bus_read(const bus_t *restrict bus, int (*callback)(const char *message, void *user_data), void *user_data)
 {
-	int r, state = 0, saved_errno;
-	if (release_semaphore(bus, S, SEM_UNDO) == -1)
+	int r, state = 0, saved_errno, slot;
+	uint64_t received;
+	const char *message;
+	if (bus->partition)
+		return partitioned_read(bus, callback, user_data, NULL, 0);
+	if (bus->map)
+		return map_read(bus, callback, user_data, NULL, 0);
+	if (start_listening(bus, NULL) == -1)
 		return -1;
+	slot = register_listener(bus);
+	PROBE(read_start, bus, 0);
 	t(r = callback(NULL, user_data));
 	if (!r)  goto done;
 	for (;;) {
-		t(release_semaphore(bus, Q, 0));
 		t(zero_semaphore(bus, Q, 0));
-		t(r = callback(bus->message, user_data));
-		if (!r)  goto done;
+		received = stats_now(bus);
+		listener_received(bus, slot);
+		PROBE(read_received, bus, strlen(bus->message));
+		if ((message = unexpired(bus, bus->message))) {
+			t(r = callback(message, user_data));
+			PROBE(read_handled, bus, strlen(bus->message));
+			if (!r)  goto done;
+		}
 		t(release_semaphore(bus, W, SEM_UNDO));  state++;
 		t(acquire_semaphore(bus, S, SEM_UNDO));  state++;
-		t(zero_semaphore(bus, S, 0));
-#ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS_ME_HARDER
-		t(zero_semaphore(bus, N, 0));
-#endif
+		if (bus->synchronous)
+			t(zero_semaphore(bus, S, 0));
+		else
+			t(zero_semaphore(bus, N, 0));
 		t(release_semaphore(bus, S, SEM_UNDO));  state--;
-		t(acquire_semaphore(bus, W, SEM_UNDO));  state--;
+		t(continue_listening(bus));  state--;
+		stats_acknowledged(bus, received);
+		listener_acknowledged(bus, slot);
+		PROBE(read_acknowledged, bus, 0);
 	}
 
 fail:
@@ -866,10 +5581,14 @@ fail:
 	if (state > 0)
 		acquire_semaphore(bus, W, SEM_UNDO);
 	acquire_semaphore(bus, S, SEM_UNDO);
+	unregister_listener(bus, slot);
+	PROBE(read_stop, bus, 0);
 	errno = saved_errno;
 	return -1;
 
 done:
+	unregister_listener(bus, slot);
+	PROBE(read_stop, bus, 0);
 	t(acquire_semaphore(bus, S, SEM_UNDO));
 	return 0;
 }
@@ -906,66 +5625,621 @@ done:
 int bus_read_timed(const bus_t *restrict bus, int (*callback)(const char *message, void *user_data),
                    void *user_data, const struct timespec *timeout, clockid_t clockid)
 {
-	int r, state = 0, saved_errno;
+	int r, state = 0, saved_errno, slot = -1;
 	struct timespec delta;
+	uint64_t received;
+	const char *message;
 	if (!timeout)
 		return bus_read(bus, callback, user_data);
+	if (bus->partition)
+		return partitioned_read(bus, callback, user_data, timeout, clockid);
+	if (bus->map)
+		return map_read(bus, callback, user_data, timeout, clockid);
 
 	DELTA;
-	if (release_semaphore_timed(bus, S, SEM_UNDO, &delta) == -1)
+	if (start_listening(bus, &delta) == -1)
 		return -1;
+	slot = register_listener(bus);
+	PROBE(read_start, bus, 0);
 	t(r = callback(NULL, user_data));
 	if (!r)  goto done;
 	for (;;) {
-		DELTA;
-		t(release_semaphore_timed(bus, Q, 0, &delta));
 		DELTA;
 		t(zero_semaphore_timed(bus, Q, 0, &delta));
-		t(r = callback(bus->message, user_data));
-		if (!r)  goto done;
+		received = stats_now(bus);
+		listener_received(bus, slot);
+		PROBE(read_received, bus, strlen(bus->message));
+		if ((message = unexpired(bus, bus->message))) {
+			t(r = callback(message, user_data));
+			PROBE(read_handled, bus, strlen(bus->message));
+			if (!r)  goto done;
+		}
 		t(release_semaphore(bus, W, SEM_UNDO));  state++;
 		t(acquire_semaphore(bus, S, SEM_UNDO));  state++;
-		t(zero_semaphore(bus, S, 0));
-#ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS_ME_HARDER
-		t(zero_semaphore(bus, N, 0));
-#endif
+		if (bus->synchronous)
+			t(zero_semaphore(bus, S, 0));
+		else
+			t(zero_semaphore(bus, N, 0));
 		t(release_semaphore(bus, S, SEM_UNDO));  state--;
-		t(acquire_semaphore(bus, W, SEM_UNDO));  state--;
+		t(continue_listening(bus));  state--;
+		stats_acknowledged(bus, received);
+		listener_acknowledged(bus, slot);
+		PROBE(read_acknowledged, bus, 0);
+	}
+
+fail:
+	saved_errno = errno;
+	if (state > 1)
+		release_semaphore(bus, S, SEM_UNDO);
+	if (state > 0)
+		acquire_semaphore(bus, W, SEM_UNDO);
+	acquire_semaphore(bus, S, SEM_UNDO);
+	unregister_listener(bus, slot);
+	PROBE(read_stop, bus, 0);
+	errno = saved_errno;
+	return -1;
+
+done:
+	unregister_listener(bus, slot);
+	PROBE(read_stop, bus, 0);
+	t(acquire_semaphore(bus, S, SEM_UNDO));
+	return 0;
+}
+
+
+/**
+ * Announce that the thread is listening on the bus.
+ * This is required so the will does not miss any
+ * messages due to race conditions. Additionally,
+ * not calling this function will cause the bus the
+ * misbehave, is `bus_poll` is written to expect
+ * this function to have been called.
+ * 
+ * @param   bus  Bus information
+ * @return       0 on success, -1 on error
+ */
+int
+bus_poll_start(bus_t *bus)
+{
+	int i, saved_errno;
+	if (bus->partition) {
+		for (i = 0; i < bus->partitions; i++)
+			if (((bus->subscribed >> i) & 1) && bus_poll_start(&bus->partition[i]))
+				goto fail_partition;
+		return 0;
+	}
+
+	bus->first_poll = 1;
+	bus->received = 0;
+	if (bus->map)
+		t(bus->map_slot = map_start_listening(bus));
+	else
+		t(start_listening(bus, NULL));
+	bus->slot = register_listener(bus);
+	PROBE(poll_start, bus, 0);
+	return 0;
+
+fail_partition:
+	saved_errno = errno;
+	partitioned_poll_stop(bus, bus->subscribed & ~(UINT64_MAX << i));
+	errno = saved_errno;
+fail:
+	return -1;
+}
+
+
+/**
+ * Announce that the thread has stopped listening on the bus.
+ * This is required so that the thread does not cause others
+ * to wait indefinitely.
+ * 
+ * @param   bus  Bus information
+ * @return       0 on success, -1 on error
+ */
+int
+bus_poll_stop(const bus_t *bus)
+{
+	if (bus->partition)
+		return partitioned_poll_stop(bus, bus->subscribed);
+
+	unregister_listener(bus, bus->slot);
+	PROBE(poll_stop, bus, 0);
+	if (bus->map) {
+		map_stop_listening(bus, bus->map_slot);
+		return 0;
+	}
+	return acquire_semaphore(bus, S, SEM_UNDO | IPC_NOWAIT);
+}
+
+
+/**
+ * Wait for a message to be broadcasted on the bus.
+ * The caller should make a copy of the received message,
+ * without freeing the original copy, and parse it in a
+ * separate thread. When the new thread has started be
+ * started, the caller of this function should then
+ * either call `bus_poll` again or `bus_poll_stop`.
+ * 
+ * @param   bus    Bus information
+ * @param   flags  `BUS_NOWAIT` if the bus should fail and set `errno` to
+ *                 `EAGAIN` if there isn't already a message available on the bus
+ * @return         The received message, `NULL` on error
+ */
+const char *
+bus_poll(bus_t *bus, int flags)
+{
+	const char *message;
+	if (bus->partition)
+		return partitioned_poll(bus, flags & BUS_NOWAIT, NULL, 0);
+	if (bus->map)
+		return map_poll(bus, flags & BUS_NOWAIT, NULL, 0);
+again:
+	t(poll_acknowledge(bus));
+	t(zero_semaphore(bus, Q, F(BUS_NOWAIT, IPC_NOWAIT)));
+	bus->first_poll = 0;
+	bus->received = stats_now(bus);
+	listener_received(bus, bus->slot);
+	PROBE(poll_received, bus, strlen(bus->message));
+	if (!(message = unexpired(bus, bus->message)))
+		goto again;
+	return message;
+
+fail:
+	return NULL;
+}
+
+
+/**
+ * Wait for a message to be broadcasted on the bus.
+ * The caller should make a copy of the received message,
+ * without freeing the original copy, and parse it in a
+ * separate thread. When the new thread has started be
+ * started, the caller of this function should then
+ * either call `bus_poll_timed` again or `bus_poll_stop`.
+ * 
+ * @param   bus      Bus information
+ * @param   timeout  The time the operation shall fail with errno set
+ *                   to `EAGAIN` if not completed
+ * @param   clockid  The ID of the clock the `timeout` is measured with,
+ *                   it most be a predictable clock
+ * @return           The received message, `NULL` on error
+ */
+const char *bus_poll_timed(bus_t *bus, const struct timespec *timeout, clockid_t clockid)
+{
+	struct timespec delta;
+	const char *message;
+	if (!timeout)
+		return bus_poll(bus, 0);
+	if (bus->partition)
+		return partitioned_poll(bus, 0, timeout, clockid);
+	if (bus->map)
+		return map_poll(bus, 0, timeout, clockid);
+
+again:
+	t(poll_acknowledge(bus));
+	DELTA;
+	t(zero_semaphore_timed(bus, Q, 0, &delta));
+	bus->first_poll = 0;
+	bus->received = stats_now(bus);
+	listener_received(bus, bus->slot);
+	PROBE(poll_received, bus, strlen(bus->message));
+	if (!(message = unexpired(bus, bus->message)))
+		goto again;
+	return message;
+
+fail:
+	return NULL;
+}
+
+
+/**
+ * Select the partitions of a bus that `bus_read` and `bus_poll` shall
+ * listen on, `bus_poll` waits on them one at a time
+ * 
+ * @param   bus         Bus information
+ * @param   partitions  The partitions, bit `i` is set for partition `i`
+ * @return              0 on success, -1 on error
+ */
+int
+bus_subscribe(bus_t *bus, uint64_t partitions)
+{
+	if (!partitions || (partitions & ~(UINT64_MAX >> (64 - bus->partitions)))) {
+		errno = EINVAL;
+		return -1;
+	}
+	bus->subscribed = partitions;
+	return 0;
+}
+
+
+/**
+ * Broadcast a request on a bus and wait for a reply to it
+ * 
+ * @param   bus      Bus information
+ * @param   request  The request, the broadcasted message may not
+ *                   be longer than `BUS_MEMORY_SIZE` including
+ *                   the NUL-termination
+ * @param   reply    Output parameter for the reply, must be able
+ *                   to hold `BUS_MEMORY_SIZE` bytes
+ * @param   timeout  The time the operation shall fail with errno set
+ *                   to `EAGAIN` if no reply has been received,
+ *                   `NULL` to wait for ever
+ * @param   clockid  The ID of the clock the `timeout` is measured with,
+ *                   it most be a predictable clock
+ * @return           0 on success, -1 on error
+ */
+int
+bus_call(const bus_t *bus, const char *request, char *reply, const struct timespec *timeout, clockid_t clockid)
+{
+	char message[BUS_MEMORY_SIZE];
+	struct call_slot *slot;
+	uint32_t generation = 0, replied;
+	int index = -1, saved_errno, len;
+
+	if (!HAVE_CALLS(bus)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/* The slot is claimed before the request is broadcasted,
+	 * since the reply can arrive before `bus_write` returns. */
+	t(index = claim_call(bus, &generation));
+	slot = CALL_SLOT(bus, index);
+	len = snprintf(message, sizeof(message), "%ji call %ju %s", (intmax_t)getpid(),
+	               (uintmax_t)generation * BUS_CALL_SLOTS + (uintmax_t)index, request);
+	if (len < 0 || (size_t)len >= sizeof(message)) {
+		errno = EMSGSIZE;
+		goto fail;
+	}
+	t(bus_write_timed(bus, message, timeout, clockid));
+
+	/* The reply is written to the slot, and
+	 * only this process is woken up by it. */
+	while ((replied = ATOMIC_LOAD(slot->replied)) != generation)
+		if (map_wait(&slot->replied, replied, timeout, clockid) < 0 && errno != EINTR)
+			goto fail;
+	finish_call(bus, index, generation, reply);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (index >= 0 && finish_call(bus, index, generation, reply))
+		return 0;
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Reply to a call received on a bus
+ * 
+ * @param   bus      Bus information
+ * @param   call     The received message with the call
+ * @param   reply    The reply, may not be longer than `BUS_MEMORY_SIZE`
+ *                   including the NUL-termination
+ * @return           0 on success, -1 on error
+ */
+int
+bus_reply(const bus_t *bus, const char *call, const char *reply)
+{
+	struct call_slot *slot;
+	unsigned long long id;
+	uint32_t generation, expected;
+	size_t len = strlen(reply);
+
+	if (!HAVE_CALLS(bus)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (len >= BUS_MEMORY_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (parse_tagged(call, "call", &id))
+		return -1;
+	if (!(id / BUS_CALL_SLOTS) || id / BUS_CALL_SLOTS > UINT32_MAX)
+		goto invalid;
+	slot = CALL_SLOT(bus, (int)(id % BUS_CALL_SLOTS));
+	generation = (uint32_t)(id / BUS_CALL_SLOTS);
+
+	/* Only the first reply is written, the caller may also have
+	 * stopped waiting, and the slot may have been reused. */
+	expected = generation;
+	if (!ATOMIC_CAS(slot->waiting, expected, 0)) {
+		errno = ENOENT;
+		return -1;
+	}
+	memcpy(slot->reply, reply, len + 1);
+	ATOMIC_STORE(slot->replied, generation);
+	map_wake(&slot->replied);
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+
+/**
+ * Broadcast a query on a bus and collect the responses
+ * that the listeners attach to it
+ * 
+ * @param   bus        Bus information
+ * @param   query      The query, the broadcasted message may not
+ *                     be longer than `BUS_MEMORY_SIZE` including
+ *                     the NUL-termination
+ * @param   callback   Function to call for each response, the input
+ *                     parameters will be the response and `user_data`
+ *                     from `bus_survey`'s parameter with the same name.
+ *                     `callback` should return either of the values:
+ *                       *  0:  skip the remaining responses
+ *                       *  1:  continue with the next response
+ *                       * -1:  an error has occurred
+ * @param   user_data        Parameter passed to `callback`
+ * @param   publish_timeout  The time the operation shall fail with errno
+ *                           set to `EAGAIN` if the query has not been
+ *                           published, `NULL` to wait for ever, waiting
+ *                           for the listeners to acknowledge the query
+ *                           is not limited
+ * @param   clockid          The ID of the clock the `publish_timeout` is
+ *                           measured with, it most be a predictable clock
+ * @return                   The number of responses, -1 on error
+ */
+int
+bus_survey(const bus_t *bus, const char *query, int (*callback)(const char *response, void *user_data),
+           void *user_data, const struct timespec *publish_timeout, clockid_t clockid)
+{
+	char message[BUS_MEMORY_SIZE];
+	struct survey_area *area;
+	struct survey_response *response;
+	int32_t pid = (int32_t)getpid(), expected;
+	uint32_t released, generation, count, i;
+	int saved_errno, len, r = 1, n = 0;
+
+	if (!HAVE_SURVEYS(bus)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	area = SURVEY_AREA(bus);
+
+	/* Wait until no other process is surveying the listeners,
+	 * the area is taken over if its process has died. */
+	for (;;) {
+		released = ATOMIC_LOAD(area->released);
+		expected = ATOMIC_LOAD(area->surveyor);
+		if (!expected || !process_exists((pid_t)expected)) {
+			if (ATOMIC_CAS(area->surveyor, expected, pid))
+				break;
+			continue;
+		}
+		if (map_wait(&area->released, released, publish_timeout, clockid) < 0 && errno != EINTR)
+			return -1;
+	}
+
+	generation = area->generation + 1;
+	generation += !generation;
+	area->generation = generation;
+	ATOMIC_STORE(area->count, 0);
+	ATOMIC_STORE(area->active, generation);
+
+	/* `bus_write` returns once every listener has acknowledged
+	 * the query, and the listeners respond before that. The
+	 * acknowledgements cannot be waited for with a timeout, as
+	 * the broadcast cannot be abandoned once it is published. */
+	len = snprintf(message, sizeof(message), "%ji survey %ju %s",
+	               (intmax_t)pid, (uintmax_t)generation, query);
+	if (len < 0 || (size_t)len >= sizeof(message)) {
+		errno = EMSGSIZE;
+		goto fail;
+	}
+	t(bus_write_timed(bus, message, publish_timeout, clockid));
+	ATOMIC_STORE(area->active, 0);
+
+	count = ATOMIC_LOAD(area->count);
+	count = count < BUS_SURVEY_SLOTS ? count : BUS_SURVEY_SLOTS;
+	for (i = 0; i < count; i++) {
+		response = &area->responses[i];
+		if (ATOMIC_LOAD(response->survey) != generation)
+			continue;
+		n += 1;
+		if (r)
+			t(r = callback(response->response, user_data));
+	}
+
+	ATOMIC_STORE(area->surveyor, 0);
+	ATOMIC_ADD(area->released, 1);
+	map_wake(&area->released);
+	return n;
+
+fail:
+	saved_errno = errno;
+	ATOMIC_STORE(area->active, 0);
+	ATOMIC_STORE(area->surveyor, 0);
+	ATOMIC_ADD(area->released, 1);
+	map_wake(&area->released);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Respond to a survey received on a bus
+ * 
+ * @param   bus       Bus information
+ * @param   survey    The received message with the survey
+ * @param   response  The response, may not be longer than
+ *                    `BUS_RESPONSE_SIZE` including the NUL-termination
+ * @return            0 on success, -1 on error
+ */
+int
+bus_respond(const bus_t *bus, const char *survey, const char *response)
+{
+	struct survey_area *area;
+	unsigned long long id;
+	uint32_t i;
+	size_t len = strlen(response);
+
+	if (!HAVE_SURVEYS(bus)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (len >= BUS_RESPONSE_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (parse_tagged(survey, "survey", &id))
+		return -1;
+	area = SURVEY_AREA(bus);
+
+	/* The survey is over once it has been acknowledged. */
+	if (!id || id != (unsigned long long)ATOMIC_LOAD(area->active)) {
+		errno = ENOENT;
+		return -1;
+	}
+	do {
+		i = ATOMIC_LOAD(area->count);
+		if (i >= BUS_SURVEY_SLOTS) {
+			errno = ENOBUFS;
+			return -1;
+		}
+	} while (!ATOMIC_CAS(area->count, i, i + 1));
+
+	memcpy(area->responses[i].response, response, len + 1);
+	ATOMIC_STORE(area->responses[i].survey, (uint32_t)id);
+	return 0;
+}
+
+
+/**
+ * Offer a channel over a bus
+ * 
+ * @param   bus      Bus information
+ * @param   name     The name of the channel, the broadcasted message may
+ *                   not be longer than `BUS_MEMORY_SIZE` including the
+ *                   NUL-termination
+ * @param   channel  Output parameter for the offering end of the channel
+ * @param   timeout  The time the operation shall fail with errno set
+ *                   to `EAGAIN` if the offer has not been broadcasted,
+ *                   `NULL` to wait for ever
+ * @param   clockid  The ID of the clock the `timeout` is measured with,
+ *                   it most be a predictable clock
+ * @return           0 on success, -1 on error
+ */
+int
+bus_channel_offer(const bus_t *bus, const char *name, bus_channel_t *channel,
+                  const struct timespec *timeout, clockid_t clockid)
+{
+	char message[BUS_MEMORY_SIZE];
+	struct bus_channel_memory *memory = NULL;
+	struct shmid_ds _info;
+	int32_t expected = 0;
+	key_t key;
+	int id = -1, mode, saved_errno, len;
+	void *address;
+
+	/* The memory is created like the shared memory of a bus,
+	 * so that it is collected by `bus gc` if it is leaked. */
+	t(mode = channel_mode(bus));
+	for (;;) {
+		key = random_key();
+		id = shmget(key, sizeof(*memory), IPC_CREAT | IPC_EXCL | mode);
+		if (id != -1)
+			break;
+		if ((errno != EEXIST) && (errno != EINTR))
+			goto fail;
+	}
+	address = shmat(id, NULL, 0);
+	if ((address == (void *)-1) || !address)
+		goto fail;
+	memory = address;
+	memory->pid[0] = (int32_t)getpid();
+
+	len = snprintf(message, sizeof(message), "%ji channel %ju %s",
+	               (intmax_t)getpid(), (uintmax_t)key, name);
+	if (len < 0 || (size_t)len >= sizeof(message)) {
+		errno = EMSGSIZE;
+		goto fail;
+	}
+	t(bus_write_timed(bus, message, timeout, clockid));
+
+	/* The offer must be accepted before it is acknowledged,
+	 * so it is withdrawn unless it has been accepted. */
+	if (ATOMIC_CAS(memory->pid[1], expected, -1)) {
+		errno = ECONNREFUSED;
+		goto fail;
 	}
 
+	/* Both processes have attached the memory, it
+	 * remains until both have detached it. */
+	shmctl(id, IPC_RMID, &_info);
+	channel->memory = memory;
+	channel->end = 0;
+	channel->pending = 0;
+	return 0;
+
 fail:
 	saved_errno = errno;
-	if (state > 1)
-		release_semaphore(bus, S, SEM_UNDO);
-	if (state > 0)
-		acquire_semaphore(bus, W, SEM_UNDO);
-	acquire_semaphore(bus, S, SEM_UNDO);
+	if (memory) {
+		expected = 0;
+		if (!ATOMIC_CAS(memory->pid[1], expected, -1) && expected > 0)
+			close_channel_end(memory, 0);
+		shmdt(memory);
+	}
+	if (id != -1)
+		shmctl(id, IPC_RMID, &_info);
 	errno = saved_errno;
 	return -1;
-
-done:
-	t(acquire_semaphore(bus, S, SEM_UNDO));
-	return 0;
 }
 
 
 /**
- * Announce that the thread is listening on the bus.
- * This is required so the will does not miss any
- * messages due to race conditions. Additionally,
- * not calling this function will cause the bus the
- * misbehave, is `bus_poll` is written to expect
- * this function to have been called.
+ * Accept a channel offered over a bus
  * 
- * @param   bus  Bus information
- * @return       0 on success, -1 on error
+ * @param   offer    The received message with the offer
+ * @param   channel  Output parameter for the accepting end of the channel
+ * @return           0 on success, -1 on error
  */
 int
-bus_poll_start(bus_t *bus)
+bus_channel_accept(const char *offer, bus_channel_t *channel)
 {
-	bus->first_poll = 1;
-	t(release_semaphore(bus, S, SEM_UNDO));
-	t(release_semaphore(bus, Q, 0));
+	struct bus_channel_memory *memory;
+	struct shmid_ds shm_stat;
+	unsigned long long key;
+	int32_t expected = 0;
+	int id;
+	void *address;
+
+	if (parse_tagged(offer, "channel", &key))
+		return -1;
+	if ((key & ~0x7FFFFFFFULL) || (key & BUS_KEY_MASK) != BUS_KEY_TAG) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* The memory is removed when the offer is withdrawn, but
+	 * its key could since have been reused by another object. */
+	t(id = shmget((key_t)key, 0, 0));
+	t(shmctl(id, IPC_STAT, &shm_stat));
+	if (shm_stat.shm_segsz != sizeof(*memory) || shm_stat.shm_cpid != (pid_t)atol(offer)) {
+		errno = ENOENT;
+		return -1;
+	}
+	address = shmat(id, NULL, 0);
+	if ((address == (void *)-1) || !address)
+		return -1;
+	memory = address;
+
+	/* Only the first process to accept the offer gets the
+	 * channel, and the offer may have been withdrawn. */
+	if (!ATOMIC_CAS(memory->pid[1], expected, (int32_t)getpid())) {
+		shmdt(memory);
+		errno = ENOENT;
+		return -1;
+	}
+	channel->memory = memory;
+	channel->end = 1;
+	channel->pending = 0;
 	return 0;
 
 fail:
@@ -974,117 +6248,251 @@ fail:
 
 
 /**
- * Announce that the thread has stopped listening on the bus.
- * This is required so that the thread does not cause others
- * to wait indefinitely.
+ * Send a message over a channel
  * 
- * @param   bus  Bus information
- * @return       0 on success, -1 on error
+ * @param   channel  The channel
+ * @param   message  The message, may not be longer than
+ *                   `BUS_MEMORY_SIZE` including the NUL-termination
+ * @param   flags    `BUS_NOWAIT` if this function shall fail
+ *                   if the channel is full
+ * @return           0 on success, -1 on error
  */
 int
-bus_poll_stop(const bus_t *bus)
+bus_channel_send(const bus_channel_t *channel, const char *message, int flags)
 {
-	return acquire_semaphore(bus, S, SEM_UNDO | IPC_NOWAIT);
+	struct bus_channel_memory *memory = channel->memory;
+	struct channel_ring *ring = &memory->rings[channel->end];
+	uint32_t sent = ring->sent, released;
+	size_t len = strlen(message);
+
+	if (len >= BUS_MEMORY_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	for (;;) {
+		if (ATOMIC_LOAD(memory->closed[!channel->end])) {
+			errno = EPIPE;
+			return -1;
+		}
+		released = ATOMIC_LOAD(ring->released);
+		if (sent - released < BUS_CHANNEL_SLOTS)
+			break;
+		t(channel_wait(channel, &ring->released, released, &ring->sender_waiting, flags & BUS_NOWAIT));
+	}
+
+	/* The receiving process is only woken up if it is waiting,
+	 * so a busy channel does not make any system calls. */
+	memcpy(ring->messages[sent % BUS_CHANNEL_SLOTS], message, len + 1);
+	ATOMIC_STORE(ring->sent, sent + 1);
+	ATOMIC_FENCE();
+	if (ATOMIC_LOAD(ring->receiver_waiting))
+		map_wake(&ring->sent);
+	return 0;
+
+fail:
+	return -1;
 }
 
 
 /**
- * Wait for a message to be broadcasted on the bus.
- * The caller should make a copy of the received message,
- * without freeing the original copy, and parse it in a
- * separate thread. When the new thread has started be
- * started, the caller of this function should then
- * either call `bus_poll` again or `bus_poll_stop`.
+ * Receive a message over a channel
  * 
- * @param   bus    Bus information
- * @param   flags  `BUS_NOWAIT` if the bus should fail and set `errno` to
- *                 `EAGAIN` if there isn't already a message available on the bus
- * @return         The received message, `NULL` on error
+ * @param   channel  The channel
+ * @param   flags    `BUS_NOWAIT` if this function shall fail
+ *                   if no message is available
+ * @return           The message, `NULL` on error
  */
 const char *
-bus_poll(bus_t *bus, int flags)
+bus_channel_receive(bus_channel_t *channel, int flags)
 {
-	int state = 0, saved_errno;
-	if (!bus->first_poll) {
-		t(release_semaphore(bus, W, SEM_UNDO));  state++;
-		t(acquire_semaphore(bus, S, SEM_UNDO));  state++;
-		t(zero_semaphore(bus, S, 0));
-#ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS_ME_HARDER
-		t(zero_semaphore(bus, N, 0));
-#endif
-		t(release_semaphore(bus, S, SEM_UNDO));  state--;
-		t(acquire_semaphore(bus, W, SEM_UNDO));  state--;
-		t(release_semaphore(bus, Q, 0));
-	} else {
-		bus->first_poll = 0;
+	struct bus_channel_memory *memory = channel->memory;
+	struct channel_ring *ring = &memory->rings[!channel->end];
+	uint32_t released = ring->released, sent;
+
+	/* The previous message is released when the next one is
+	 * requested, so that it could be used without copying it. */
+	if (channel->pending) {
+		ATOMIC_STORE(ring->released, ++released);
+		channel->pending = 0;
+		ATOMIC_FENCE();
+		if (ATOMIC_LOAD(ring->sender_waiting))
+			map_wake(&ring->released);
 	}
-	state--;
-	t(zero_semaphore(bus, Q, F(BUS_NOWAIT, IPC_NOWAIT)));
-	return bus->message;
 
+	while ((sent = ATOMIC_LOAD(ring->sent)) == released)
+		if (channel_wait(channel, &ring->sent, sent, &ring->receiver_waiting, flags & BUS_NOWAIT))
+			return NULL;
+	channel->pending = 1;
+	return ring->messages[released % BUS_CHANNEL_SLOTS];
+}
+
+
+/**
+ * Close one end of a channel
+ * 
+ * @param   channel  The channel
+ * @return           0 on success, -1 on error
+ */
+int
+bus_channel_close(bus_channel_t *channel)
+{
+	close_channel_end(channel->memory, channel->end);
+	t(shmdt(channel->memory));
+	channel->memory = NULL;
+	return 0;
 fail:
-	saved_errno = errno;
-	if (state > 1)
-		release_semaphore(bus, S, SEM_UNDO);
-	if (state > 0)
-		acquire_semaphore(bus, W, SEM_UNDO);
-	if (state < 0)
-		bus->first_poll = 1;
-	errno = saved_errno;
-	return NULL;
+	return -1;
 }
 
 
 /**
- * Wait for a message to be broadcasted on the bus.
- * The caller should make a copy of the received message,
- * without freeing the original copy, and parse it in a
- * separate thread. When the new thread has started be
- * started, the caller of this function should then
- * either call `bus_poll_timed` again or `bus_poll_stop`.
+ * Listen on a bus, and pass the messages to a pool of worker threads
  * 
- * @param   bus      Bus information
- * @param   timeout  The time the operation shall fail with errno set
- *                   to `EAGAIN` if not completed
- * @param   clockid  The ID of the clock the `timeout` is measured with,
- *                   it most be a predictable clock
- * @return           The received message, `NULL` on error
+ * @param   bus        Bus information
+ * @param   callback   Function to call, from a worker thread, when a message
+ *                     is received, see `bus_read`, it is called once with
+ *                     `NULL` from the calling thread when it has started
+ *                     listening, and it may be called concurrently
+ * @param   user_data  Parameter passed to `callback`
+ * @param   workers    The number of worker threads
+ * @param   buffers    The number of message buffers
+ * @return             0 on success, -1 on error
  */
-const char *bus_poll_timed(bus_t *bus, const struct timespec *timeout, clockid_t clockid)
+int
+bus_dispatch(bus_t *bus, int (*callback)(const char *message, void *user_data),
+             void *user_data, size_t workers, size_t buffers)
 {
-	int state = 0, saved_errno;
-	struct timespec delta;
-	if (!timeout)
-		return bus_poll(bus, 0);
+	struct dispatcher dispatcher;
+	struct dispatch_buffer *buffer;
+	pthread_t *threads;
+	struct timespec until;
+	const char *message = NULL;
+	size_t i, created = 0, cells;
+	uint32_t index, used;
+	int r;
+
+	if (!workers || !buffers || buffers > UINT32_MAX / 2) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (cells = 1; cells < buffers; cells <<= 1);
+
+	memset(&dispatcher, 0, sizeof(dispatcher));
+	dispatcher.callback = callback;
+	dispatcher.user_data = user_data;
+	dispatcher.buffers = malloc(buffers * sizeof(*dispatcher.buffers));
+	dispatcher.queue = malloc(cells * sizeof(*dispatcher.queue));
+	threads = malloc(workers * sizeof(*threads));
+	if (!dispatcher.buffers || !dispatcher.queue || !threads)
+		goto fail;
+	for (i = 0; i < buffers; i++) {
+		dispatcher.buffers[i].dispatcher = &dispatcher;
+		dispatcher.buffers[i].next = i + 1 < buffers ? (uint32_t)i + 2 : 0;
+	}
+	dispatcher.pool = 1;
+	for (i = 0; i < cells; i++)
+		dispatcher.queue[i].sequence = (uint32_t)i;
+	dispatcher.mask = (uint32_t)cells - 1;
+	pthread_mutex_init(&dispatcher.lock, NULL);
+
+	if (bus_poll_start(bus)) {
+		pthread_mutex_destroy(&dispatcher.lock);
+		goto fail;
+	}
+	for (; created < workers; created++) {
+		r = pthread_create(&threads[created], NULL, dispatch_work, &dispatcher);
+		if (r) {
+			dispatch_stop(&dispatcher, 1, r);
+			break;
+		}
+	}
+	if (!ATOMIC_LOAD(dispatcher.stop)) {
+		r = callback(NULL, user_data);
+		if (r <= 0)
+			dispatch_stop(&dispatcher, r < 0, errno);
+	}
 
-	if (!bus->first_poll) {
-		t(release_semaphore(bus, W, SEM_UNDO));  state++;
-		t(acquire_semaphore(bus, S, SEM_UNDO));  state++;
-		t(zero_semaphore(bus, S, 0));
-#ifndef BUS_SEMAPHORES_ARE_SYNCHRONOUS_ME_HARDER
-		t(zero_semaphore(bus, N, 0));
-#endif
-		t(release_semaphore(bus, S, SEM_UNDO));  state--;
-		t(acquire_semaphore(bus, W, SEM_UNDO));  state--;
-		t(release_semaphore(bus, Q, 0));
-	} else {
-		bus->first_poll = 0;
+	while (!ATOMIC_LOAD(dispatcher.stop)) {
+		/* A message is acknowledged when the next one is polled,
+		 * so it is held back until a buffer has been taken. */
+		index = dispatch_take(&dispatcher);
+		buffer = &dispatcher.buffers[index];
+		do {
+			clock_gettime(CLOCK_MONOTONIC, &until);
+			until.tv_nsec += DISPATCH_CHECK_INTERVAL;
+			if (until.tv_nsec >= 1000000000L) {
+				until.tv_sec += 1;
+				until.tv_nsec -= 1000000000L;
+			}
+			message = bus_poll_timed(bus, &until, CLOCK_MONOTONIC);
+		} while (!message && (errno == EAGAIN || errno == EINTR) && !ATOMIC_LOAD(dispatcher.stop));
+		if (!message) {
+			if (!ATOMIC_LOAD(dispatcher.stop))
+				dispatch_stop(&dispatcher, 1, errno);
+			bus_dispatch_release(buffer->message);
+			break;
+		}
+		memcpy(buffer->message, message, strlen(message) + 1);
+		dispatch_enqueue(&dispatcher, index);
 	}
-	state--;
-	DELTA;
-	t(zero_semaphore_timed(bus, Q, 0, &delta));
-	return bus->message;
+
+	dispatch_stop(&dispatcher, 0, 0);
+	for (i = 0; i < created; i++)
+		pthread_join(threads[i], NULL);
+	if (bus_poll_stop(bus))
+		dispatch_stop(&dispatcher, 1, errno);
+
+	/* Messages that the callback function has
+	 * held must be released before returning. */
+	while ((used = ATOMIC_LOAD(dispatcher.used))) {
+		ATOMIC_STORE(dispatcher.polling_waiting, 1);
+		ATOMIC_FENCE();
+		if (ATOMIC_LOAD(dispatcher.used) == used)
+			map_wait(&dispatcher.used, used, NULL, 0);
+	}
+
+	pthread_mutex_destroy(&dispatcher.lock);
+	free(dispatcher.buffers);
+	free(dispatcher.queue);
+	free(threads);
+	if (dispatcher.failed) {
+		errno = dispatcher.error;
+		return -1;
+	}
+	return 0;
 
 fail:
-	saved_errno = errno;
-	if (state > 1)
-		release_semaphore(bus, S, SEM_UNDO);
-	if (state > 0)
-		acquire_semaphore(bus, W, SEM_UNDO);
-	if (state < 0)
-		bus->first_poll = 1;
-	errno = saved_errno;
-	return NULL;
+	free(dispatcher.buffers);
+	free(dispatcher.queue);
+	free(threads);
+	return -1;
+}
+
+
+/**
+ * Keep a message passed to the callback function of `bus_dispatch`
+ * 
+ * @param  message  The message
+ */
+void
+bus_dispatch_hold(const char *message)
+{
+	ATOMIC_ADD(DISPATCH_BUFFER(message)->references, 1);
+}
+
+
+/**
+ * Release a message held with `bus_dispatch_hold`
+ * 
+ * @param  message  The message
+ */
+void
+bus_dispatch_release(const char *message)
+{
+	struct dispatch_buffer *buffer = DISPATCH_BUFFER(message);
+	if (!ATOMIC_DECREMENT(buffer->references))
+		dispatch_return(buffer);
 }
 
 
@@ -1101,30 +6509,57 @@ fail:
 int
 bus_chown(const char *file, uid_t owner, gid_t group)
 {
-	bus_t bus;
+	bus_t bus, *part;
 	struct semid_ds sem_stat;
 	struct shmid_ds shm_stat;
-	int shm_id;
+	int shm_id, mapped, i, saved_errno, r;
+	char *journal;
+
+	clear_bus(&bus);
+	t(mapped = is_mapped(file));
+
+	/* The journal, if any, is owned like the bus. */
+	journal = journal_pathname(file);
+	if (!journal)
+		return -1;
+	r = chown(journal, owner, group);
+	saved_errno = errno;
+	free(journal);
+	if (r && saved_errno != ENOENT) {
+		errno = saved_errno;
+		return -1;
+	}
+
+	if (mapped)
+		return chown(file, owner, group);
 
 	t(bus_open(&bus, file, -1));
 	t(chown(file, owner, group));
 
-	/* chown sem */
-	t(open_semaphores(&bus));
-	t(semctl(bus.sem_id, 0, IPC_STAT, &sem_stat));
-	sem_stat.sem_perm.uid = owner;
-	sem_stat.sem_perm.gid = group;
-	t(semctl(bus.sem_id, 0, IPC_SET, &sem_stat));
-
-	/* chown shm */
-	t(shm_id = shmget(bus.key_shm, (size_t)BUS_MEMORY_SIZE, 0));
-	t(shmctl(shm_id, IPC_STAT, &shm_stat));
-	shm_stat.shm_perm.uid = owner;
-	shm_stat.shm_perm.gid = group;
-	t(shmctl(shm_id, IPC_SET, &shm_stat));
+	for (i = 0; i < bus.partitions; i++) {
+		part = bus.partition ? &bus.partition[i] : &bus;
+
+		/* chown sem */
+		t(open_semaphores(part));
+		t(semctl(part->sem_id, 0, IPC_STAT, &sem_stat));
+		sem_stat.sem_perm.uid = owner;
+		sem_stat.sem_perm.gid = group;
+		t(semctl(part->sem_id, 0, IPC_SET, &sem_stat));
+
+		/* chown shm */
+		t(shm_id = shmget(part->key_shm, (size_t)BUS_MEMORY_SIZE, 0));
+		t(shmctl(shm_id, IPC_STAT, &shm_stat));
+		shm_stat.shm_perm.uid = owner;
+		shm_stat.shm_perm.gid = group;
+		t(shmctl(shm_id, IPC_SET, &shm_stat));
+	}
 
+	free(bus.partition);
 	return 0;
 fail:
+	saved_errno = errno;
+	free(bus.partition);
+	errno = saved_errno;
 	return -1;
 }
 
@@ -1143,11 +6578,12 @@ fail:
 int
 bus_chmod(const char *file, mode_t mode)
 {
-	bus_t bus;
+	bus_t bus, *part;
 	mode_t fmode;
 	struct semid_ds sem_stat;
 	struct shmid_ds shm_stat;
-	int shm_id;
+	int shm_id, mapped, i, saved_errno, r;
+	char *journal;
 
 	mode = (mode & S_IRWXU) ? (mode | S_IRWXU) : (mode & (mode_t)~S_IRWXU);
 	mode = (mode & S_IRWXG) ? (mode | S_IRWXG) : (mode & (mode_t)~S_IRWXG);
@@ -1155,22 +6591,230 @@ bus_chmod(const char *file, mode_t mode)
 	mode &= (S_IWUSR | S_IWGRP | S_IWOTH | S_IRUSR | S_IRGRP | S_IROTH);
 	fmode = mode & (mode_t)~(S_IWGRP | S_IWOTH);
 
+	/* Listeners write to the file of a mapped bus,
+	 * and readers write to the journal, if any. */
+	clear_bus(&bus);
+	t(mapped = is_mapped(file));
+	journal = journal_pathname(file);
+	if (!journal)
+		return -1;
+	r = chmod(journal, mode);
+	saved_errno = errno;
+	free(journal);
+	if (r && saved_errno != ENOENT) {
+		errno = saved_errno;
+		return -1;
+	}
+	if (mapped)
+		return chmod(file, mode);
+
 	t(bus_open(&bus, file, -1));
 	t(chmod(file, fmode));
 
-	/* chmod sem */
-	t(open_semaphores(&bus));
-	t(semctl(bus.sem_id, 0, IPC_STAT, &sem_stat));
-	sem_stat.sem_perm.mode = (unsigned short)mode;
-	t(semctl(bus.sem_id, 0, IPC_SET, &sem_stat));
+	for (i = 0; i < bus.partitions; i++) {
+		part = bus.partition ? &bus.partition[i] : &bus;
+
+		/* chmod sem */
+		t(open_semaphores(part));
+		t(semctl(part->sem_id, 0, IPC_STAT, &sem_stat));
+		sem_stat.sem_perm.mode = (unsigned short)mode;
+		t(semctl(part->sem_id, 0, IPC_SET, &sem_stat));
+
+		/* chmod shm */
+		t(shm_id = shmget(part->key_shm, (size_t)BUS_MEMORY_SIZE, 0));
+		t(shmctl(shm_id, IPC_STAT, &shm_stat));
+		shm_stat.shm_perm.mode = (unsigned short)mode;
+		t(shmctl(shm_id, IPC_SET, &shm_stat));
+	}
+
+	free(bus.partition);
+	return 0;
+fail:
+	saved_errno = errno;
+	free(bus.partition);
+	errno = saved_errno;
+	return -1;
+}
 
-	/* chmod shm */
-	t(shm_id = shmget(bus.key_shm, (size_t)BUS_MEMORY_SIZE, 0));
+
+/**
+ * Get a snapshot of the internal state of a bus
+ * 
+ * The state is read without locking the bus, and is
+ * therefore only a best-effort snapshot if processes
+ * are using the bus
+ * 
+ * @param   bus    Bus information
+ * @param   state  Output parameter for the state of the bus
+ * @return         0 on success, -1 on error
+ */
+int
+bus_state(const bus_t *restrict bus, struct bus_state *restrict state)
+{
+	unsigned short values[MAX_SEMAPHORES];
+	struct semid_ds sem_stat;
+	struct shmid_ds shm_stat;
+	union semun arg;
+	int shm_id, i, reading, waiting_for_acks, acknowledging;
+
+	memset(state, 0, sizeof(*state));
+	if (bus->partition)
+		return partitioned_state(bus, state);
+	if (bus->map)
+		return map_state(bus, state);
+
+	arg.buf = &sem_stat;
+	t(semctl(bus->sem_id, 0, IPC_STAT, arg));
+	if (sem_stat.sem_nsems > MAX_SEMAPHORES) {
+		errno = EINVAL;
+		goto fail;
+	}
+	arg.array = values;
+	t(semctl(bus->sem_id, 0, GETALL, arg));
+	t(shm_id = shmget(bus->key_shm, (size_t)BUS_MEMORY_SIZE, 0));
 	t(shmctl(shm_id, IPC_STAT, &shm_stat));
-	shm_stat.shm_perm.mode = (unsigned short)mode;
-	t(shmctl(shm_id, IPC_SET, &shm_stat));
 
+	state->semaphore_count = (int)sem_stat.sem_nsems;
+	for (i = 0; i < state->semaphore_count; i++)
+		state->semaphores[i] = values[i];
+
+	/* A listener that is acknowledging a message holds P(S) until
+	 * every listener has done so, so those listeners are not
+	 * counted in S, but they are waiting for N (or S) to become 0.
+	 * The broadcasting process is also waiting for S to become 0. */
+	t(reading = semctl(bus->sem_id, Q, GETZCNT));
+	t(waiting_for_acks = semctl(bus->sem_id, S, GETZCNT));
+	waiting_for_acks = waiting_for_acks && !values[X];
+	if (bus->synchronous) {
+		t(i = semctl(bus->sem_id, S, GETZCNT));
+		acknowledging = i - waiting_for_acks;
+	} else {
+		t(acknowledging = semctl(bus->sem_id, N, GETZCNT));
+	}
+	state->listeners = (unsigned long)values[S] + (unsigned long)acknowledging;
+	state->waiting_listeners = (unsigned long)reading;
+	state->broadcasting = !values[X];
+	state->unacknowledged = waiting_for_acks ? (unsigned long)values[S] : 0;
+	state->acknowledging = (unsigned long)values[W];
+	t(i = semctl(bus->sem_id, X, GETNCNT));
+	state->waiting_writers = (unsigned long)i;
+
+	state->size = (size_t)shm_stat.shm_segsz;
+	state->attached = (unsigned long)shm_stat.shm_nattch;
+	state->uid = sem_stat.sem_perm.uid;
+	state->gid = sem_stat.sem_perm.gid;
+	state->mode = (mode_t)(sem_stat.sem_perm.mode & 0777);
+	state->creator = shm_stat.shm_cpid;
+	state->last_operation = sem_stat.sem_otime;
+	state->sequence = bus->control ? bus->control->sequence : 0;
+	state->synchronous = bus->synchronous;
+	state->slots = 1;
+	state->partitions = 1;
+	state->calls = pending_calls(bus);
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Get the statistics of a bus
+ * 
+ * The statistics are read without locking the bus, and
+ * are therefore not necessarily consistent with each
+ * other if processes are using the bus
+ * 
+ * @param   bus    Bus information
+ * @param   stats  Output parameter for the statistics
+ * @return         0 on success, -1 on error
+ */
+int
+bus_stats(const bus_t *restrict bus, struct bus_stats *restrict stats)
+{
+	struct bus_stats part;
+	int i;
+
+	if (bus->partition) {
+		t(bus_stats(&bus->partition[0], stats));
+		for (i = 1; i < bus->partitions; i++) {
+			t(bus_stats(&bus->partition[i], &part));
+			stats->messages += part.messages;
+			stats->bytes += part.bytes;
+			stats->failed += part.failed;
+			stats->deliveries += part.deliveries;
+			stats->expired += part.expired;
+			add_histogram(&stats->lock, &part.lock);
+			add_histogram(&stats->broadcast, &part.broadcast);
+			add_histogram(&stats->acknowledge, &part.acknowledge);
+		}
+		return 0;
+	}
+
+	if (!HAVE_STATS(bus)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	memcpy(stats, &bus->control->stats, sizeof(*stats));
 	return 0;
 fail:
 	return -1;
 }
+
+
+/**
+ * Get the listeners in the registry of a bus
+ * 
+ * The registry is read without locking the bus, and
+ * is therefore only a best-effort snapshot if
+ * processes are using the bus
+ * 
+ * @param   bus        Bus information
+ * @param   listeners  Output parameter for the listeners
+ * @param   n          The number of elements in `listeners`
+ * @return             The number of registered listeners, which
+ *                     may exceed `n`, in which case only the first
+ *                     `n` are stored, -1 on error
+ */
+int
+bus_listeners(const bus_t *restrict bus, struct bus_listener *restrict listeners, size_t n)
+{
+	const struct registry_slot *slot;
+	int i, r, count = 0;
+	int32_t pid;
+
+	if (bus->partition) {
+		for (i = 0; i < bus->partitions; i++) {
+			if ((size_t)count < n)
+				r = bus_listeners(&bus->partition[i], listeners + count, n - (size_t)count);
+			else
+				r = bus_listeners(&bus->partition[i], NULL, 0);
+			if (r < 0)
+				return -1;
+			count += r;
+		}
+		return count;
+	}
+
+	if (!HAVE_REGISTRY(bus)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	for (i = 0; i < BUS_REGISTRY_SLOTS; i++) {
+		slot = &bus->control->listeners[i];
+		if (!(pid = slot->pid))
+			continue;
+		if ((size_t)count < n) {
+			listeners[count].pid = (pid_t)pid;
+			listeners[count].alive = process_exists((pid_t)pid);
+			listeners[count].registered = slot->registered;
+			listeners[count].received = slot->received;
+			listeners[count].acknowledged = slot->acknowledged;
+			listeners[count].acknowledged_at = slot->acknowledged_at;
+		}
+		count++;
+	}
+
+	return count;
+}